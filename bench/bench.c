@@ -0,0 +1,798 @@
+#include "casync/casync.h"
+#include "casync/chan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Micro-benchmarks for the scheduler and the context switch. Results are
+ * written as JSON to stdout, or to the file given as the only argument, so
+ * they can be compared across releases:
+ *
+ *   {
+ *     "library": "casync", "version": "...", "arch": "...", "abi": "...",
+ *     "results": [
+ *       {"name": "...", "tasks": N, "ops": N, "ns_per_op": X}, ...
+ *     ]
+ *   }
+ *
+ * "tasks" is the number of tasks alive in the gather while measuring. The
+ * parallel_* results compare one worker against one worker per CPU, for
+ * co-routines that don't yield. The wake_latency_* results are the time from
+ * waking a co-routine until it runs, while busy co-routines keep yielding.
+ * The run_blocking_* results are the cost of handing a function that returns
+ * right away to the thread pool of casync_run_blocking() and back. The
+ * loop_submit result is the cost per co-routine another thread submits with
+ * casync_loop_submit(), until it ran. The *_shared_stack results are for
+ * co-routines started with casync_attr::shared_stack, whose stacks are copied
+ * whenever another one of them runs. The fan_out_* results are the cost per
+ * co-routine of gathering many short ones with fresh stacks, started one by
+ * one or with casync_gather_array(). The ring_traversal_dynamic* results
+ * compare stacks of their own against stacks packed into a huge page arena by
+ * casync_stack_arena().
+ *
+ * The results are not checked here. See tests/ for that.
+ */
+
+#if !defined(CASYNC_VERSION)
+#    define CASYNC_VERSION "unknown"
+#endif
+#if !defined(CASYNC_ARCH)
+#    define CASYNC_ARCH "unknown"
+#endif
+#if !defined(CASYNC_ABI)
+#    define CASYNC_ABI "unknown"
+#endif
+
+#if defined(CASYNC_UCONTEXT)
+/* Two ucontext_t live on a suspended stack, which are 1K each on x86_64 and
+ * 4.5K on AArch64 */
+#    define SMALL_STACK_SIZE (1024 * 16)
+#else
+#    define SMALL_STACK_SIZE (1024 * 2)
+#endif
+#define LARGE_STACK_SIZE (1024 * 64)
+#define MAX_RESULTS      64
+#define OPS              100000
+#define SPAWN_COUNT      1000
+#define PARALLEL_JOBS    256
+#define PARALLEL_WORK    200000
+#define LATENCY_BULK     1000
+#define LATENCY_WAKES    1000
+#define BLOCKING_CALLS   1000
+#define FAN_OUT_COUNT    10000
+#define ARENA_TASKS      10000
+
+struct result
+{
+    const char* name;
+    size_t      tasks;
+    size_t      ops;
+    double      ns_per_op;
+};
+
+struct ring
+{
+    size_t   members;
+    size_t   rounds;
+    uint64_t start;
+    uint64_t end;
+};
+
+struct latency
+{
+    struct casync_wait_queue waiters;
+    int                      priority;
+    uint64_t                 woken_at;
+    uint64_t                 total_ns;
+    size_t                   wakes;
+};
+
+struct scale
+{
+    size_t   live;
+    double   spawn_ns;
+    double   finish_ns;
+    uint64_t first_finish;
+    uint64_t last_finish;
+};
+
+static struct result results[MAX_RESULTS];
+static int           result_count;
+static volatile int  stop;
+
+/* -------------------------------------------------------------------------- */
+static void report(const char* name, size_t tasks, size_t ops, double ns)
+{
+    if (result_count == MAX_RESULTS)
+        return;
+    results[result_count].name = name;
+    results[result_count].tasks = tasks;
+    results[result_count].ops = ops;
+    results[result_count].ns_per_op = ns / (double)ops;
+    result_count++;
+}
+
+/* -------------------------------------------------------------------------- */
+static int run_static(
+    size_t stack_size, size_t stack_count, int (*function)(void*), void* arg)
+{
+    void*               stacks = malloc(stack_count * stack_size);
+    struct casync_task* freelist;
+
+    if (stacks == NULL)
+        return -1;
+
+    freelist = casync_stack_pool_init_linear(stacks, stack_size, stack_count);
+    stop = 0;
+    casync_gather_static(freelist, 1, function, arg);
+
+    free(stacks);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int nop(void* arg)
+{
+    (void)arg;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int idle(void* arg)
+{
+    (void)arg;
+    while (!stop)
+        casync_yield();
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int ring_driver(void* arg)
+{
+    struct ring* r = arg;
+    size_t       i;
+
+    /* Let every member start first, so only switches are measured */
+    casync_yield();
+
+    r->start = casync_clock_ns();
+    for (i = 0; i != r->rounds; ++i)
+        casync_yield();
+    r->end = casync_clock_ns();
+
+    stop = 1;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int ring_spawner(void* arg)
+{
+    struct ring* r = arg;
+    size_t       i;
+
+    for (i = 0; i != r->members; ++i)
+        casync_start_static(idle, NULL);
+    return ring_driver(r);
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_ring(size_t tasks)
+{
+    struct ring r;
+    size_t      switches;
+
+    /* Keep the total number of switches roughly constant */
+    r.rounds = tasks < 1000 ? OPS / tasks : 10;
+    r.members = tasks - 1;
+    if (run_static(SMALL_STACK_SIZE, tasks + 1, ring_spawner, &r) != 0)
+        return;
+
+    /* Each round switches through every task and the control task once */
+    switches = r.rounds * (tasks + 1);
+    report("ring_traversal", tasks, switches, (double)(r.end - r.start));
+
+    if (tasks == 2)
+        report(
+            "yield_round_trip",
+            tasks,
+            r.rounds,
+            (double)(r.end - r.start));
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_fpu(const char* name, int fpu)
+{
+    struct casync_attr attr;
+    struct ring        r;
+
+    memset(&attr, 0, sizeof attr);
+    attr.stack_size = LARGE_STACK_SIZE;
+    attr.fpu = fpu;
+    r.rounds = OPS;
+    r.members = 1;
+    stop = 0;
+    casync_gather_ex(2, &attr, idle, NULL, &attr, ring_driver, &r);
+    report(name, 2, r.rounds, (double)(r.end - r.start));
+}
+
+/* -------------------------------------------------------------------------- */
+static int dynamic_spawner(void* arg)
+{
+    struct ring*       r = arg;
+    struct casync_attr attr;
+    size_t             i;
+
+    memset(&attr, 0, sizeof attr);
+    attr.stack_size = SMALL_STACK_SIZE;
+    for (i = 0; i != r->members; ++i)
+        casync_start_ex(&attr, idle, NULL);
+    return ring_driver(r);
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_arena(const char* name, size_t tasks, int flags)
+{
+    struct ring r;
+
+    /* Stacks of their own take at least two pages each, one of which is the
+     * guard page. The arena packs them into huge pages */
+    r.rounds = 10;
+    r.members = tasks - 1;
+    stop = 0;
+    casync_stack_arena(flags);
+    casync_gather(1, dynamic_spawner, &r);
+    casync_stack_arena(0);
+    casync_stack_cache_flush();
+    report(name, tasks, r.rounds * (tasks + 1), (double)(r.end - r.start));
+}
+
+/* -------------------------------------------------------------------------- */
+static int shared_spawner(void* arg)
+{
+    struct ring*       r = arg;
+    struct casync_attr attr;
+    size_t             i;
+
+    memset(&attr, 0, sizeof attr);
+    attr.shared_stack = 1;
+    for (i = 0; i != r->members; ++i)
+        casync_start_ex(&attr, idle, NULL);
+    return ring_driver(r);
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_shared(size_t tasks)
+{
+    struct casync_attr attr;
+    struct ring        r;
+
+    /* Every switch between two of them copies both stacks */
+    memset(&attr, 0, sizeof attr);
+    attr.shared_stack = 1;
+    r.rounds = tasks < 1000 ? OPS / tasks : 10;
+    r.members = tasks - 1;
+    stop = 0;
+    casync_gather_ex(1, &attr, shared_spawner, &r);
+    report(
+        tasks == 2 ? "yield_round_trip_shared_stack"
+                   : "ring_traversal_shared_stack",
+        tasks,
+        tasks == 2 ? r.rounds : r.rounds * (tasks + 1),
+        (double)(r.end - r.start));
+}
+
+/* -------------------------------------------------------------------------- */
+static int spawn_finish_static(void* arg)
+{
+    uint64_t t0, t1;
+    size_t   i;
+    (void)arg;
+
+    t0 = casync_clock_ns();
+    for (i = 0; i != OPS; ++i)
+    {
+        casync_start_static(nop, NULL);
+        casync_yield();
+    }
+    t1 = casync_clock_ns();
+    report("spawn_finish_static", 1, OPS, (double)(t1 - t0));
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int spawn_finish(void* arg)
+{
+    uint64_t t0, t1;
+    size_t   i;
+    (void)arg;
+
+    t0 = casync_clock_ns();
+    for (i = 0; i != OPS; ++i)
+    {
+        casync_start(nop, NULL);
+        casync_yield();
+    }
+    t1 = casync_clock_ns();
+    report("spawn_finish", 1, OPS, (double)(t1 - t0));
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int nested_gather_static(void* arg)
+{
+    static size_t       stacks[LARGE_STACK_SIZE / sizeof(size_t)];
+    struct casync_task* freelist;
+    uint64_t            t0, t1;
+    size_t              i;
+    (void)arg;
+
+    t0 = casync_clock_ns();
+    for (i = 0; i != OPS; ++i)
+    {
+        freelist = casync_stack_pool_init_linear(stacks, sizeof(stacks), 1);
+        casync_gather_static(freelist, 1, nop, NULL);
+    }
+    t1 = casync_clock_ns();
+    report("nested_gather_static", 1, OPS, (double)(t1 - t0));
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int nested_gather(void* arg)
+{
+    uint64_t t0, t1;
+    size_t   i;
+    (void)arg;
+
+    t0 = casync_clock_ns();
+    for (i = 0; i != OPS / 10; ++i)
+        casync_gather(1, nop, NULL);
+    t1 = casync_clock_ns();
+    report("nested_gather", 1, OPS / 10, (double)(t1 - t0));
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int chan_producer(void* arg)
+{
+    struct casync_chan* chan = arg;
+    size_t              i;
+    for (i = 0; i != OPS; ++i)
+        casync_chan_send(chan, &i);
+    casync_chan_close(chan);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int chan_consumer(void* arg)
+{
+    struct casync_chan* chan = arg;
+    size_t              item;
+    while (casync_chan_recv(chan, &item) == 0)
+    {
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int chan_batch_producer(void* arg)
+{
+    struct casync_chan* chan = arg;
+    size_t              items[64];
+    size_t              i;
+    for (i = 0; i != 64; ++i)
+        items[i] = i;
+    for (i = 0; i != OPS / 64; ++i)
+        casync_chan_send_many(chan, items, 64);
+    casync_chan_close(chan);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int chan_batch_consumer(void* arg)
+{
+    struct casync_chan* chan = arg;
+    size_t              items[64];
+    while (casync_chan_recv_many(chan, items, 64) > 0)
+    {
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_chan(
+    const char* name,
+    size_t      capacity,
+    size_t      ops,
+    int (*producer)(void*),
+    int (*consumer)(void*))
+{
+    struct casync_chan* chan = casync_chan_create(sizeof(size_t), capacity);
+    uint64_t            t0, t1;
+    if (chan == NULL)
+        return;
+
+    t0 = casync_clock_ns();
+    casync_gather(2, consumer, chan, producer, chan);
+    t1 = casync_clock_ns();
+    report(name, 2, ops, (double)(t1 - t0));
+
+    casync_chan_destroy(chan);
+}
+
+/* -------------------------------------------------------------------------- */
+static int fan_out_starter(void* arg)
+{
+    const struct casync_spawn* spawns = arg;
+    size_t                     i;
+
+    for (i = 0; i != FAN_OUT_COUNT; ++i)
+        casync_start_ex(spawns[i].attr, spawns[i].function, spawns[i].arg);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_fan_out(void)
+{
+    struct casync_spawn* spawns = malloc(FAN_OUT_COUNT * sizeof *spawns);
+    struct casync_attr   attr;
+    uint64_t             t0, t1;
+    size_t               i;
+
+    if (spawns == NULL)
+        return;
+    memset(&attr, 0, sizeof attr);
+    attr.stack_size = SMALL_STACK_SIZE;
+    for (i = 0; i != FAN_OUT_COUNT; ++i)
+    {
+        spawns[i].attr = &attr;
+        spawns[i].function = nop;
+        spawns[i].arg = NULL;
+    }
+
+    /* Both start with an empty stack cache, so every stack is mapped */
+    casync_stack_cache_flush();
+    t0 = casync_clock_ns();
+    casync_gather(1, fan_out_starter, spawns);
+    t1 = casync_clock_ns();
+    report("fan_out_start", FAN_OUT_COUNT, FAN_OUT_COUNT, (double)(t1 - t0));
+
+    casync_stack_cache_flush();
+    t0 = casync_clock_ns();
+    casync_gather_array(spawns, FAN_OUT_COUNT);
+    t1 = casync_clock_ns();
+    report("fan_out_array", FAN_OUT_COUNT, FAN_OUT_COUNT, (double)(t1 - t0));
+
+    casync_stack_cache_flush();
+    free(spawns);
+}
+
+/* -------------------------------------------------------------------------- */
+static int quick(void* arg)
+{
+    struct scale* s = arg;
+    if (s->first_finish == 0)
+        s->first_finish = casync_clock_ns();
+    s->last_finish = casync_clock_ns();
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int live_driver(void* arg)
+{
+    struct scale* s = arg;
+    uint64_t      t0, t1;
+    size_t        i;
+
+    for (i = 0; i != s->live; ++i)
+        casync_start_static(idle, NULL);
+    casync_yield();
+
+    t0 = casync_clock_ns();
+    for (i = 0; i != SPAWN_COUNT; ++i)
+        casync_start_static(quick, s);
+    t1 = casync_clock_ns();
+    s->spawn_ns = (double)(t1 - t0);
+
+    /* The quick tasks are adjacent in the ring, so they run back to back */
+    casync_yield();
+    s->finish_ns = (double)(s->last_finish - s->first_finish);
+
+    stop = 1;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_live(size_t live)
+{
+    struct scale s;
+    s.live = live;
+    s.first_finish = 0;
+    if (run_static(SMALL_STACK_SIZE, live + SPAWN_COUNT + 1, live_driver, &s) !=
+        0)
+        return;
+
+    report("spawn_with_live_tasks", live, SPAWN_COUNT, s.spawn_ns);
+    report("finish_with_live_tasks", live, SPAWN_COUNT - 1, s.finish_ns);
+}
+
+/* -------------------------------------------------------------------------- */
+static int latency_checker(void* arg)
+{
+    struct latency* l = arg;
+    while (l->wakes != LATENCY_WAKES)
+    {
+        casync_wait_queue_park(&l->waiters);
+        l->total_ns += casync_clock_ns() - l->woken_at;
+        l->wakes++;
+    }
+    stop = 1;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int latency_waker(void* arg)
+{
+    struct latency* l = arg;
+    while (!stop)
+    {
+        l->woken_at = casync_clock_ns();
+        casync_wait_queue_wake(&l->waiters);
+        casync_yield();
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int latency_spawner(void* arg)
+{
+    struct latency*    l = arg;
+    struct casync_attr attr;
+    size_t             i;
+
+    memset(&attr, 0, sizeof attr);
+    attr.stack_size = 16 * 1024;
+    for (i = 0; i != LATENCY_BULK; ++i)
+        casync_start_ex(&attr, idle, NULL);
+    casync_start_ex(&attr, latency_waker, l);
+    attr.priority = l->priority;
+    casync_start_ex(&attr, latency_checker, l);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_latency(const char* name, int priority)
+{
+    struct latency l;
+    memset(&l, 0, sizeof l);
+    l.priority = priority;
+    stop = 0;
+    casync_gather(1, latency_spawner, &l);
+    report(name, LATENCY_BULK + 2, l.wakes, (double)l.total_ns);
+}
+
+#if defined(CASYNC_THREADS)
+/* -------------------------------------------------------------------------- */
+static int cpu_bound(void* arg)
+{
+    volatile size_t sum = 0;
+    size_t          i;
+    (void)arg;
+    for (i = 0; i != PARALLEL_WORK; ++i)
+        sum += i;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int cpu_bound_spawner(void* arg)
+{
+    struct casync_attr attr;
+    size_t             i;
+    (void)arg;
+
+    memset(&attr, 0, sizeof attr);
+    attr.stack_size = 16 * 1024;
+    for (i = 0; i != PARALLEL_JOBS; ++i)
+        casync_start_ex(&attr, cpu_bound, NULL);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_parallel(const char* name, int workers)
+{
+    uint64_t t0, t1;
+    t0 = casync_clock_ns();
+    casync_gather_parallel(workers, 1, cpu_bound_spawner, NULL);
+    t1 = casync_clock_ns();
+    report(name, PARALLEL_JOBS, PARALLEL_JOBS, (double)(t1 - t0));
+}
+
+/* -------------------------------------------------------------------------- */
+static int blocking_caller(void* arg)
+{
+    size_t i;
+    (void)arg;
+    for (i = 0; i != BLOCKING_CALLS; ++i)
+        casync_run_blocking(nop, NULL);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int blocking_spawner(void* arg)
+{
+    size_t*            callers = arg;
+    struct casync_attr attr;
+    size_t             i;
+
+    memset(&attr, 0, sizeof attr);
+    attr.stack_size = 16 * 1024;
+    for (i = 0; i != *callers; ++i)
+        casync_start_ex(&attr, blocking_caller, NULL);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_blocking(const char* name, size_t callers)
+{
+    uint64_t t0, t1;
+
+    /* Start the pool's threads first */
+    casync_gather(1, blocking_spawner, &callers);
+    t0 = casync_clock_ns();
+    casync_gather(1, blocking_spawner, &callers);
+    t1 = casync_clock_ns();
+    report(name, callers, callers * BLOCKING_CALLS, (double)(t1 - t0));
+}
+
+/* -------------------------------------------------------------------------- */
+struct submit_state
+{
+    struct casync_loop* loop;
+    size_t              ran;
+};
+
+/* -------------------------------------------------------------------------- */
+static int submitted(void* arg)
+{
+    struct submit_state* s = arg;
+    if (++s->ran == OPS)
+        casync_loop_close(s->loop);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int submit_producer(void* arg)
+{
+    struct submit_state* s = arg;
+    size_t               i;
+    for (i = 0; i != OPS; ++i)
+        casync_loop_submit(s->loop, submitted, s);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int submit_driver(void* arg)
+{
+    /* The pool's thread is the other thread */
+    return casync_run_blocking(submit_producer, arg);
+}
+
+/* -------------------------------------------------------------------------- */
+static int submit_server(void* arg)
+{
+    struct submit_state* s = arg;
+    s->loop = casync_loop_current();
+    casync_start(submit_driver, s);
+    return casync_loop_serve();
+}
+
+/* -------------------------------------------------------------------------- */
+static void bench_submit(void)
+{
+    struct submit_state s;
+    uint64_t            t0, t1;
+
+    memset(&s, 0, sizeof s);
+    t0 = casync_clock_ns();
+    casync_gather(1, submit_server, &s);
+    t1 = casync_clock_ns();
+    report("loop_submit", 2, s.ran, (double)(t1 - t0));
+}
+#endif
+
+/* -------------------------------------------------------------------------- */
+static void write_json(FILE* fp)
+{
+    int i;
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"library\": \"casync\",\n");
+    fprintf(fp, "  \"version\": \"%s\",\n", CASYNC_VERSION);
+    fprintf(fp, "  \"arch\": \"%s\",\n", CASYNC_ARCH);
+    fprintf(fp, "  \"abi\": \"%s\",\n", CASYNC_ABI);
+    fprintf(fp, "  \"results\": [\n");
+    for (i = 0; i != result_count; ++i)
+        fprintf(
+            fp,
+            "    {\"name\": \"%s\", \"tasks\": %zu, \"ops\": %zu, "
+            "\"ns_per_op\": %.2f}%s\n",
+            results[i].name,
+            results[i].tasks,
+            results[i].ops,
+            results[i].ns_per_op,
+            i + 1 == result_count ? "" : ",");
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+}
+
+/* -------------------------------------------------------------------------- */
+int main(int argc, char** argv)
+{
+    static const size_t ring_sizes[] = {1, 2, 100, 10000, 1000000};
+    static const size_t live_counts[] = {10, 1000, 100000, 1000000};
+    size_t              i;
+    FILE*               fp = stdout;
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-'))
+    {
+        fprintf(stderr, "usage: %s [output.json]\n", argv[0]);
+        return -1;
+    }
+
+    /* Resolve the lazy binding of the clock now. The dynamic linker saves
+     * the full register state on the stack, which doesn't fit into the tiny
+     * stacks used here */
+    casync_clock_ns();
+
+    for (i = 0; i != sizeof(ring_sizes) / sizeof(*ring_sizes); ++i)
+        bench_ring(ring_sizes[i]);
+
+    bench_fpu("yield_round_trip_fpu_none", CASYNC_FPU_NONE);
+    bench_fpu("yield_round_trip_fpu_control", CASYNC_FPU_CONTROL);
+    bench_fpu("yield_round_trip_fpu_full", CASYNC_FPU_FULL);
+    bench_shared(2);
+    bench_shared(1000);
+    bench_arena("ring_traversal_dynamic", ARENA_TASKS, 0);
+    bench_arena(
+        "ring_traversal_dynamic_arena", ARENA_TASKS, CASYNC_ARENA_HUGE_PAGES);
+
+    run_static(LARGE_STACK_SIZE, 2, spawn_finish_static, NULL);
+    casync_gather(1, spawn_finish, NULL);
+    run_static(LARGE_STACK_SIZE, 1, nested_gather_static, NULL);
+    casync_gather(1, nested_gather, NULL);
+
+    for (i = 0; i != sizeof(live_counts) / sizeof(*live_counts); ++i)
+        bench_live(live_counts[i]);
+    bench_fan_out();
+
+    bench_chan("chan_send_recv", 1, OPS, chan_producer, chan_consumer);
+    bench_chan(
+        "chan_send_recv_many",
+        64,
+        OPS / 64 * 64,
+        chan_batch_producer,
+        chan_batch_consumer);
+
+    bench_latency("wake_latency_normal", CASYNC_PRIORITY_NORMAL);
+    bench_latency("wake_latency_high", CASYNC_PRIORITY_HIGH);
+
+#if defined(CASYNC_THREADS)
+    bench_parallel("parallel_cpu_bound_1_worker", 1);
+    bench_parallel("parallel_cpu_bound_all_cpus", 0);
+    bench_blocking("run_blocking_round_trip", 1);
+    bench_blocking("run_blocking_concurrent", 64);
+    bench_submit();
+#endif
+
+    if (argc > 1 && (fp = fopen(argv[1], "w")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        return -1;
+    }
+    write_json(fp);
+    if (fp != stdout)
+        fclose(fp);
+
+    return 0;
+}
@@ -1,4 +1,4 @@
-#include "casync/casync.h"
+#include "casync/net.h"
 
 #if defined(_WIN32)
 #    define WIN32_LEAN_AND_MEAN
@@ -25,6 +25,9 @@
 #define PORT    "8080"
 #define BACKLOG 10
 
+/* Clients that stay silent for longer are dropped */
+#define CLIENT_IDLE_TIMEOUT_MS 30000
+
 #if defined(_MSC_VER)
 #    define ALIGNED(x)
 #else
@@ -78,57 +81,29 @@ static int async_accept(
     int fd, struct sockaddr_storage* addr, socklen_t* __restrict addr_len)
 {
     char s[INET6_ADDRSTRLEN];
+    int  new_fd = casync_accept(fd, (struct sockaddr*)addr, addr_len);
 
-    while (1)
+    if (new_fd != -1)
     {
-        int new_fd = accept(fd, (struct sockaddr*)addr, addr_len);
-        if (new_fd == -1 &&
-#if defined(_WIN32)
-            (WSAGetLastError() == WSAEWOULDBLOCK ||
-             WSAGetLastError() == WSAEINPROGRESS))
-#else
-            (errno == EAGAIN || errno == EWOULDBLOCK))
-#endif
-        {
-            casync_yield();
-            continue;
-        }
-
-        if (new_fd != -1)
-        {
-            inet_ntop(
-                addr->ss_family,
-                &((struct sockaddr_in*)addr)->sin_addr,
-                s,
-                sizeof s);
-            fprintf(stderr, "server: got connection from %s\n", s);
-        }
-
-        return new_fd;
+        inet_ntop(
+            addr->ss_family,
+            &((struct sockaddr_in*)addr)->sin_addr,
+            s,
+            sizeof s);
+        fprintf(stderr, "server: got connection from %s\n", s);
     }
+
+    return new_fd;
 }
 
 static int async_recv(int fd, void* buf, size_t n, int flags)
 {
-    while (1)
-    {
-        int rc = recv(fd, buf, n, flags);
-        if (rc == -1 &&
-#if defined(_WIN32)
-            (WSAGetLastError() == WSAEWOULDBLOCK ||
-             WSAGetLastError() == WSAEINPROGRESS))
-#else
-            (errno == EWOULDBLOCK || errno == EAGAIN))
-#endif
-        {
-            casync_yield();
-            continue;
-        }
+    int rc = casync_recv(fd, buf, n, flags);
 
-        if (rc == -1)
-            log_err("client: recv() failed: %s\n", strerror(errno));
-        return rc;
-    }
+    /* Canceled by the idle deadline, which the caller reports */
+    if (rc == -1 && errno != ECANCELED)
+        log_err("client: recv() failed: %s\n", strerror(errno));
+    return rc;
 }
 
 static int handle_client(void* arg)
@@ -139,7 +114,14 @@ static int handle_client(void* arg)
 
     while (1)
     {
+        casync_set_deadline(
+            casync_clock_ns() + (uint64_t)CLIENT_IDLE_TIMEOUT_MS * 1000000);
         rc = async_recv(fd, buf, 64 - 1, 0);
+        if (rc == -1 && errno == ECANCELED)
+        {
+            fprintf(stderr, "server: Client idle, disconnecting\n");
+            break;
+        }
         if (rc <= 0)
             break;
 
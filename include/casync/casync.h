@@ -5,6 +5,81 @@
 
 struct casync_task;
 
+/*!
+ * @brief Returned by calls that wait, if the calling co-routine was canceled
+ * with casync_cancel(), or its deadline or the timeout of its gather passed.
+ */
+#define CASYNC_ECANCELED (-2)
+
+/*!
+ * @brief Priority levels for casync_attr::priority. As long as every
+ * co-routine of a gather has normal priority, co-routines take turns in the
+ * order they became runnable. Otherwise, each scheduling round only runs the
+ * highest level that has runnable co-routines, and a co-routine that is woken
+ * while a lower level is running runs at the next casync_yield() of the
+ * running co-routine. To prevent starvation, a lower level that was passed
+ * over for 4 rounds per level of difference joins the next round.
+ */
+#define CASYNC_PRIORITY_LOW    (-1)
+#define CASYNC_PRIORITY_NORMAL 0
+#define CASYNC_PRIORITY_HIGH   1
+
+/*!
+ * @brief FPU and SIMD state saved on every switch, for casync_attr::fpu.
+ * Saving the control words (MXCSR and the x87 control word) is the default,
+ * as the ABI requires, so rounding modes and exception masks don't leak
+ * between co-routines. A co-routine that never changes them can save a few
+ * cycles per switch with CASYNC_FPU_NONE. CASYNC_FPU_FULL saves the x87, SSE,
+ * AVX and AVX-512 registers with XSAVEOPT, or XSAVE on older CPUs, into an
+ * area at the top of the stack. Only code that keeps state in registers across
+ * casync_yield() behind the compiler's back needs it, e.g. hand-written
+ * assembly. It falls back to CASYNC_FPU_CONTROL if the OS doesn't enable
+ * XSAVE, if the area would take more than half of the stack, and on AArch64,
+ * where it isn't implemented yet and the control word is FPCR. The portable
+ * ucontext backend ignores the mode and saves whatever swapcontext() saves.
+ */
+#define CASYNC_FPU_CONTROL 0
+#define CASYNC_FPU_NONE    1
+#define CASYNC_FPU_FULL    2
+
+/*!
+ * @brief Optional attributes of a co-routine, used by casync_start_ex() and
+ * casync_gather_ex(). Zero-initialize the struct and only set the fields you
+ * care about, so new fields keep their defaults.
+ */
+struct casync_attr
+{
+    /*! Minimum stack size in bytes. 0 selects the default of 1 MiB. Leaf
+     * co-routines that don't call deep into other libraries get away with a
+     * lot less, e.g. 16 KiB. */
+    size_t stack_size;
+
+    /*! Name for debugging, returned by casync_name(). The string isn't copied
+     * and must outlive the co-routine. */
+    const char* name;
+
+    /*! One of the CASYNC_PRIORITY_* levels, 0 is normal. */
+    int priority;
+
+    /*! If not 0, the co-routine is canceled this many nanoseconds after it
+     * starts, see casync_set_deadline(). */
+    uint64_t timeout_ns;
+
+    /*! One of the CASYNC_FPU_* modes, 0 saves the control words. */
+    int fpu;
+
+    /*! If not 0, the co-routine runs on a stack it shares with the other such
+     * co-routines of its thread, and stack_size is ignored. While it is
+     * suspended, only the part of the stack it uses is kept, in a buffer of
+     * its own. That suits large numbers of idle co-routines with shallow
+     * stacks. Its locals move in the meantime, so other co-routines and
+     * threads must not be handed pointers to them, and it can't call
+     * casync_gather(). casync_run_blocking() calls the function directly, and
+     * CASYNC_FPU_FULL saves the control words instead. Ignored by the
+     * ucontext backend. */
+    int shared_stack;
+};
+
 /*!
  * @brief Transfers control to another co-routine. This is typically called
  * when waiting on an I/O operation. For example:
@@ -18,13 +93,21 @@ struct casync_task;
  */
 extern void casync_yield(void);
 
+#if defined(CASYNC_STATS) || defined(CASYNC_TRACE)
+/* Records the switch before calling the real casync_yield(), see stats.h and
+ * trace.h */
+void casync_yield_instrumented(void);
+#    define casync_yield casync_yield_instrumented
+#endif
+
 /*!
  * @brief Runs a set of co-routines until all complete.
  *
  * In the _static version, each co-routine allocates its stack from a pool of
  * static memory. You can create a freelist from a pool of memory with @see
- * casync_stack_pool_init_linear. In the normal version, the memory is
- * allocated using malloc() and freed before the function returns.
+ * casync_stack_pool_init_linear. In the normal version, the memory is taken
+ * from the calling thread's stack cache and returned to it before the function
+ * returns.
  *
  * @param[in] n The number of co-routines to gather. Each co-routine expects a
  * function pointer followed by a user-pointer, which is passed to the
@@ -45,18 +128,262 @@ extern void casync_yield(void);
 int casync_gather_static(struct casync_task* freelist, int n, ...);
 int casync_gather(int n, ...);
 
+/*!
+ * @brief Same as casync_gather(), except each co-routine is given attributes.
+ * Each co-routine expects a pointer to its attributes, which may be NULL for
+ * the defaults, followed by the function pointer and the user-pointer:
+ *
+ *   ```c
+ *   struct casync_attr leaf = {16 * 1024};
+ *   struct casync_attr parser = {2 * 1024 * 1024, "parser"};
+ *   casync_gather_ex(2,
+ *     &leaf, my_coroutine_1, &arg1,
+ *     &parser, my_coroutine_2, &arg2);
+ *   ```
+ */
+int casync_gather_ex(int n, ...);
+
+/*!
+ * @brief Same as casync_gather(), except all co-routines that are still
+ * running after timeout_ns nanoseconds are canceled, including ones started
+ * with casync_start() and co-routines of nested gathers. The call still
+ * returns only once every co-routine has returned.
+ * @return Returns CASYNC_ECANCELED if the timeout passed, or if the gather
+ * was canceled through the co-routine that called it.
+ */
+int casync_gather_timeout(uint64_t timeout_ns, int n, ...);
+
+/*!
+ * @brief A co-routine to start with casync_gather_array() or
+ * casync_start_many().
+ */
+struct casync_spawn
+{
+    const struct casync_attr* attr; /* May be NULL for the defaults */
+    int (*function)(void*);
+    void* arg;
+};
+
+/*!
+ * @brief Same as casync_gather_ex(), except the co-routines are given as an
+ * array, e.g. to fan out a query to thousands of shards:
+ *
+ *   ```c
+ *   for (i = 0; i != shard_count; ++i)
+ *   {
+ *     spawns[i].attr = &leaf;
+ *     spawns[i].function = query_shard;
+ *     spawns[i].arg = &shards[i];
+ *   }
+ *   casync_gather_array(spawns, shard_count);
+ *   ```
+ *
+ * Stacks of the same size that the stack cache can't provide are mapped in
+ * one block, and the co-routines are scheduled in one go.
+ */
+int casync_gather_array(const struct casync_spawn* spawns, size_t n);
+
+/*!
+ * @brief Same as casync_gather(), except the co-routines are spread across a
+ * pool of worker threads. Each worker runs its own scheduler. Co-routines
+ * started with casync_start() from inside one of them are queued on the
+ * worker, and workers that run out of work steal queued co-routines from the
+ * others. A co-routine that has started stays on its worker until it returns.
+ *
+ * Co-routines on different workers run at the same time, so shared data needs
+ * the usual synchronization.
+ *
+ * @param[in] workers Number of worker threads, including the calling thread.
+ * 0 or less uses one worker per CPU.
+ * @note Only available when casync is built with CASYNC_THREADS.
+ */
+int casync_gather_parallel(int workers, int n, ...);
+
+/*!
+ * @brief The scheduler of the outermost casync_gather() running on a thread.
+ */
+struct casync_loop;
+
+/*!
+ * @brief Returns the loop of the calling thread's outermost casync_gather(),
+ * for casync_loop_submit() from other threads, or NULL outside of one.
+ */
+struct casync_loop* casync_loop_current(void);
+
+/*!
+ * @brief Starts a co-routine in a loop running on another thread. May be
+ * called from any thread, without taking locks. The loop starts submitted
+ * co-routines in batches, in the order they were submitted, at the start of
+ * its next round. If it is sleeping in the reactor, it is woken, as long as
+ * one of its co-routines is in casync_loop_serve(). If the loop has no memory
+ * for the co-routine's stack, it keeps trying at the start of each round.
+ *
+ * The loop must belong to casync_gather() or one of its variants that
+ * allocate stacks, not casync_gather_static(). It must still be running:
+ * stop submitting before calling casync_loop_close().
+ * @return Returns 0 on success, -1 if out of memory.
+ * @note Only available when casync is built with CASYNC_THREADS.
+ */
+int casync_loop_submit(
+    struct casync_loop* loop, int (*function)(void*), void* arg);
+
+/*!
+ * @brief Keeps the calling co-routine's loop running while waiting for
+ * submissions from other threads, until casync_loop_close() is called. Only
+ * one co-routine per loop may serve at a time. For example, with one loop per
+ * thread and an acceptor thread handing out connections:
+ *
+ *   ```c
+ *   static int loop_main(void* arg)
+ *   {
+ *       struct worker* w = arg;
+ *       w->loop = casync_loop_current();
+ *       ... tell the acceptor about w->loop ...
+ *       return casync_loop_serve();
+ *   }
+ *   ```
+ *
+ * @return Returns 0 once the loop was closed, -1 on error, or
+ * CASYNC_ECANCELED if the co-routine was canceled. After an error or
+ * cancellation, the loop may finish at any time, so other threads must no
+ * longer use it.
+ * @note On Windows, this returns -1 for now.
+ */
+int casync_loop_serve(void);
+
+/*!
+ * @brief Lets casync_loop_serve() return, so the loop finishes once its
+ * remaining co-routines have. May be called from any thread, once per loop.
+ * A closed loop stays closed.
+ */
+void casync_loop_close(struct casync_loop* loop);
+
+/*!
+ * @brief Calls a function that blocks, e.g. getaddrinfo() or fsync(), on a
+ * pool of threads, so that the other co-routines keep running. The calling
+ * co-routine is taken out of the scheduler until the function returns, and
+ * then resumes on its own thread. Outside of casync_gather(), or if no thread
+ * can be started, the function is called directly.
+ *
+ * The function runs on another thread, so it must not use casync functions or
+ * the calling thread's thread-local state. It can't be interrupted, so a
+ * canceled co-routine still waits for it to return.
+ * @return Returns the function's return value.
+ * @note Only available when casync is built with CASYNC_THREADS. On Windows,
+ * the function is always called directly for now.
+ */
+int casync_run_blocking(int (*function)(void*), void* arg);
+
+/*!
+ * @brief Sets the maximum number of threads casync_run_blocking() starts.
+ * Calls beyond that are queued until a thread is free. Threads that are
+ * already running aren't stopped. 0 or less restores the default of 64.
+ */
+void casync_run_blocking_threads(int max_threads);
+
 /*!
  * @brief Starts a new co-routine that will run in parallel with the rest of
  * the currently active co-routines within the current async_gather() context.
  *
  * In the _static version, the new co-routine allocates its stack from the pool
  * of static memory that was passed to casync_gather_static(). In the normal
- * version, the memory is allocated using malloc() and freed before the
- * function returns.
+ * version, the memory is taken from the stack cache and returned to it when
+ * the enclosing casync_gather() returns. Within casync_gather_static(), the
+ * normal version uses the pool as well, as long as it has a stack large enough
+ * for the co-routine's attributes.
  */
 void casync_start_static(int (*function)(void*), void* arg);
 void casync_start(int (*function)(void*), void* arg);
 
+/*!
+ * @brief Same as casync_start(), except the new co-routine is given
+ * attributes. attr may be NULL for the defaults.
+ */
+void casync_start_ex(
+    const struct casync_attr* attr, int (*function)(void*), void* arg);
+
+/*!
+ * @brief Same as calling casync_start_ex() for each element of the array,
+ * with the stacks allocated like casync_gather_array() does.
+ */
+void casync_start_many(const struct casync_spawn* spawns, size_t n);
+
+/*!
+ * @brief Starts a co-routine like casync_start_ex(), and returns a handle
+ * that can be used to wait for it and retrieve its return value. The handle
+ * must be passed to exactly one of casync_join(), casync_join_any() or
+ * casync_detach(), otherwise it is leaked. The return value of a joinable
+ * co-routine is not reported by casync_gather().
+ *
+ * Inside casync_gather_parallel(), the co-routine is started on the calling
+ * worker, so it can be joined without synchronization.
+ * @return Returns NULL if out of memory.
+ */
+struct casync_handle;
+struct casync_handle* casync_start_joinable(
+    const struct casync_attr* attr, int (*function)(void*), void* arg);
+
+/*!
+ * @brief Suspends the calling co-routine until the co-routine of the handle
+ * has returned, and frees the handle.
+ * @return Returns the co-routine's return value, or -1 if it has not returned
+ * yet and the caller is not in a casync_gather(). Returns CASYNC_ECANCELED if
+ * the caller was canceled, in which case the handle is not freed.
+ */
+int casync_join(struct casync_handle* handle);
+
+/*!
+ * @brief Suspends the calling co-routine until any of the handles' co-routines
+ * has returned, e.g. to use whichever of several redundant requests answers
+ * first. The handle of the co-routine that returned is freed and set to NULL
+ * in the array. NULL entries are ignored, so the function can be called
+ * repeatedly on the same array to collect all of them.
+ * @param[out] return_code Receives the co-routine's return value. May be NULL.
+ * @return Returns the index of the co-routine that returned, or -1 if all
+ * entries are NULL.
+ */
+int casync_join_any(struct casync_handle** handles, int n, int* return_code);
+
+/*!
+ * @brief Gives up on a handle. The co-routine keeps running, and the handle is
+ * freed once it returns.
+ */
+void casync_detach(struct casync_handle* handle);
+
+/*!
+ * @brief Asks the co-routine of the handle to give up. Cancellation is
+ * cooperative: if the co-routine is waiting in casync_sleep_ns(),
+ * casync_wait_fd(), casync_join(), a wait queue, or any of the primitives of
+ * casync/chan.h, casync/sync.h or the I/O functions, it is woken and the call
+ * returns CASYNC_ECANCELED (or -1 with errno set to ECANCELED, for functions
+ * that report errors through errno). Every call that would have to wait after
+ * that fails the same way, so the co-routine can only clean up and return.
+ * Long computations can check casync_canceled() to stop early.
+ *
+ * If the co-routine is running a casync_gather(), all co-routines in it are
+ * canceled as well. Has no effect if the co-routine has already returned.
+ */
+void casync_cancel(struct casync_handle* handle);
+
+/*!
+ * @brief Returns non-zero if the calling co-routine was canceled.
+ */
+int casync_canceled(void);
+
+/*!
+ * @brief Cancels the calling co-routine once casync_clock_ns() reaches
+ * deadline_ns, e.g. to drop a connection that has been idle for too long.
+ * Setting a new deadline replaces the previous one. 0 removes it.
+ * @return Returns -1 if out of memory or if called outside of casync_gather().
+ */
+int casync_set_deadline(uint64_t deadline_ns);
+
+/*!
+ * @brief Returns the name of the calling co-routine, or NULL if it wasn't
+ * given one with casync_start_ex() or casync_gather_ex().
+ */
+const char* casync_name(void);
+
 /*!
  * @brief Initialize stack memory to be used with casync_gather_static(). For
  * example, if you want to create a pool of 5 stacks, each with 1024*64 words of
@@ -73,12 +400,145 @@ struct casync_task* casync_stack_pool_init_linear(
     void* stacks_memory, size_t stack_size, size_t stack_count);
 
 /*!
- * @brief Yields until the specified amount of time has passed.
- * @note Contrary to the name, no sleeping is actually performed in the current
- * implementation. The function yields immediately until the time is passed.
+ * @brief Configures the stack cache of the calling thread. casync_gather() and
+ * casync_start() recycle stacks through a per-thread cache, so that starting
+ * co-routines doesn't require system calls. Stacks are binned by size. For
+ * each size, at most max_cached stacks are kept. The max_dirty most recently
+ * used ones keep their memory, older ones are trimmed so they only occupy
+ * address space. The defaults are 256 and 16.
+ */
+void casync_stack_cache_limits(size_t max_cached, size_t max_dirty);
+
+/*!
+ * @brief Releases all stacks in the calling thread's cache. Call this before a
+ * thread that used casync_gather() exits, otherwise the stacks are leaked.
+ */
+void casync_stack_cache_flush(void);
+
+/*!
+ * @brief Flags of casync_stack_arena() and casync_stack_arena_map().
+ * CASYNC_ARENA_HUGE_PAGES backs the memory with 2 MiB pages, from the
+ * reserved huge pages if there are any, otherwise with transparent huge pages
+ * where the OS supports them. CASYNC_ARENA_NUMA_LOCAL prefers memory of the
+ * NUMA node the calling thread runs on, on Linux and Windows.
+ */
+#define CASYNC_ARENA_HUGE_PAGES 1
+#define CASYNC_ARENA_NUMA_LOCAL 2
+
+/*!
+ * @brief Makes casync_gather() and casync_start() on the calling thread take
+ * stacks of up to 256 KiB from arenas, instead of mapping each one. With
+ * thousands of co-routines taking turns, each switch touches another stack,
+ * and packing them into a few huge pages saves TLB misses. 0 turns it off
+ * again, the default.
+ *
+ * Stack sizes are rounded up to powers of two from 2 KiB, and stacks in an
+ * arena have no guard pages, so an overflow corrupts the stack below instead
+ * of faulting. Arena memory stays allocated until casync_stack_cache_flush()
+ * finds none of it in use.
+ * @param[in] flags CASYNC_ARENA_* flags, at least one of them.
+ */
+void casync_stack_arena(int flags);
+
+/*!
+ * @brief Maps memory for casync_stack_pool_init_linear() the way the arenas
+ * of casync_stack_arena() are. size is rounded up to a multiple of 2 MiB:
+ *
+ *   ```c
+ *   size_t size = 10000 * 4096;
+ *   void* stacks = casync_stack_arena_map(size, CASYNC_ARENA_HUGE_PAGES);
+ *   freelist = casync_stack_pool_init_linear(stacks, 4096, 10000);
+ *   ...
+ *   casync_stack_arena_unmap(stacks, size);
+ *   ```
+ *
+ * @return Returns NULL if out of memory.
  */
-void casync_sleep_ns(uint64_t ns);
-#define casync_sleep_ms(ms) casync_sleep_ns((ms) * 1000000)
+void* casync_stack_arena_map(size_t size, int flags);
+
+/*!
+ * @brief Unmaps memory of casync_stack_arena_map(), given the same size.
+ */
+void casync_stack_arena_unmap(void* memory, size_t size);
+
+/*!
+ * @brief FIFO queue of parked co-routines. This is the building block of
+ * casync/chan.h and casync/sync.h, and can be used to build other primitives.
+ * A parked co-routine is taken out of the scheduler entirely, so waiting costs
+ * nothing, and the queue lives in the waiters' stacks, so it never allocates.
+ * Initialize with CASYNC_WAIT_QUEUE_INIT or by zeroing it.
+ */
+struct casync_waiter;
+struct casync_wait_queue
+{
+    struct casync_waiter* head;
+    struct casync_waiter* tail;
+};
+#define CASYNC_WAIT_QUEUE_INIT {NULL, NULL}
+
+/*!
+ * @brief Parks the calling co-routine at the end of the queue until it is
+ * woken by casync_wait_queue_wake().
+ * @return Returns 0 once woken, or CASYNC_ECANCELED if the co-routine was
+ * canceled. A canceled co-routine is removed from the queue.
+ * @note This must be called within a casync_gather().
+ */
+int casync_wait_queue_park(struct casync_wait_queue* queue);
+
+/*!
+ * @brief Reschedules the co-routine at the front of the queue. The caller
+ * keeps running, the woken co-routine runs when its turn comes.
+ * @return Returns 1 if a co-routine was woken, 0 if the queue was empty.
+ */
+int casync_wait_queue_wake(struct casync_wait_queue* queue);
+
+#define CASYNC_READ  0x01
+#define CASYNC_WRITE 0x02
+
+/*!
+ * @brief Suspends the calling co-routine until a file descriptor (or socket)
+ * becomes readable and/or writable. The co-routine is taken out of the
+ * scheduler while it waits, so it costs nothing until the event arrives. When
+ * no other co-routine is runnable, the outermost casync_gather() sleeps in the
+ * OS until an event arrives. For example:
+ *
+ *   ```c
+ *   while ((rc = recv(...)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+ *       casync_wait_fd(fd, CASYNC_READ);
+ *   ```
+ *
+ * At most one co-routine may wait for reading and one for writing on the same
+ * file descriptor at any time.
+ *
+ * When called outside of casync_gather(), the calling thread blocks.
+ *
+ * @param[in] events A combination of CASYNC_READ and CASYNC_WRITE.
+ * @return Returns the subset of events that are ready, or -1 on error. Errors
+ * and hang-ups on the file descriptor are reported as ready, so that the next
+ * I/O call returns the actual error. Returns CASYNC_ECANCELED with errno set
+ * to ECANCELED if the co-routine was canceled.
+ */
+int casync_wait_fd(int fd, int events);
+
+/*!
+ * @brief Suspends the calling co-routine until the specified amount of time has
+ * passed. The co-routine is taken out of the scheduler while it sleeps. If no
+ * other co-routine is runnable, the outermost casync_gather() sleeps in the OS
+ * until the earliest deadline.
+ *
+ * When called outside of casync_gather(), the calling thread sleeps.
+ * @note This function used to return void. Code that stores it in a
+ * void (*)(uint64_t) function pointer needs to be updated.
+ * @return Returns 0, or CASYNC_ECANCELED if the co-routine was canceled.
+ */
+int casync_sleep_ns(uint64_t ns);
+#define casync_sleep_ms(ms) casync_sleep_ns((uint64_t)(ms) * 1000000)
+
+/*!
+ * @brief Returns the time of a monotonic clock in nanoseconds. This is the
+ * clock used by casync_sleep_ns().
+ */
+uint64_t casync_clock_ns(void);
 
 /*!
  * @brief Internal function that is implemented differently depending on
@@ -90,3 +550,49 @@ void* casync_init_stack(
     void* return_addr,
     void* stack_buffer,
     int   stack_size);
+
+/*!
+ * @brief Internal function used by the platform-specific casync_sleep_ns().
+ * Parks the calling co-routine until casync_clock_ns() reaches the deadline.
+ * @return Returns -1 if called outside of casync_gather(), CASYNC_ECANCELED if
+ * the co-routine was canceled, 0 otherwise.
+ */
+int casync_timer_wait(uint64_t deadline_ns);
+
+/*!
+ * @brief Internal description of a system call for casync_io_submit(). Only
+ * the fields used by the operation need to be set.
+ */
+enum casync_io_opcode
+{
+    CASYNC_OP_READ,
+    CASYNC_OP_WRITE,
+    CASYNC_OP_RECV,
+    CASYNC_OP_SEND,
+    CASYNC_OP_ACCEPT,
+    CASYNC_OP_OPENAT
+};
+
+struct casync_io_op
+{
+    enum casync_io_opcode opcode;
+    int                   fd; /* dirfd for CASYNC_OP_OPENAT */
+    void*                 buf;
+    size_t                len;
+    int                   flags;
+    unsigned              mode;     /* CASYNC_OP_OPENAT */
+    const char*           path;     /* CASYNC_OP_OPENAT */
+    void*                 addr;     /* CASYNC_OP_ACCEPT */
+    void*                 addr_len; /* CASYNC_OP_ACCEPT */
+};
+
+/*!
+ * @brief Internal function used by the utilities in util/. If the reactor can
+ * perform system calls asynchronously (io_uring), submits the operation and
+ * parks the calling co-routine until it completes.
+ * @param[out] result The return value of the system call, or -errno on error.
+ * @return Returns 0 if the operation was performed, or -1 if the reactor
+ * doesn't support it, in which case the caller falls back to a non-blocking
+ * system call.
+ */
+int casync_io_submit(const struct casync_io_op* op, int* result);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "casync/casync.h"
+
+/*!
+ * @brief A queue of fixed-size items for passing data between co-routines.
+ * A co-routine receiving from an empty channel, or sending to a full one, is
+ * taken out of the scheduler until the other side wakes it, so no time is
+ * spent polling. Any number of co-routines may send and receive. Waiting
+ * co-routines are served first-come, first-served.
+ *
+ * All co-routines using a channel must run on the same thread. This includes
+ * co-routines in nested casync_gather() calls, but not co-routines on
+ * different workers of casync_gather_parallel().
+ */
+struct casync_chan;
+
+/*!
+ * @brief Creates a channel.
+ * @param[in] item_size Size of one item in bytes. Items are copied.
+ * @param[in] capacity Maximum number of items the channel buffers before
+ * senders have to wait. 0 creates an unbounded channel, where sending never
+ * waits.
+ * @return Returns NULL if out of memory.
+ */
+struct casync_chan* casync_chan_create(size_t item_size, size_t capacity);
+
+/*!
+ * @brief Frees a channel. No co-routine may be waiting on it.
+ */
+void casync_chan_destroy(struct casync_chan* chan);
+
+/*!
+ * @brief Closes the channel and wakes every co-routine waiting on it. Sending
+ * to a closed channel fails. Receiving still returns the items that were
+ * buffered before it was closed.
+ */
+void casync_chan_close(struct casync_chan* chan);
+
+/*!
+ * @brief Copies one item into the channel. Waits while the channel is full.
+ * @return Returns 0 on success. Returns -1 if the channel is closed, if out of
+ * memory, or if the call would have to wait outside of casync_gather().
+ * Returns CASYNC_ECANCELED if the co-routine was canceled while waiting.
+ */
+int casync_chan_send(struct casync_chan* chan, const void* item);
+
+/*!
+ * @brief Copies one item out of the channel. Waits while the channel is empty.
+ * @return Returns 0 on success. Returns -1 if the channel is closed and empty,
+ * or if the call would have to wait outside of casync_gather(). Returns
+ * CASYNC_ECANCELED if the co-routine was canceled while waiting.
+ */
+int casync_chan_recv(struct casync_chan* chan, void* item);
+
+/*!
+ * @brief Sends n items from a contiguous array. Waits as often as necessary
+ * for space, but moves as many items as fit at each wake-up.
+ * @return Returns the number of items sent. This is less than n only under the
+ * same conditions casync_chan_send() fails.
+ */
+size_t
+casync_chan_send_many(struct casync_chan* chan, const void* items, size_t n);
+
+/*!
+ * @brief Waits until at least one item is available, then receives up to max
+ * items into a contiguous array.
+ * @return Returns the number of items received. Returns 0 under the same
+ * conditions casync_chan_recv() fails.
+ */
+size_t casync_chan_recv_many(struct casync_chan* chan, void* items, size_t max);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "casync/casync.h"
+
+#include <sys/types.h>
+
+/*!
+ * @brief File functions that suspend the calling co-routine instead of
+ * blocking the thread. With the io_uring reactor (CASYNC_IO=uring), the system
+ * calls are performed asynchronously by the kernel, which includes reads and
+ * writes of regular files. Otherwise, non-blocking file descriptors are
+ * waited on with casync_wait_fd(), and regular files block as usual. The
+ * return values and error reporting are the same as read(), write() and
+ * openat().
+ *
+ * These are optional POSIX utilities. If you need them, you must also add
+ * util/io_posix.c to your build.
+ */
+ssize_t casync_read(int fd, void* buf, size_t len);
+ssize_t casync_write(int fd, const void* buf, size_t len);
+int     casync_openat(int dirfd, const char* path, int flags, mode_t mode);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "casync/casync.h"
+
+#if defined(_WIN32)
+#    include "winsock2.h"
+#    include "ws2tcpip.h"
+#else
+#    include <sys/socket.h>
+#endif
+
+/*!
+ * @brief Socket functions that suspend the calling co-routine with
+ * casync_wait_fd() instead of failing with EAGAIN/EWOULDBLOCK. The socket must
+ * be in non-blocking mode. The return values and error reporting are the same
+ * as the corresponding BSD socket functions.
+ *
+ * These are optional utilities. If you need them, you must also add
+ * util/net_posix.c or util/net_win32.c to your build.
+ */
+int casync_recv(int fd, void* buf, size_t len, int flags);
+int casync_send(int fd, const void* buf, size_t len, int flags);
+int casync_accept(int fd, struct sockaddr* addr, socklen_t* addr_len);
+
+/*!
+ * @brief Starts a non-blocking connect and suspends the calling co-routine
+ * until the connection is established or has failed.
+ * @return Returns 0 on success, or -1 on error.
+ */
+int casync_connect(int fd, const struct sockaddr* addr, socklen_t addr_len);
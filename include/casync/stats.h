@@ -0,0 +1,91 @@
+#pragma once
+
+#include "casync/casync.h"
+
+#include <stdio.h>
+
+/*
+ * Scheduler statistics, to find out which co-routine keeps the loop busy
+ * between yields. They are only collected if the library is built with
+ * -DCASYNC_STATS=ON, which adds a few nanoseconds to each switch and paints
+ * the top of each new stack. Otherwise, the functions below report nothing.
+ *
+ * Times are measured in ticks of the time stamp counter on x86, of the
+ * virtual counter on AArch64, or in nanoseconds elsewhere.
+ * casync_loop_stats::ticks_per_ns converts them.
+ */
+
+/*! Number of buckets in casync_loop_stats::queue_histogram. */
+#define CASYNC_STATS_BUCKETS 16
+
+/*!
+ * @brief Only the topmost bytes of each stack are painted, so untouched pages
+ * of large stacks aren't committed. Deeper stacks report this much usage.
+ */
+#define CASYNC_STATS_PAINT_SIZE (16 * 1024)
+
+struct casync_task_stats
+{
+    const char* name;
+    int         priority;
+    uint64_t    switches;  /* Times it yielded or waited */
+    uint64_t    ticks;     /* Time spent running, including nested gathers */
+    uint64_t    max_slice; /* Longest stretch without yielding, in ticks */
+    size_t      stack_size;
+    size_t      stack_used; /* High-water mark */
+};
+
+struct casync_loop_stats
+{
+    uint64_t rounds;         /* Times every runnable co-routine ran once */
+    uint64_t switches;       /* Including finished co-routines */
+    uint64_t started;        /* Co-routines started */
+    uint64_t finished;       /* Co-routines that returned */
+    uint64_t ticks;          /* Time spent running finished co-routines */
+    uint64_t max_slice;      /* Longest stretch of a finished co-routine */
+    size_t   stack_used;     /* Highest high-water mark of finished ones */
+    uint64_t stack_copies;   /* Co-routines copied onto a shared stack */
+    uint64_t stack_copied;   /* Bytes copied onto and off shared stacks */
+    size_t   live;           /* Co-routines that haven't returned */
+    size_t   parked;         /* Of those, waiting on something */
+    double   ticks_per_ns;
+
+    /*! Number of runnable co-routines at the start of each round. Bucket 0
+     * counts empty rounds, bucket i > 0 rounds with 2^(i-1) to 2^i - 1
+     * co-routines. The last bucket also counts everything above. */
+    uint64_t queue_histogram[CASYNC_STATS_BUCKETS];
+};
+
+/*!
+ * @brief Takes a snapshot of the counters of the calling co-routine's gather.
+ * @return Returns -1 if called outside of casync_gather(), or if statistics
+ * are disabled.
+ */
+int casync_stats_loop(struct casync_loop_stats* stats);
+
+/*!
+ * @brief Takes a snapshot of up to max co-routines of the calling
+ * co-routine's gather that haven't returned yet, most recently started first.
+ * @return Returns the number of live co-routines, which may be more than max.
+ * Returns 0 outside of casync_gather(), or if statistics are disabled.
+ */
+size_t casync_stats_tasks(struct casync_task_stats* tasks, size_t max);
+
+/*!
+ * @brief Writes the statistics of the outermost gather of the calling thread
+ * and of every gather nested in it to fp, one line per co-routine. When
+ * called from a co-routine, its stack must have room for fprintf().
+ */
+void casync_stats_dump(FILE* fp);
+
+/*!
+ * @brief Makes every outermost gather dump its statistics to stderr at the
+ * start of its next round. This is async-signal-safe, so it can be called
+ * from a signal handler, e.g. for SIGUSR1:
+ *
+ *   ```c
+ *   static void on_sigusr1(int sig) { casync_stats_request_dump(); }
+ *   signal(SIGUSR1, on_sigusr1);
+ *   ```
+ */
+void casync_stats_request_dump(void);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "casync/casync.h"
+
+/*
+ * Synchronization primitives for co-routines. A co-routine that has to wait is
+ * parked (taken out of the scheduler) until it is its turn, instead of
+ * spinning on casync_yield(). Waiters are served first-come, first-served:
+ * releasing a contended mutex or semaphore hands it directly to the oldest
+ * waiter, so newcomers can't overtake it. None of them make system calls.
+ *
+ * All co-routines using a primitive must run on the same thread. Functions
+ * that wait return -1 if they would have to wait outside of casync_gather(),
+ * and CASYNC_ECANCELED if the co-routine was canceled while waiting. When
+ * casync_mutex_lock() or casync_cond_wait() fail, the mutex is not held.
+ */
+
+/*!
+ * @brief Mutual exclusion across yields. Initialize with CASYNC_MUTEX_INIT
+ * or casync_mutex_init().
+ */
+struct casync_mutex
+{
+    int                      locked;
+    struct casync_wait_queue waiters;
+};
+#define CASYNC_MUTEX_INIT {0, CASYNC_WAIT_QUEUE_INIT}
+
+void casync_mutex_init(struct casync_mutex* mutex);
+int  casync_mutex_lock(struct casync_mutex* mutex);
+void casync_mutex_unlock(struct casync_mutex* mutex);
+
+/*!
+ * @return Returns 0 if the mutex was acquired, -1 if it is locked.
+ */
+int casync_mutex_trylock(struct casync_mutex* mutex);
+
+/*!
+ * @brief Condition variable. Initialize with CASYNC_COND_INIT or
+ * casync_cond_init(). Because co-routines are cooperative, no wake-up can be
+ * missed between unlocking the mutex and parking. Spurious wake-ups don't
+ * happen either, but the condition may have changed again by the time the
+ * mutex is reacquired, so check it in a loop as usual.
+ */
+struct casync_cond
+{
+    struct casync_wait_queue waiters;
+};
+#define CASYNC_COND_INIT {CASYNC_WAIT_QUEUE_INIT}
+
+void casync_cond_init(struct casync_cond* cond);
+int  casync_cond_wait(struct casync_cond* cond, struct casync_mutex* mutex);
+void casync_cond_signal(struct casync_cond* cond);
+void casync_cond_broadcast(struct casync_cond* cond);
+
+/*!
+ * @brief Counting semaphore, e.g. to limit the number of concurrent
+ * connections. Initialize with casync_sem_init().
+ */
+struct casync_sem
+{
+    size_t                   count;
+    struct casync_wait_queue waiters;
+};
+#define CASYNC_SEM_INIT(count) {count, CASYNC_WAIT_QUEUE_INIT}
+
+void casync_sem_init(struct casync_sem* sem, size_t count);
+int  casync_sem_acquire(struct casync_sem* sem);
+void casync_sem_release(struct casync_sem* sem);
+
+/*!
+ * @return Returns 0 if a unit was acquired, -1 if none is available.
+ */
+int casync_sem_tryacquire(struct casync_sem* sem);
+
+/*!
+ * @brief Waits for a group of co-routines to finish. Each one is counted with
+ * casync_wait_group_add() before it starts and calls casync_wait_group_done()
+ * when it's finished. casync_wait_group_wait() returns once the count drops
+ * to zero. Initialize with CASYNC_WAIT_GROUP_INIT or casync_wait_group_init().
+ */
+struct casync_wait_group
+{
+    size_t                   count;
+    struct casync_wait_queue waiters;
+};
+#define CASYNC_WAIT_GROUP_INIT {0, CASYNC_WAIT_QUEUE_INIT}
+
+void casync_wait_group_init(struct casync_wait_group* wg);
+void casync_wait_group_add(struct casync_wait_group* wg, size_t n);
+void casync_wait_group_done(struct casync_wait_group* wg);
+int  casync_wait_group_wait(struct casync_wait_group* wg);
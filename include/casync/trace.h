@@ -0,0 +1,43 @@
+#pragma once
+
+#include "casync/casync.h"
+
+#include <stdio.h>
+
+/*
+ * Records when co-routines start, run, wait, are woken and return, and
+ * exports the recording in the Chrome trace format, which chrome://tracing
+ * and https://ui.perfetto.dev display as a timeline with one track per
+ * co-routine. Events are only recorded if the library is built with
+ * -DCASYNC_TRACE=ON. Otherwise, the functions below fail.
+ *
+ * Each thread records into its own buffer, and only while recording is
+ * started on that thread. The buffer is a ring: once it is full, the oldest
+ * events are overwritten, so it always holds the most recent ones.
+ */
+
+/*!
+ * @brief Starts recording on the calling thread, discarding anything that
+ * was recorded before.
+ * @param[in] capacity Number of events to keep. Each takes 40 bytes.
+ * @return Returns -1 if out of memory, or if tracing is disabled.
+ */
+int casync_trace_start(size_t capacity);
+
+/*!
+ * @brief Stops recording on the calling thread. The events are kept until
+ * casync_trace_start() or casync_trace_free() is called.
+ */
+void casync_trace_stop(void);
+
+/*!
+ * @brief Writes the events recorded on the calling thread to fp as Chrome
+ * trace JSON. Recording can continue afterwards.
+ * @return Returns -1 if nothing was recorded, or if tracing is disabled.
+ */
+int casync_trace_export(FILE* fp);
+
+/*!
+ * @brief Stops recording and frees the calling thread's buffer.
+ */
+void casync_trace_free(void);
@@ -0,0 +1,12 @@
+#include "../casync_internal.h"
+
+/* -------------------------------------------------------------------------- */
+size_t casync_fpu_init(struct casync_task* task, int mode)
+{
+    /* D8-D15 are saved in every mode. There is no full mode yet, which would
+     * have to save FPSR and all of V0-V31. Saving FPCR keeps the rounding mode
+     * per co-routine at least */
+    task->fpu = mode == CASYNC_FPU_NONE ? CASYNC_FPU_NONE : CASYNC_FPU_CONTROL;
+    task->fpu_area = NULL;
+    return task->stack_size;
+}
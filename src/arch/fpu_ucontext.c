@@ -0,0 +1,12 @@
+#include "../casync_internal.h"
+
+/* -------------------------------------------------------------------------- */
+size_t casync_fpu_init(struct casync_task* task, int mode)
+{
+    /* swapcontext() decides what is saved, which is at least the control
+     * state on every platform we know of */
+    (void)mode;
+    task->fpu = CASYNC_FPU_CONTROL;
+    task->fpu_area = NULL;
+    return task->stack_size;
+}
@@ -0,0 +1,119 @@
+#include "../casync_internal.h"
+
+#include <string.h>
+
+#if defined(_MSC_VER)
+#    include <intrin.h>
+#else
+#    include <cpuid.h>
+#endif
+
+/* Legacy region plus XSAVE header. Everything after it is only read by XRSTOR
+ * if the header says so */
+#define XSAVE_HEADER_END 576
+#define XSAVE_MXCSR      24
+
+/* Components the assembly saves: x87, SSE, AVX and AVX-512. AMX tiles are
+ * left out, they would add 8 KiB per task */
+#define XSAVE_COMPONENTS 0xE7
+
+/* casync_task::fpu of a task using XSAVE, because XSAVEOPT is missing */
+#define FPU_XSAVE 3
+
+/* -------------------------------------------------------------------------- */
+static void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+    __cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+static uint64_t xgetbv0(void)
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+static size_t xsave_size(int* mode)
+{
+    static THREADLOCAL size_t size;
+    static THREADLOCAL int    xsave_mode;
+    unsigned                  regs[4];
+
+    if (size == 0)
+    {
+        size = (size_t)-1;
+        cpuid(0, 0, regs);
+        if (regs[0] >= 0xD)
+        {
+            /* OSXSAVE means XSAVE is supported and enabled by the OS */
+            cpuid(1, 0, regs);
+            if (regs[2] & (1u << 27))
+            {
+                /* Components are at fixed offsets. The area ends with the
+                 * last one that is enabled */
+                uint64_t enabled = xgetbv0() & XSAVE_COMPONENTS;
+                unsigned i;
+                size = XSAVE_HEADER_END;
+                for (i = 2; i < 8; i++)
+                {
+                    if (!(enabled & (1u << i)))
+                        continue;
+                    cpuid(0xD, i, regs);
+                    if (regs[1] + regs[0] > size)
+                        size = regs[1] + regs[0];
+                }
+                cpuid(0xD, 1, regs);
+                xsave_mode = (regs[0] & 1) ? CASYNC_FPU_FULL : FPU_XSAVE;
+            }
+        }
+    }
+
+    *mode = xsave_mode;
+    return size;
+}
+
+/* -------------------------------------------------------------------------- */
+size_t casync_fpu_init(struct casync_task* task, int mode)
+{
+    uintptr_t top = (uintptr_t)task->stack_base + task->stack_size;
+    size_t    size;
+    char*     area;
+
+    task->fpu = (uintptr_t)mode;
+    task->fpu_area = NULL;
+    if (mode != CASYNC_FPU_FULL)
+    {
+        if (mode != CASYNC_FPU_NONE)
+            task->fpu = CASYNC_FPU_CONTROL;
+        return task->stack_size;
+    }
+
+    /* The area is taken from the top of the stack, where XSAVE's 64-byte
+     * alignment costs the least. Keep the bulk of the stack for the task */
+    size = xsave_size(&mode);
+    if (size > task->stack_size / 2)
+    {
+        task->fpu = CASYNC_FPU_CONTROL;
+        return task->stack_size;
+    }
+    area = (char*)((top - size) & ~(uintptr_t)63);
+
+    /* An empty header makes the first XRSTOR load the initial state. MXCSR is
+     * loaded from the legacy region regardless */
+    memset(area, 0, XSAVE_HEADER_END);
+    *(uint32_t*)(area + XSAVE_MXCSR) = 0x1F80;
+
+    task->fpu = (uintptr_t)mode;
+    task->fpu_area = area;
+    return (size_t)(area - (char*)task->stack_base);
+}
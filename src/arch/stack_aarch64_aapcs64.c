@@ -0,0 +1,42 @@
+#include "casync/casync.h"
+
+void casync_task_start(void);
+
+void* casync_init_stack(
+    void* function,
+    void* arg,
+    void* return_addr,
+    void* stack_buffer,
+    int   stack_size)
+{
+    /* AArch64 grows downwards. The stack must be 16-byte aligned */
+    uint64_t* sp =
+        (uint64_t*)(((uintptr_t)stack_buffer + stack_size) & ~(uintptr_t)15);
+
+    /* Default FPCR: round to nearest, no flush-to-zero, no traps. See
+     * yield_gas_aarch64_aapcs64.s for the layout */
+    --sp;      /* Padding */
+    *--sp = 0; /* FPCR */
+    sp -= 8;   /* d8-d15 */
+
+    /* Set up so we "return" to a stub that calls the task function when
+     * restoring context */
+    *--sp = (uint64_t)casync_task_start; /* x30 */
+    *--sp = 0; /* x29, terminates frame pointer chains */
+
+    /* Callee-saved registers */
+    sp -= 7;                       /* x22-x28 */
+    *--sp = (uint64_t)return_addr; /* x21, where the task function returns */
+    *--sp = (uint64_t)function;    /* x20 */
+    *--sp = (uint64_t)arg;         /* x19 */
+
+    return sp;
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_stack_low(void* stack)
+{
+    /* The frame casync_yield() saves is the lowest part, and the
+     * saved stack pointer points to it */
+    return stack;
+}
@@ -0,0 +1,70 @@
+#include "../casync_internal.h"
+
+#include <stdlib.h>
+#include <ucontext.h>
+
+void casync_end(int return_code);
+
+/*
+ * Portable fallback for architectures without a backend in src/arch/. A task
+ * that hasn't run yet has this frame at the top of its stack, and
+ * casync_task::stack points to its context. Once the task yields, the context
+ * is saved on its stack by casync_yield() instead, see yield_ucontext.c.
+ */
+struct start_frame
+{
+    ucontext_t context;
+    int (*function)(void*);
+    void* arg;
+};
+
+/* -------------------------------------------------------------------------- */
+static void task_start(void)
+{
+    /* makecontext() can only pass int arguments portably, so the frame is
+     * found through the task instead. Nothing has overwritten its "stack"
+     * since it was started */
+    struct start_frame* frame = casync_current_loop->active->stack;
+
+    /* The assembly backends return to casync_end_redirect, which passes the
+     * return code on. We can just call casync_end() */
+    casync_end(frame->function(frame->arg));
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_init_stack(
+    void* function,
+    void* arg,
+    void* return_addr,
+    void* stack_buffer,
+    int   stack_size)
+{
+    uintptr_t           top = (uintptr_t)stack_buffer + stack_size;
+    struct start_frame* frame;
+    (void)return_addr;
+
+    frame = (struct start_frame*)((top - sizeof *frame) & ~(uintptr_t)63);
+    frame->function = (int (*)(void*))function;
+    frame->arg = arg;
+
+    /* getcontext() fills in the signal mask and whatever else makecontext()
+     * expects to be initialized */
+    if (getcontext(&frame->context) != 0)
+        abort();
+    frame->context.uc_stack.ss_sp = stack_buffer;
+    frame->context.uc_stack.ss_size =
+        (size_t)((char*)frame - (char*)stack_buffer);
+    frame->context.uc_link = NULL; /* casync_end() never returns */
+    makecontext(&frame->context, task_start, 0);
+
+    return &frame->context;
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_stack_low(void* stack)
+{
+    /* The stack pointer is somewhere in the machine-specific part of the
+     * context, so shared stacks aren't supported */
+    (void)stack;
+    return NULL;
+}
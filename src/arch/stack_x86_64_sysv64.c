@@ -1,5 +1,7 @@
 #include "casync/casync.h"
 
+void casync_task_start(void);
+
 void* casync_init_stack(
     void* function,
     void* arg,
@@ -7,28 +9,35 @@ void* casync_init_stack(
     void* stack_buffer,
     int   stack_size)
 {
-    uint64_t* sp = stack_buffer;
-    int       stack_words = stack_size / sizeof(uint64_t);
-    sp += stack_words; /* x86 grows downwards */
+    /* x86 grows downwards. The stack must be 16-byte aligned */
+    uint64_t* sp =
+        (uint64_t*)(((uintptr_t)stack_buffer + stack_size) & ~(uintptr_t)15);
 
     /* Where to return to when task completes*/
     *--sp = (uint64_t)return_addr;
 
-    /* Set up so we "return" to the task function when restoring context */
-    *--sp = (uint64_t)function; /* return address to task */
+    /* Set up so we "return" to a stub that calls the task function when
+     * restoring context. See yield_gas_x86_64_sysv64.s for the layout */
+    *--sp = (uint64_t)casync_task_start;
 
-    /* flags */
-    *--sp = 0;
+    /* Callee-saved registers */
+    *--sp = 0;                  /* rbp, terminates frame pointer chains */
+    --sp;                       /* rbx */
+    *--sp = (uint64_t)arg;      /* r12 */
+    *--sp = (uint64_t)function; /* r13 */
+    --sp;                       /* r14 */
+    --sp;                       /* r15 */
 
-    /* General purpose registers */
-    --sp;                  /* rax */
-    --sp;                  /* rcx */
-    --sp;                  /* rdx */
-    --sp;                  /* rbx */
-    --sp;                  /* rbp */
-    --sp;                  /* rsi */
-    *--sp = (uint64_t)arg; /* rdi */
-    sp -= 8;               /* r8 - r15 */
+    /* Default x87 control word and MXCSR */
+    *--sp = ((uint64_t)0x037F << 32) | 0x1F80;
 
     return sp;
 }
+
+/* -------------------------------------------------------------------------- */
+void* casync_stack_low(void* stack)
+{
+    /* The callee-saved registers and the MXCSR are the lowest part, and the
+     * saved stack pointer points to it */
+    return stack;
+}
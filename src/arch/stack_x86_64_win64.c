@@ -1,5 +1,7 @@
 #include "casync/casync.h"
 
+void casync_task_start(void);
+
 void* casync_init_stack(
     void* function,
     void* arg,
@@ -7,28 +9,40 @@ void* casync_init_stack(
     void* stack_buffer,
     int   stack_size)
 {
-    uint64_t* sp = stack_buffer;
-    int       stack_words = stack_size / sizeof(uint64_t);
-    sp += stack_words; /* x86 grows downwards */
+    /* x86 grows downwards. The stack must be 16-byte aligned */
+    uint64_t* sp =
+        (uint64_t*)(((uintptr_t)stack_buffer + stack_size) & ~(uintptr_t)15);
 
     sp -= 4;                       /* 32 bytes of shadow space (win64) */
     *--sp = (uint64_t)return_addr; /* Where to return to when task completes*/
 
-    /* Set up so we "return" to the coroutine function when restoring context */
-    *--sp = (uint64_t)function;
+    /* Set up so we "return" to a stub that calls the task function when
+     * restoring context. See yield_gas_x86_64_win64.s for the layout */
+    *--sp = (uint64_t)casync_task_start;
+
+    /* Callee-saved general purpose registers */
+    *--sp = 0;                  /* rbp, terminates frame pointer chains */
+    --sp;                       /* rbx */
+    --sp;                       /* rdi */
+    --sp;                       /* rsi */
+    *--sp = (uint64_t)arg;      /* r12 */
+    *--sp = (uint64_t)function; /* r13 */
+    --sp;                       /* r14 */
+    --sp;                       /* r15 */
 
-    /* General purpose registers */
-    --sp;                  /* rax */
-    *--sp = (uint64_t)arg; /* rcx */
-    --sp;                  /* rdx */
-    --sp;                  /* rbx */
-    --sp;                  /* rbp */
-    --sp;                  /* rsi */
-    --sp;                  /* rdi */
-    sp -= 8;               /* r8 - r15 */
+    /* Default x87 control word and MXCSR */
+    *--sp = ((uint64_t)0x037F << 32) | 0x1F80;
 
-    /* flags register */
-    *--sp = 0;
+    /* xmm6 - xmm15 */
+    sp -= 20;
 
     return sp;
 }
+
+/* -------------------------------------------------------------------------- */
+void* casync_stack_low(void* stack)
+{
+    /* The saved registers, XMM6-15 included, are the lowest part, and the
+     * saved stack pointer points to it */
+    return stack;
+}
@@ -7,23 +7,36 @@ void* casync_init_stack(
     void* stack_buffer,
     int   stack_size)
 {
-    uint32_t* sp = stack_buffer;
-    int       stack_words = stack_size / sizeof(uint32_t);
-    sp += stack_words; /* x86 grows downwards */
+    /* x86 grows downwards. The stack must be 16-byte aligned */
+    uint32_t* sp =
+        (uint32_t*)(((uintptr_t)stack_buffer + stack_size) & ~(uintptr_t)15);
 
     /* task_func(void* arg) */
     sp -= 3;                       /* Align stack to 16 bytes before call */
     *--sp = (uint32_t)arg;         /* Task argument 1 */
     *--sp = (uint32_t)return_addr; /* Where to return to when task completes*/
 
-    /* Set up so we "return" to the task function when restoring context */
-    *--sp = (uint32_t)function; /* return address to task */
+    /* Set up so we "return" to the task function when restoring context. See
+     * yield_gas_x86_i386.s for the layout */
+    *--sp = (uint32_t)function;
 
-    /* eflags */
-    *--sp = 0;
+    /* Callee-saved registers */
+    *--sp = 0; /* ebp, terminates frame pointer chains */
+    --sp;      /* ebx */
+    --sp;      /* esi */
+    --sp;      /* edi */
 
-    /* General purpose registers (pusha) */
-    sp -= 8;
+    /* Default x87 control word and MXCSR */
+    *--sp = 0x037F;
+    *--sp = 0x1F80;
 
     return sp;
 }
+
+/* -------------------------------------------------------------------------- */
+void* casync_stack_low(void* stack)
+{
+    /* The callee-saved registers and the MXCSR are the lowest part, and the
+     * saved stack pointer points to it */
+    return stack;
+}
@@ -0,0 +1,170 @@
+// Some notes:
+//   - casync_yield() is an ordinary function call as far as the compiler is
+//     concerned, so only the callee-saved registers need to be preserved across
+//     a context switch: X19-X28, the frame pointer X29, the link register X30,
+//     SP and the lower 64 bits of V8-V15 (D8-D15). Everything else is already
+//     considered clobbered by the caller.
+//   - casync_task::fpu selects whether FPCR (rounding mode, flush-to-zero) is
+//     saved as well (CASYNC_FPU_CONTROL, the default) or not
+//     (CASYNC_FPU_NONE). casync_fpu_init() turns CASYNC_FPU_FULL into
+//     CASYNC_FPU_CONTROL on this architecture.
+//   - SP must always be 16-byte aligned. The frame is a multiple of 16 bytes.
+//   - There is no return address on the stack. casync_yield() "returns" with
+//     RET to whatever X30 was restored to.
+//
+// Stack frame of a suspended task, starting at casync_task::stack:
+//   0   X19                  (task argument when starting a task)
+//   8   X20                  (task function when starting a task)
+//   16  X21                  (casync_end_redirect when starting a task)
+//   24  X22
+//   32  X23
+//   40  X24
+//   48  X25
+//   56  X26
+//   64  X27
+//   72  X28
+//   80  X29                  (0 when starting a task)
+//   88  X30                  (casync_task_start when starting a task)
+//   96  D8-D15               (8 * 8 bytes)
+//   160 FPCR                 (unused unless CASYNC_FPU_CONTROL)
+//   168 padding
+
+.section .note.GNU-stack
+
+/*
+ * Linux (AAPCS64):
+ *   Integer args : X0-X7
+ *   Callee-saved : X19-X29, SP, D8-D15
+ */
+
+.section .data
+  .extern casync_current_loop
+
+.section .text
+  .extern casync_end
+  .global casync_yield
+  .global casync_restore
+  .global casync_end_redirect
+  .global casync_task_start
+
+.macro LOAD_TLS var_name
+  mrs     x9, tpidr_el0
+  add     x9, x9, #:tprel_hi12:\var_name, lsl #12
+  add     x9, x9, #:tprel_lo12_nc:\var_name
+  ldr     x10, [x9]
+.endm
+
+// casync_end_redirect is the return address of every task function, so this
+// is where unwinders end up at the bottom of a task's stack. Unwinders look up
+// the return address minus one, hence the nop.
+  .cfi_startproc
+  .cfi_undefined x30
+  nop
+casync_end_redirect:
+  bl      casync_end          // Never returns. W0 holds the return value
+
+casync_task_start:
+  mov     x0, x19             // Task argument
+  mov     x30, x21            // Task function returns to casync_end_redirect
+  br      x20                 // Task function
+  .cfi_endproc
+
+// The frame of a suspended task looks the same on every stack, so the CFI
+// stays valid across the stack switch. casync_restore is entered with an
+// empty frame, and .switch is where both paths meet.
+casync_yield:
+  .cfi_startproc
+  LOAD_TLS casync_current_loop
+  cbz     x10, .no_loop
+
+  sub     sp, sp, #176
+  .cfi_adjust_cfa_offset 176
+  stp     x19, x20, [sp, #0]
+  stp     x21, x22, [sp, #16]
+  stp     x23, x24, [sp, #32]
+  stp     x25, x26, [sp, #48]
+  stp     x27, x28, [sp, #64]
+  stp     x29, x30, [sp, #80]
+  stp     d8, d9, [sp, #96]
+  stp     d10, d11, [sp, #112]
+  stp     d12, d13, [sp, #128]
+  stp     d14, d15, [sp, #144]
+  .cfi_rel_offset x19, 0
+  .cfi_rel_offset x20, 8
+  .cfi_rel_offset x21, 16
+  .cfi_rel_offset x22, 24
+  .cfi_rel_offset x23, 32
+  .cfi_rel_offset x24, 40
+  .cfi_rel_offset x25, 48
+  .cfi_rel_offset x26, 56
+  .cfi_rel_offset x27, 64
+  .cfi_rel_offset x28, 72
+  .cfi_rel_offset x29, 80
+  .cfi_rel_offset x30, 88
+  .cfi_remember_state
+
+  ldr     x11, [x10]          // x11 = casync_current_loop->active
+  ldr     x12, [x11, #16]     // x12 = casync_current_loop->active->fpu
+  cbnz    x12, .save_done
+  mrs     x13, fpcr
+  str     x13, [sp, #160]
+.save_done:
+  mov     x13, sp
+  str     x13, [x11]          // casync_current_loop->active->stack = sp
+  ldr     x11, [x11, #8]      // x11 = casync_current_loop->active->next
+  str     x11, [x10]          // casync_current_loop->active = x11
+  b       .switch
+
+casync_restore:
+  .cfi_remember_state
+  .cfi_def_cfa_offset 0
+  .cfi_same_value x19
+  .cfi_same_value x20
+  .cfi_same_value x21
+  .cfi_same_value x22
+  .cfi_same_value x23
+  .cfi_same_value x24
+  .cfi_same_value x25
+  .cfi_same_value x26
+  .cfi_same_value x27
+  .cfi_same_value x28
+  .cfi_same_value x29
+  .cfi_same_value x30
+  LOAD_TLS casync_current_loop
+  ldr     x11, [x10]          // x11 = casync_current_loop->active
+.switch:
+  .cfi_restore_state
+  ldr     x13, [x11]          // sp = casync_current_loop->active->stack
+  mov     sp, x13
+  ldr     x12, [x11, #16]     // x12 = casync_current_loop->active->fpu
+  cbnz    x12, .restore_done
+  ldr     x13, [sp, #160]
+  msr     fpcr, x13
+.restore_done:
+  ldp     x19, x20, [sp, #0]
+  ldp     x21, x22, [sp, #16]
+  ldp     x23, x24, [sp, #32]
+  ldp     x25, x26, [sp, #48]
+  ldp     x27, x28, [sp, #64]
+  ldp     x29, x30, [sp, #80]
+  ldp     d8, d9, [sp, #96]
+  ldp     d10, d11, [sp, #112]
+  ldp     d12, d13, [sp, #128]
+  ldp     d14, d15, [sp, #144]
+  add     sp, sp, #176
+  .cfi_adjust_cfa_offset -176
+  .cfi_same_value x19
+  .cfi_same_value x20
+  .cfi_same_value x21
+  .cfi_same_value x22
+  .cfi_same_value x23
+  .cfi_same_value x24
+  .cfi_same_value x25
+  .cfi_same_value x26
+  .cfi_same_value x27
+  .cfi_same_value x28
+  .cfi_same_value x29
+  .cfi_same_value x30
+.no_loop:
+  ret
+  .cfi_endproc
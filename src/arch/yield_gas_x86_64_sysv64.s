@@ -1,18 +1,40 @@
 # Some notes:
-#   - Floating point registers are not saved/restored
-#   - SIMD registers are not saved/restored
+#   - casync_yield() is an ordinary function call as far as the compiler is
+#     concerned, so only the callee-saved registers need to be preserved across
+#     a context switch: RBX, RBP, R12-R15, the MXCSR control bits and the x87
+#     control word. Everything else is already considered clobbered by the
+#     caller.
+#   - SIMD registers are all caller-saved in this ABI and are not saved.
+#   - casync_task::fpu selects what else is saved: the control words
+#     (CASYNC_FPU_CONTROL, the default), nothing (CASYNC_FPU_NONE), or the
+#     x87, SSE, AVX and AVX-512 state with XSAVEOPT or XSAVE (CASYNC_FPU_FULL)
+#     into the area at casync_task::fpu_area. XSAVEOPT skips components that
+#     weren't modified since the task's last XRSTOR. XSAVE/XRSTOR use EDX:EAX
+#     as the mask of components, so the task pointers are moved to R8/R9 while
+#     saving.
 #   - When calling C functions, the stack pointer must always be aligned to 16
 #     bytes prior to the call. Any C code calling assembly routines will have
 #     aligned the stack pointer to 16 bytes as well. This makes it straight
 #     forward to adjust the stack pointer. On function entry, the stack pointer
-#     will be -4 bytes due to the return address.
+#     will be -8 bytes due to the return address.
+#
+# Stack frame of a suspended task, starting at casync_task::stack:
+#   0   MXCSR                (unused unless CASYNC_FPU_CONTROL)
+#   4   x87 control word     (unused unless CASYNC_FPU_CONTROL)
+#   8   R15
+#   16  R14
+#   24  R13                  (task function when starting a task)
+#   32  R12                  (task argument when starting a task)
+#   40  RBX
+#   48  RBP
+#   56  return address       (casync_task_start when starting a task)
 
 .section .note.GNU-stack
 
 /*
  * Linux (System V AMD64 ABI):
  *   Integer args : RDI, RSI, RDX, RCX, R8, R9
- *   Volatile     :
+ *   Callee-saved : RBX, RBP, R12-R15, MXCSR control bits, x87 control word
  */
 
 .section .data
@@ -23,6 +45,7 @@
   .global casync_yield
   .global casync_restore
   .global casync_end_redirect
+  .global casync_task_start
 
 .macro LOAD_TLS var_name
   movq    %fs:\var_name@TPOFF, %rax
@@ -33,58 +56,133 @@
   movq    (\reg), \reg
 .endm
 
+# casync_end_redirect is the return address of every task function, so this
+# is where unwinders end up at the bottom of a task's stack. Unwinders look up
+# the return address minus one, hence the nop.
+  .cfi_startproc
+  .cfi_undefined %rip
+  nop
 casync_end_redirect:
   movl    %eax, %edi
-  jmp     casync_end
+  call    casync_end          # Never returns. "call" keeps the stack aligned
 
-casync_yield:
-  pushfq
-  pushq   %rax
+casync_task_start:
+  movq    %r12, %rdi          # Task argument
+  jmpq    *%r13               # Task function, returns to casync_end_redirect
+  .cfi_endproc
 
+# The frame of a suspended task looks the same on every stack, so the CFI
+# stays valid across the stack switch. casync_restore is entered with an
+# empty frame, and .switch is where both paths meet.
+casync_yield:
+  .cfi_startproc
   LOAD_TLS casync_current_loop
   test    %rax, %rax
   je      .no_loop
 
-  pushq   %rcx
-  pushq   %rdx
-  pushq   %rbx
   pushq   %rbp
-  pushq   %rsi
-  pushq   %rdi
-  pushq   %r8
-  pushq   %r9
-  pushq   %r10
-  pushq   %r11
+  .cfi_adjust_cfa_offset 8
+  .cfi_rel_offset %rbp, 0
+  pushq   %rbx
+  .cfi_adjust_cfa_offset 8
+  .cfi_rel_offset %rbx, 0
   pushq   %r12
+  .cfi_adjust_cfa_offset 8
+  .cfi_rel_offset %r12, 0
   pushq   %r13
+  .cfi_adjust_cfa_offset 8
+  .cfi_rel_offset %r13, 0
   pushq   %r14
+  .cfi_adjust_cfa_offset 8
+  .cfi_rel_offset %r14, 0
   pushq   %r15
+  .cfi_adjust_cfa_offset 8
+  .cfi_rel_offset %r15, 0
+  subq    $8, %rsp
+  .cfi_adjust_cfa_offset 8
+  .cfi_remember_state
 
   movq    (%rax), %rdx        # rdx = casync_current_loop->active
-  movq    8(%rdx), %rcx       # rcx = casync_current_loop->active->next
+  movq    16(%rdx), %rcx      # rcx = casync_current_loop->active->fpu
+  test    %rcx, %rcx
+  jne     .save_fpu
+  stmxcsr (%rsp)
+  fnstcw  4(%rsp)
+.save_done:
   movq    %rsp, (%rdx)        # casync_current_loop->active->stack = rsp
-  movq    %rcx, (%rax)        # casync->current_loop->active = rcx
+  movq    8(%rdx), %rdx       # rdx = casync_current_loop->active->next
+  movq    %rdx, (%rax)        # casync_current_loop->active = rdx
+  jmp     .switch
 
 casync_restore:
+  .cfi_remember_state
+  .cfi_def_cfa_offset 8
+  .cfi_same_value %rbp
+  .cfi_same_value %rbx
+  .cfi_same_value %r12
+  .cfi_same_value %r13
+  .cfi_same_value %r14
+  .cfi_same_value %r15
   LOAD_TLS casync_current_loop
   movq    (%rax), %rdx        # rdx = casync_current_loop->active
+.switch:
+  .cfi_restore_state
   movq    (%rdx), %rsp        # rsp = casync_current_loop->active->stack
+  movq    16(%rdx), %rcx      # rcx = casync_current_loop->active->fpu
+  test    %rcx, %rcx
+  jne     .restore_fpu
+  ldmxcsr (%rsp)
+  fldcw   4(%rsp)
+.restore_done:
+  addq    $8, %rsp
+  .cfi_adjust_cfa_offset -8
   popq    %r15
+  .cfi_adjust_cfa_offset -8
+  .cfi_same_value %r15
   popq    %r14
+  .cfi_adjust_cfa_offset -8
+  .cfi_same_value %r14
   popq    %r13
+  .cfi_adjust_cfa_offset -8
+  .cfi_same_value %r13
   popq    %r12
-  popq    %r11
-  popq    %r10
-  popq    %r9
-  popq    %r8
-  popq    %rdi
-  popq    %rsi
-  popq    %rbp
+  .cfi_adjust_cfa_offset -8
+  .cfi_same_value %r12
   popq    %rbx
-  popq    %rdx
-  popq    %rcx
+  .cfi_adjust_cfa_offset -8
+  .cfi_same_value %rbx
+  popq    %rbp
+  .cfi_adjust_cfa_offset -8
+  .cfi_same_value %rbp
 .no_loop:
-  popq    %rax
-  popfq
   ret
 
+  .cfi_restore_state
+.save_fpu:
+  cmpq    $1, %rcx            # CASYNC_FPU_NONE
+  je      .save_done
+  movq    %rax, %r8
+  movq    %rdx, %r9
+  movq    24(%r9), %r10       # r10 = casync_current_loop->active->fpu_area
+  movl    $0xE7, %eax         # x87, SSE, AVX and AVX-512 state
+  xorl    %edx, %edx
+  cmpq    $2, %rcx            # CASYNC_FPU_FULL
+  jne     .save_xsave
+  xsaveopt (%r10)
+  jmp     .save_fpu_done
+.save_xsave:
+  xsave   (%r10)              # CPU without XSAVEOPT
+.save_fpu_done:
+  movq    %r8, %rax
+  movq    %r9, %rdx
+  jmp     .save_done
+
+.restore_fpu:
+  cmpq    $1, %rcx            # CASYNC_FPU_NONE
+  je      .restore_done
+  movq    24(%rdx), %r10      # r10 = casync_current_loop->active->fpu_area
+  movl    $0xE7, %eax
+  xorl    %edx, %edx
+  xrstor  (%r10)
+  jmp     .restore_done
+  .cfi_endproc
@@ -1,11 +1,35 @@
 # Some notes:
-#   - Floating point registers are not saved/restored
-#   - SIMD registers are not saved/restored
+#   - casync_yield() is an ordinary function call as far as the compiler is
+#     concerned, so only the callee-saved registers need to be preserved across
+#     a context switch: RBX, RBP, RDI, RSI, R12-R15, XMM6-XMM15, the MXCSR
+#     control bits and the x87 control word. Everything else is already
+#     considered clobbered by the caller.
+#   - casync_task::fpu selects whether the control words are saved as well
+#     (CASYNC_FPU_CONTROL, the default), not (CASYNC_FPU_NONE), or whether the
+#     x87, SSE, AVX and AVX-512 state is saved with XSAVEOPT or XSAVE
+#     (CASYNC_FPU_FULL) into the area at casync_task::fpu_area. XMM6-XMM15
+#     are saved in every mode, because the ABI requires it. XSAVE/XRSTOR use
+#     EDX:EAX as the mask of components, so the task pointers are moved to
+#     R8/R9 while saving.
 #   - When calling C functions, the stack pointer must always be aligned to 16
 #     bytes prior to the call. Any C code calling assembly routines will have
 #     aligned the stack pointer to 16 bytes as well. This makes it straight
 #     forward to adjust the stack pointer. On function entry, the stack pointer
-#     will be -4 bytes due to the return address.
+#     will be -8 bytes due to the return address.
+#
+# Stack frame of a suspended task, starting at casync_task::stack:
+#   0   XMM6-XMM15           (10 * 16 bytes)
+#   160 MXCSR                (unused unless CASYNC_FPU_CONTROL)
+#   164 x87 control word     (unused unless CASYNC_FPU_CONTROL)
+#   168 R15
+#   176 R14
+#   184 R13                  (task function when starting a task)
+#   192 R12                  (task argument when starting a task)
+#   200 RSI
+#   208 RDI
+#   216 RBX
+#   224 RBP
+#   232 return address       (casync_task_start when starting a task)
 
 # Windows x64 ABI:
 #   Integer args : RCX, RDX, R8, R9
@@ -19,16 +43,16 @@
   .global casync_yield
   .global casync_restore
   .global casync_end_redirect
+  .global casync_task_start
 
-# Loads a TLS variable into %rax
+# Loads a TLS variable into %rax. Clobbers the volatile registers. Must be
+# used on function entry, where the stack pointer is -8 bytes from alignment
 .macro LOAD_TLS var_name
-  .extern __emutls_v.\var_name:
-  subq    $40, %rsp
+  subq    $40, %rsp           # Shadow space + alignment
   leaq    __emutls_v.\var_name(%rip), %rcx
   call    __emutls_get_address
-  movq    (%rax), %rax
   addq    $40, %rsp
-  ret
+  movq    (%rax), %rax
 .endm
 
 .macro LOAD_GLOBAL var_name reg
@@ -36,61 +60,109 @@
   movq    (\reg), \reg
 .endm
 
-.macro SAVE_CONTEXT
-  pushq   %rax
-  pushq   %rcx
-  pushq   %rdx
-  pushq   %rbx
+casync_end_redirect:
+  movl    %eax, %ecx
+  subq    $32, %rsp           # Shadow space
+  call    casync_end          # Never returns
+
+casync_task_start:
+  movq    %r12, %rcx          # Task argument
+  jmpq    *%r13               # Task function, returns to casync_end_redirect
+
+casync_yield:
+  LOAD_TLS casync_current_loop
+  test    %rax, %rax
+  je      .no_loop
+
   pushq   %rbp
-  pushq   %rsi
+  pushq   %rbx
   pushq   %rdi
-  pushq   %r8
-  pushq   %r9
-  pushq   %r10
-  pushq   %r11
+  pushq   %rsi
   pushq   %r12
   pushq   %r13
   pushq   %r14
   pushq   %r15
-  pushfq
+  subq    $168, %rsp
+  movups  %xmm6, 0(%rsp)
+  movups  %xmm7, 16(%rsp)
+  movups  %xmm8, 32(%rsp)
+  movups  %xmm9, 48(%rsp)
+  movups  %xmm10, 64(%rsp)
+  movups  %xmm11, 80(%rsp)
+  movups  %xmm12, 96(%rsp)
+  movups  %xmm13, 112(%rsp)
+  movups  %xmm14, 128(%rsp)
+  movups  %xmm15, 144(%rsp)
 
-  # *casync_current_loop->active->stack = rsp
-  LOAD_TLS casync_current_loop
-  movq    (%rax), %rax        # Get first field in struct ("stack")
-  movq    %rsp, (%rax)        # Assign current stack pointer to field in struct
-.endm
+  movq    (%rax), %rdx        # rdx = casync_current_loop->active
+  movq    16(%rdx), %rcx      # rcx = casync_current_loop->active->fpu
+  test    %rcx, %rcx
+  jne     .save_fpu
+  stmxcsr 160(%rsp)
+  fnstcw  164(%rsp)
+.save_done:
+  movq    %rsp, (%rdx)        # casync_current_loop->active->stack = rsp
+  movq    8(%rdx), %rdx       # rdx = casync_current_loop->active->next
+  movq    %rdx, (%rax)        # casync_current_loop->active = rdx
+  jmp     .switch
 
-.macro RESTORE_CONTEXT
+casync_restore:
   LOAD_TLS casync_current_loop
-  movq    (%rax), %rax        # Get first field in struct ("stack")
-  movq    (%rax), %rsp        # Assign stored stack pointer to rsp
-
-  popfq
+  movq    (%rax), %rdx        # rdx = casync_current_loop->active
+.switch:
+  movq    (%rdx), %rsp        # rsp = casync_current_loop->active->stack
+  movups  0(%rsp), %xmm6
+  movups  16(%rsp), %xmm7
+  movups  32(%rsp), %xmm8
+  movups  48(%rsp), %xmm9
+  movups  64(%rsp), %xmm10
+  movups  80(%rsp), %xmm11
+  movups  96(%rsp), %xmm12
+  movups  112(%rsp), %xmm13
+  movups  128(%rsp), %xmm14
+  movups  144(%rsp), %xmm15
+  movq    16(%rdx), %rcx      # rcx = casync_current_loop->active->fpu
+  test    %rcx, %rcx
+  jne     .restore_fpu
+  ldmxcsr 160(%rsp)
+  fldcw   164(%rsp)
+.restore_done:
+  addq    $168, %rsp
   popq    %r15
   popq    %r14
   popq    %r13
   popq    %r12
-  popq    %r11
-  popq    %r10
-  popq    %r9
-  popq    %r8
-  popq    %rdi
   popq    %rsi
-  popq    %rbp
+  popq    %rdi
   popq    %rbx
-  popq    %rdx
-  popq    %rcx
-  popq    %rax
-.endm
+  popq    %rbp
+.no_loop:
+  ret
 
-casync_end_redirect:
-  movl    %eax, %ecx
-  jmp     casync_end
+.save_fpu:
+  cmpq    $1, %rcx            # CASYNC_FPU_NONE
+  je      .save_done
+  movq    %rax, %r8
+  movq    %rdx, %r9
+  movq    24(%r9), %r10       # r10 = casync_current_loop->active->fpu_area
+  movl    $0xE7, %eax         # x87, SSE, AVX and AVX-512 state
+  xorl    %edx, %edx
+  cmpq    $2, %rcx            # CASYNC_FPU_FULL
+  jne     .save_xsave
+  xsaveopt (%r10)
+  jmp     .save_fpu_done
+.save_xsave:
+  xsave   (%r10)              # CPU without XSAVEOPT
+.save_fpu_done:
+  movq    %r8, %rax
+  movq    %r9, %rdx
+  jmp     .save_done
 
-casync_yield:
-  SAVE_CONTEXT
-  leaq    -8(%rsp), %rsp     # Align
-  call    casync_task_switch # Call scheduler
-casync_restore:
-  RESTORE_CONTEXT            # Restore context of new task
-  ret                        # "Return" to the task function
+.restore_fpu:
+  cmpq    $1, %rcx            # CASYNC_FPU_NONE
+  je      .restore_done
+  movq    24(%rdx), %r10      # r10 = casync_current_loop->active->fpu_area
+  movl    $0xE7, %eax
+  xorl    %edx, %edx
+  xrstor  (%r10)
+  jmp     .restore_done
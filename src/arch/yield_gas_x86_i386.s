@@ -1,11 +1,30 @@
 # Some notes:
-#   - Floating point registers are not saved/restored
-#   - SIMD registers are not saved/restored
+#   - casync_yield() is an ordinary function call as far as the compiler is
+#     concerned, so only the callee-saved registers need to be preserved across
+#     a context switch: EBX, ESI, EDI, EBP, the MXCSR control bits and the x87
+#     control word. Everything else is already considered clobbered by the
+#     caller. Saving MXCSR requires SSE.
+#   - SIMD registers are all caller-saved in this ABI and are not saved.
+#   - casync_task::fpu selects what else is saved: the control words
+#     (CASYNC_FPU_CONTROL, the default), nothing (CASYNC_FPU_NONE), or the
+#     x87, SSE, AVX and AVX-512 state with XSAVEOPT or XSAVE (CASYNC_FPU_FULL)
+#     into the area at casync_task::fpu_area. XSAVE/XRSTOR use EDX:EAX as the
+#     mask of components. The callee-saved registers are free to use once they
+#     are pushed, so they hold the task pointers while saving.
 #   - When calling C functions, the stack pointer must always be aligned to 16
 #     bytes prior to the call. Any C code calling assembly routines will have
 #     aligned the stack pointer to 16 bytes as well. This makes it straight
 #     forward to adjust the stack pointer. On function entry, the stack pointer
 #     will be -4 bytes due to the return address.
+#
+# Stack frame of a suspended task, starting at casync_task::stack:
+#   0   MXCSR                (unused unless CASYNC_FPU_CONTROL)
+#   4   x87 control word     (unused unless CASYNC_FPU_CONTROL)
+#   8   EDI
+#   12  ESI
+#   16  EBX
+#   20  EBP
+#   24  return address       (task function when starting a task)
 
 .section .note.GNU-stack
 
@@ -36,28 +55,116 @@
   movl    (\reg), \reg
 .endm
 
+# casync_end_redirect is the return address of every task function, so this
+# is where unwinders end up at the bottom of a task's stack. Unwinders look up
+# the return address minus one, hence the nop.
+  .cfi_startproc
+  .cfi_undefined %eip
+  nop
 casync_end_redirect:
-  pushl   %eax
-  pushl   $0
-  jmp     casync_end
+  subl    $12, %esp           # Align stack to 16 bytes before call
+  pushl   %eax                # Return value of task
+  call    casync_end          # Never returns
+  .cfi_endproc
 
+# The frame of a suspended task looks the same on every stack, so the CFI
+# stays valid across the stack switch. casync_restore is entered with an
+# empty frame, and .switch is where both paths meet.
 casync_yield:
-  pushfl                      # eflags register
-  pushal                      # eax, ecx, edx, ebx, esp, ebp, esi, edi
-
+  .cfi_startproc
   LOAD_TLS casync_current_loop
   test    %eax, %eax
   je      .no_loop
 
+  pushl   %ebp
+  .cfi_adjust_cfa_offset 4
+  .cfi_rel_offset %ebp, 0
+  pushl   %ebx
+  .cfi_adjust_cfa_offset 4
+  .cfi_rel_offset %ebx, 0
+  pushl   %esi
+  .cfi_adjust_cfa_offset 4
+  .cfi_rel_offset %esi, 0
+  pushl   %edi
+  .cfi_adjust_cfa_offset 4
+  .cfi_rel_offset %edi, 0
+  subl    $8, %esp
+  .cfi_adjust_cfa_offset 8
+  .cfi_remember_state
+
   movl    (%eax), %edx        # edx = casync_current_loop->active
-  movl    4(%edx), %ecx       # rcx = casync_current_loop->active->next
+  movl    8(%edx), %ecx       # ecx = casync_current_loop->active->fpu
+  test    %ecx, %ecx
+  jne     .save_fpu
+  stmxcsr (%esp)
+  fnstcw  4(%esp)
+.save_done:
   movl    %esp, (%edx)        # casync_current_loop->active->stack = esp
-  movl    %ecx, (%eax)        # casync_current_loop->active = ecx
+  movl    4(%edx), %edx       # edx = casync_current_loop->active->next
+  movl    %edx, (%eax)        # casync_current_loop->active = edx
+  jmp     .switch
+
 casync_restore:
+  .cfi_remember_state
+  .cfi_def_cfa_offset 4
+  .cfi_same_value %ebp
+  .cfi_same_value %ebx
+  .cfi_same_value %esi
+  .cfi_same_value %edi
   LOAD_TLS casync_current_loop
-  movl    (%eax), %edx        # Get first field in struct ("stack")
-  movl    (%edx), %esp        # Assign stored stack pointer to esp
+  movl    (%eax), %edx        # edx = casync_current_loop->active
+.switch:
+  .cfi_restore_state
+  movl    (%edx), %esp        # esp = casync_current_loop->active->stack
+  movl    8(%edx), %ecx       # ecx = casync_current_loop->active->fpu
+  test    %ecx, %ecx
+  jne     .restore_fpu
+  ldmxcsr (%esp)
+  fldcw   4(%esp)
+.restore_done:
+  addl    $8, %esp
+  .cfi_adjust_cfa_offset -8
+  popl    %edi
+  .cfi_adjust_cfa_offset -4
+  .cfi_same_value %edi
+  popl    %esi
+  .cfi_adjust_cfa_offset -4
+  .cfi_same_value %esi
+  popl    %ebx
+  .cfi_adjust_cfa_offset -4
+  .cfi_same_value %ebx
+  popl    %ebp
+  .cfi_adjust_cfa_offset -4
+  .cfi_same_value %ebp
 .no_loop:
-  popal                       # eax, ecx, edx, ebx, esp, ebp, esi, edi
-  popfl                       # eflags register
   ret                         # "Return" to the task function
+
+  .cfi_restore_state
+.save_fpu:
+  cmpl    $1, %ecx            # CASYNC_FPU_NONE
+  je      .save_done
+  movl    %eax, %esi
+  movl    %edx, %edi
+  movl    12(%edi), %ebx      # ebx = casync_current_loop->active->fpu_area
+  movl    $0xE7, %eax         # x87, SSE, AVX and AVX-512 state
+  xorl    %edx, %edx
+  cmpl    $2, %ecx            # CASYNC_FPU_FULL
+  jne     .save_xsave
+  xsaveopt (%ebx)
+  jmp     .save_fpu_done
+.save_xsave:
+  xsave   (%ebx)              # CPU without XSAVEOPT
+.save_fpu_done:
+  movl    %esi, %eax
+  movl    %edi, %edx
+  jmp     .save_done
+
+.restore_fpu:
+  cmpl    $1, %ecx            # CASYNC_FPU_NONE
+  je      .restore_done
+  movl    12(%edx), %ecx      # ecx = casync_current_loop->active->fpu_area
+  movl    $0xE7, %eax
+  xorl    %edx, %edx
+  xrstor  (%ecx)
+  jmp     .restore_done
+  .cfi_endproc
@@ -1,11 +1,16 @@
 ; Some notes:
-;   - Floating point registers are not saved/restored
-;   - SIMD registers are not saved/restored
+;   - casync_yield() is an ordinary function call as far as the compiler is
+;     concerned, so only the callee-saved registers need to be preserved across
+;     a context switch: RBX, RBP, RDI, RSI, R12-R15, XMM6-XMM15, the MXCSR
+;     control bits and the x87 control word. Everything else is already
+;     considered clobbered by the caller.
 ;   - When calling C functions, the stack pointer must always be aligned to 16
 ;     bytes prior to the call. Any C code calling assembly routines will have
 ;     aligned the stack pointer to 16 bytes as well. This makes it straight
 ;     forward to adjust the stack pointer. On function entry, the stack pointer
-;     will be -4 bytes due to the return address.
+;     will be -8 bytes due to the return address.
+;   - The stack frame layout and the handling of casync_task::fpu are the same
+;     as in yield_gas_x86_64_win64.s
 
 ; Windows x64 ABI:
 ;   Integer args : RCX, RDX, R8, R9
@@ -20,72 +25,128 @@
   PUBLIC casync_yield
   PUBLIC casync_restore
   PUBLIC casync_end_redirect
+  PUBLIC casync_task_start
 
+; Loads a TLS variable into rax. Only clobbers volatile registers
 LOAD_TLS MACRO var_name
   mov     ecx, DWORD PTR _tls_index
   mov     rax, gs:[58h]
-  mov     ebx, SECTIONREL var_name
-  movsxd  rbx, ebx
+  mov     r8d, SECTIONREL var_name
   mov     rdx, [rax+rcx*8]
-  mov     rax, [rdx+rbx]
+  mov     rax, [rdx+r8]
 ENDM
 
 casync_end_redirect PROC
   mov     ecx, eax
-  jmp     casync_end
+  sub     rsp, 32             ; Shadow space
+  call    casync_end          ; Never returns
 casync_end_redirect ENDP
 
-casync_yield PROC
-  pushfq
-  push    rax
-  push    rcx
-  push    rdx
-  push    rbx
+casync_task_start PROC
+  mov     rcx, r12            ; Task argument
+  jmp     r13                 ; Task function, returns to casync_end_redirect
+casync_task_start ENDP
 
+casync_yield PROC
   LOAD_TLS casync_current_loop
   test    rax, rax
-  je      .no_loop
+  je      no_loop
 
   push    rbp
-  push    rsi
+  push    rbx
   push    rdi
-  push    r8
-  push    r9
-  push    r10
-  push    r11
+  push    rsi
   push    r12
   push    r13
   push    r14
   push    r15
+  sub     rsp, 168
+  movups  [rsp], xmm6
+  movups  [rsp+16], xmm7
+  movups  [rsp+32], xmm8
+  movups  [rsp+48], xmm9
+  movups  [rsp+64], xmm10
+  movups  [rsp+80], xmm11
+  movups  [rsp+96], xmm12
+  movups  [rsp+112], xmm13
+  movups  [rsp+128], xmm14
+  movups  [rsp+144], xmm15
 
   mov     rdx, [rax]          ; rdx = casync_current_loop->active
-  mov     rcx, [rdx+8]        ; rcx = casync_current_loop->active->next
+  mov     rcx, [rdx+16]       ; rcx = casync_current_loop->active->fpu
+  test    rcx, rcx
+  jne     save_fpu
+  stmxcsr DWORD PTR [rsp+160]
+  fnstcw  WORD PTR [rsp+164]
+save_done:
   mov     [rdx], rsp          ; casync_current_loop->active->stack = rsp
-  mov     [rax], rcx          ; casync->current_loop->active = rcx
+  mov     rdx, [rdx+8]        ; rdx = casync_current_loop->active->next
+  mov     [rax], rdx          ; casync_current_loop->active = rdx
+  jmp     casync_switch
+
+no_loop:
+  ret
+
+save_fpu:
+  cmp     rcx, 1              ; CASYNC_FPU_NONE
+  je      save_done
+  mov     r8, rax
+  mov     r9, rdx
+  mov     r10, [r9+24]        ; r10 = casync_current_loop->active->fpu_area
+  mov     eax, 0E7h           ; x87, SSE, AVX and AVX-512 state
+  xor     edx, edx
+  cmp     rcx, 2              ; CASYNC_FPU_FULL
+  jne     save_xsave
+  xsaveopt [r10]
+  jmp     save_fpu_done
+save_xsave:
+  xsave   [r10]               ; CPU without XSAVEOPT
+save_fpu_done:
+  mov     rax, r8
+  mov     rdx, r9
+  jmp     save_done
+casync_yield ENDP
 
 casync_restore PROC
-  LOAD_TLS rax, casync_current_loop
+  LOAD_TLS casync_current_loop
   mov     rdx, [rax]          ; rdx = casync_current_loop->active
+casync_switch::
   mov     rsp, [rdx]          ; rsp = casync_current_loop->active->stack
+  movups  xmm6, [rsp]
+  movups  xmm7, [rsp+16]
+  movups  xmm8, [rsp+32]
+  movups  xmm9, [rsp+48]
+  movups  xmm10, [rsp+64]
+  movups  xmm11, [rsp+80]
+  movups  xmm12, [rsp+96]
+  movups  xmm13, [rsp+112]
+  movups  xmm14, [rsp+128]
+  movups  xmm15, [rsp+144]
+  mov     rcx, [rdx+16]       ; rcx = casync_current_loop->active->fpu
+  test    rcx, rcx
+  jne     restore_fpu
+  ldmxcsr DWORD PTR [rsp+160]
+  fldcw   WORD PTR [rsp+164]
+restore_done:
+  add     rsp, 168
   pop     r15
   pop     r14
   pop     r13
   pop     r12
-  pop     r11
-  pop     r10
-  pop     r9
-  pop     r8
-  pop     rdi
   pop     rsi
-  pop     rbp
-.no_loop:
+  pop     rdi
   pop     rbx
-  pop     rdx
-  pop     rcx
-  pop     rax
-  popfq
+  pop     rbp
   ret
+
+restore_fpu:
+  cmp     rcx, 1              ; CASYNC_FPU_NONE
+  je      restore_done
+  mov     r10, [rdx+24]       ; r10 = casync_current_loop->active->fpu_area
+  mov     eax, 0E7h
+  xor     edx, edx
+  xrstor  [r10]
+  jmp     restore_done
 casync_restore ENDP
-casync_yield ENDP
 
 END
@@ -0,0 +1,50 @@
+#include "../casync_internal.h"
+
+#include <stdlib.h>
+#include <ucontext.h>
+
+/*
+ * Some notes:
+ *   - casync_task::stack points to the ucontext_t the task was suspended
+ *     into. casync_yield() keeps it in its own frame, so like the assembly
+ *     backends nothing outside the task's stack is needed to resume it.
+ *   - swapcontext() saves more than the assembly backends do, including the
+ *     floating point environment, and usually the signal mask with a system
+ *     call. This backend is meant to run everywhere, not to be fast. Compare
+ *     casync_bench with casync_bench_ucontext to see the difference.
+ */
+
+/* The instrumented wrapper calls this one, see src/instrument.c */
+#undef casync_yield
+
+/* -------------------------------------------------------------------------- */
+void casync_yield(void)
+{
+    struct casync_loop* loop = casync_current_loop;
+    struct casync_task* task;
+    ucontext_t          context;
+
+    if (loop == NULL)
+        return;
+
+    task = loop->active;
+    task->stack = &context;
+    loop->active = task->next;
+    if (swapcontext(&context, loop->active->stack) != 0)
+        abort();
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_restore(void)
+{
+    setcontext(casync_current_loop->active->stack);
+    abort();
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_end_redirect(void)
+{
+    /* Only exists for casync.c to pass to casync_init_stack(). Tasks end in
+     * task_start() of stack_ucontext.c */
+    abort();
+}
@@ -0,0 +1,305 @@
+#include "casync_internal.h"
+
+#include <stdlib.h>
+
+/*
+ * Offloads blocking calls to a process-wide pool of threads. The threads are
+ * started on demand, up to the limit, and then wait for more work until the
+ * process exits.
+ *
+ * Each thread that calls casync_run_blocking() from inside a gather has a
+ * port: a notifier the pool threads signal when a call finished, and the list
+ * of finished calls. One of the co-routines waiting for a call leads. It waits
+ * on the notifier with casync_wait_fd(), so the reactor sleeps as usual while
+ * nothing is runnable, and wakes the others as their calls finish. Once its
+ * own call finished, it hands the lead to one that is still waiting. This
+ * needs no extra co-routine, and works with every reactor.
+ */
+
+#define DEFAULT_MAX_THREADS 64
+
+struct blocking_port;
+
+struct blocking_job
+{
+    int (*function)(void*);
+    void*                 arg;
+    int                   result;
+    int                   delivered;
+    struct casync_task*   task;
+    struct blocking_port* port;
+    struct blocking_job*  next; /* Pool queue, then the port's finished list */
+    struct blocking_job*  waiting_next;
+    struct blocking_job*  waiting_prev;
+};
+
+struct blocking_port
+{
+    void*                lock;
+    void*                notifier;
+    struct blocking_job* finished; /* Protected by lock */
+    struct blocking_job* waiting;  /* Only touched by the owning thread */
+    struct blocking_job* leader;
+};
+
+struct pool
+{
+    void*                lock;
+    void*                cond;
+    struct blocking_job* head;
+    struct blocking_job* tail;
+    int                  threads;
+    int                  idle;
+    int                  max_threads; /* 0 for the default */
+};
+
+static struct pool   pool;
+static volatile long pool_initialized;
+static int           pool_failed;
+
+static THREADLOCAL struct blocking_port* current_port;
+
+/* -------------------------------------------------------------------------- */
+static void pool_create(void)
+{
+    pool.lock = casync_thread_mutex_create();
+    pool.cond = casync_thread_cond_create();
+    pool_failed = pool.lock == NULL || pool.cond == NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+static int pool_init(void)
+{
+    /* Whoever comes first initializes, everyone else waits for it */
+    casync_thread_once(&pool_initialized, pool_create);
+    return pool_failed ? -1 : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void port_complete(struct blocking_job* job)
+{
+    struct blocking_port* port = job->port;
+
+    /* Signal while holding the lock. Once the owner took the job off the
+     * list, it may destroy the port */
+    casync_thread_mutex_lock(port->lock);
+    job->next = port->finished;
+    port->finished = job;
+    casync_thread_notifier_signal(port->notifier);
+    casync_thread_mutex_unlock(port->lock);
+}
+
+/* -------------------------------------------------------------------------- */
+static void pool_thread(void* arg)
+{
+    struct blocking_job* job;
+    (void)arg;
+
+    casync_thread_mutex_lock(pool.lock);
+    while (1)
+    {
+        while (pool.head == NULL)
+        {
+            pool.idle++;
+            casync_thread_cond_wait(pool.cond, pool.lock);
+            pool.idle--;
+        }
+        job = pool.head;
+        pool.head = job->next;
+        if (pool.head == NULL)
+            pool.tail = NULL;
+        casync_thread_mutex_unlock(pool.lock);
+
+        job->result = job->function(job->arg);
+        port_complete(job);
+
+        casync_thread_mutex_lock(pool.lock);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+static int pool_submit(struct blocking_job* job)
+{
+    int max_threads;
+
+    casync_thread_mutex_lock(pool.lock);
+    max_threads = pool.max_threads ? pool.max_threads : DEFAULT_MAX_THREADS;
+    if (pool.idle == 0 && pool.threads < max_threads &&
+        casync_thread_start(pool_thread, NULL) != NULL)
+        pool.threads++;
+    if (pool.threads == 0)
+    {
+        casync_thread_mutex_unlock(pool.lock);
+        return -1;
+    }
+
+    job->next = NULL;
+    if (pool.tail)
+        pool.tail->next = job;
+    else
+        pool.head = job;
+    pool.tail = job;
+    casync_thread_cond_signal(pool.cond);
+    casync_thread_mutex_unlock(pool.lock);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static struct blocking_port* port_get(void)
+{
+    struct blocking_port* port = current_port;
+    if (port != NULL)
+        return port;
+
+    if ((port = calloc(1, sizeof *port)) == NULL)
+        return NULL;
+    if ((port->lock = casync_thread_mutex_create()) == NULL)
+    {
+        free(port);
+        return NULL;
+    }
+    if ((port->notifier = casync_thread_notifier_create()) == NULL)
+    {
+        casync_thread_mutex_destroy(port->lock);
+        free(port);
+        return NULL;
+    }
+
+    current_port = port;
+    return port;
+}
+
+/* -------------------------------------------------------------------------- */
+static void port_destroy(struct blocking_port* port)
+{
+    casync_thread_notifier_destroy(port->notifier);
+    casync_thread_mutex_destroy(port->lock);
+    free(port);
+    current_port = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+static void port_unlink(struct blocking_port* port, struct blocking_job* job)
+{
+    if (job->waiting_prev)
+        job->waiting_prev->waiting_next = job->waiting_next;
+    else
+        port->waiting = job->waiting_next;
+    if (job->waiting_next)
+        job->waiting_next->waiting_prev = job->waiting_prev;
+}
+
+/* -------------------------------------------------------------------------- */
+static void port_deliver(struct blocking_port* port)
+{
+    struct blocking_job* job;
+    struct blocking_job* next;
+
+    casync_thread_mutex_lock(port->lock);
+    casync_thread_notifier_drain(port->notifier);
+    job = port->finished;
+    port->finished = NULL;
+    casync_thread_mutex_unlock(port->lock);
+
+    for (; job != NULL; job = next)
+    {
+        next = job->next;
+        job->delivered = 1;
+        port_unlink(port, job);
+        if (job != port->leader)
+            casync_wake(job->task);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+static void port_lead(struct blocking_port* port, struct blocking_job* job)
+{
+    struct casync_task* task = casync_current_loop->active;
+    int                 fd = casync_thread_notifier_fd(port->notifier);
+    int                 canceled = task->canceled;
+
+    /* Everyone else waits for us, so cancellation can't stop us. It is only
+     * put back once we are done */
+    while (!job->delivered)
+    {
+        task->canceled = 0;
+        if (casync_wait_fd(fd, CASYNC_READ) == -1)
+            casync_yield(); /* Out of memory in the reactor, keep polling */
+        canceled |= task->canceled;
+        port_deliver(port);
+    }
+    task->canceled = canceled;
+
+    /* Pass the lead on to a co-routine that is still waiting, or close the
+     * port if there is none */
+    port->leader = port->waiting;
+    if (port->leader)
+        casync_wake(port->leader->task);
+    else
+        port_destroy(port);
+}
+
+/* -------------------------------------------------------------------------- */
+static int job_unpark(void* ctx)
+{
+    /* The function is running on another thread and uses our stack, so we
+     * wait for it even if canceled */
+    (void)ctx;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_run_blocking(int (*function)(void*), void* arg)
+{
+    struct casync_loop*   loop = casync_current_loop;
+    struct blocking_port* port;
+    struct blocking_job   job;
+
+    /* The pool's threads would use our stack while a shared one isn't ours,
+     * see casync_attr::shared_stack. Call it here instead */
+    if (loop == NULL || loop->active->shared || pool_init() != 0 ||
+        (port = port_get()) == NULL)
+        return function(arg);
+
+    job.function = function;
+    job.arg = arg;
+    job.delivered = 0;
+    job.task = loop->active;
+    job.port = port;
+    job.waiting_prev = NULL;
+    job.waiting_next = port->waiting;
+    if (port->waiting)
+        port->waiting->waiting_prev = &job;
+    port->waiting = &job;
+
+    /* Without any thread, run it here after all */
+    if (pool_submit(&job) != 0)
+    {
+        port_unlink(port, &job);
+        if (port->waiting == NULL)
+            port_destroy(port);
+        return function(arg);
+    }
+
+    if (port->leader == NULL)
+        port->leader = &job;
+    while (!job.delivered)
+    {
+        if (port->leader == &job)
+            port_lead(port, &job);
+        else
+            casync_park(job_unpark, &job);
+    }
+
+    return job.result;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_run_blocking_threads(int max_threads)
+{
+    if (pool_init() != 0)
+        return;
+    casync_thread_mutex_lock(pool.lock);
+    pool.max_threads = max_threads > 0 ? max_threads : 0;
+    casync_thread_mutex_unlock(pool.lock);
+}
@@ -1,51 +1,98 @@
-#include "casync/casync.h"
+#include "casync_internal.h"
 
 #include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
 
-#if defined(_MSC_VER)
-#    define THREADLOCAL __declspec(thread)
-#else
-#    define THREADLOCAL __thread
-#endif
-
-struct casync_task
-{
-    void*               stack;
-    struct casync_task* next;
-    size_t              stack_size;
-};
+/* Rounds a runnable level may be passed over, per level of difference */
+#define STARVATION_ROUNDS 4
 
-struct casync_loop
-{
-    struct casync_task* active;
-    struct casync_task* finished;
-    struct casync_task  control_task;
-    int                 return_code;
-};
+/* How often a loop that is never idle checks for I/O, see loop_poll() */
+#define BUSY_POLL_NS 50000
 
 THREADLOCAL struct casync_loop* casync_current_loop;
 
 void casync_end_redirect(void);
 void casync_restore(void);
 
+/* -------------------------------------------------------------------------- */
+static struct casync_task* loop_unlink(struct casync_task* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    return t->prev;
+}
+
+/* -------------------------------------------------------------------------- */
+static void handle_complete(struct casync_handle* handle, int return_code)
+{
+    if (handle->detached)
+    {
+        free(handle);
+        return;
+    }
+
+    handle->done = 1;
+    handle->task = NULL;
+    handle->return_code = return_code;
+
+    /* casync_join_any() waits on several handles at once. Only the first to
+     * complete may wake it */
+    if (handle->wait != NULL && !handle->wait->woken)
+    {
+        handle->wait->woken = 1;
+        casync_wake(handle->wait->task);
+    }
+}
+
 /* -------------------------------------------------------------------------- */
 void casync_end(int return_code)
 {
     struct casync_task* t = casync_current_loop->active;
-    if (return_code != 0)
+
+#if defined(CASYNC_STATS)
+    casync_stats_task_end(t);
+#endif
+
+    /* The return code of a joinable task goes to whoever joins it. This has
+     * to happen while we are still in the ring, because waking a task inserts
+     * it next to the active one */
+    if (t->handle != NULL)
+        handle_complete(t->handle, return_code);
+    else if (return_code != 0)
         casync_current_loop->return_code = return_code;
 
+    if (t->deadline.index >= 0)
+        casync_timer_remove(t->loop->root, &t->deadline);
+    if (t->live_prev)
+        t->live_prev->live_next = t->live_next;
+    else
+        t->loop->live = t->live_next;
+    if (t->live_next)
+        t->live_next->live_prev = t->live_prev;
+
+    if (t->shared)
+        casync_shared_task_end(t);
+
     /* Take current task out of the loop */
-    struct casync_task* prev = t;
-    while (prev->next != t)
-        prev = prev->next;
-    prev->next = t->next;
+    struct casync_task* prev = loop_unlink(t);
+#if defined(CASYNC_TRACE)
+    casync_trace_task_end(t, prev->next);
+#endif
 
-    /* Insert active task into finished list */
-    t->next = casync_current_loop->finished;
-    casync_current_loop->finished = t;
+    /* Insert active task into finished list. Stacks of the pool of
+     * casync_gather_static() go right back to it, others are freed by the
+     * next start, since we are still running on the stack */
+    if (t->pooled)
+    {
+        t->next = casync_current_loop->finished;
+        casync_current_loop->finished = t;
+    }
+    else
+    {
+        t->next = casync_current_loop->ended;
+        casync_current_loop->ended = t;
+    }
 
     /* Switch to next active task */
     casync_current_loop->active = prev->next;
@@ -55,11 +102,357 @@ void casync_end(int return_code)
 /* -------------------------------------------------------------------------- */
 static void loop_schedule(struct casync_loop* loop, struct casync_task* task)
 {
-    struct casync_task* prev = loop->active;
-    while (prev->next != loop->active)
-        prev = prev->next;
+    /* Insert behind the active task, so the new task runs last */
+    struct casync_task* prev = loop->active->prev;
     prev->next = task;
+    task->prev = prev;
     task->next = loop->active;
+    loop->active->prev = task;
+}
+
+/* -------------------------------------------------------------------------- */
+static void
+loop_schedule_next(struct casync_loop* loop, struct casync_task* task)
+{
+    /* Insert in front of the active task, so the new task runs next */
+    struct casync_task* next = loop->active->next;
+    task->prev = loop->active;
+    task->next = next;
+    next->prev = task;
+    loop->active->next = task;
+}
+
+/* -------------------------------------------------------------------------- */
+static void loop_schedule_chain(
+    struct casync_loop* loop, struct casync_task* head, struct casync_task* tail)
+{
+    /* Same as scheduling each task of the chain in turn */
+    struct casync_task* prev = loop->active->prev;
+    prev->next = head;
+    head->prev = prev;
+    tail->next = loop->active;
+    loop->active->prev = tail;
+}
+
+/* -------------------------------------------------------------------------- */
+static void queue_push(struct casync_loop* loop, struct casync_task* task)
+{
+    int level = task->priority - CASYNC_PRIORITY_LOW;
+    task->next = NULL;
+    if (loop->queue_tail[level])
+        loop->queue_tail[level]->next = task;
+    else
+        loop->queue_head[level] = task;
+    loop->queue_tail[level] = task;
+}
+
+/* -------------------------------------------------------------------------- */
+static void loop_ready(struct casync_loop* loop, struct casync_task* task)
+{
+    int level = task->priority - CASYNC_PRIORITY_LOW;
+
+    if (!loop->prioritized ||
+        (level >= loop->round_min && level <= loop->round_max))
+        loop_schedule(loop, task);
+    else if (level > loop->round_max)
+        loop_schedule_next(loop, task);
+    else
+        queue_push(loop, task);
+}
+
+/* -------------------------------------------------------------------------- */
+static void loop_rebalance(struct casync_loop* loop)
+{
+    struct casync_task* control = &loop->control_task;
+    struct casync_task* t;
+    struct casync_task* next;
+    int                 level, top = -1;
+
+    /* Sort the tasks that are still runnable back into their levels, keeping
+     * their order */
+    for (t = control->next; t != control; t = next)
+    {
+        next = t->next;
+        queue_push(loop, t);
+    }
+    control->next = control;
+    control->prev = control;
+    loop->round_min = 0;
+
+    for (level = CASYNC_PRIORITY_LEVELS - 1; level >= 0; --level)
+    {
+        if (loop->queue_head[level] == NULL)
+        {
+            loop->skipped[level] = 0;
+            continue;
+        }
+        if (top < 0)
+            top = level;
+        else if (++loop->skipped[level] < STARVATION_ROUNDS * (top - level))
+            continue;
+
+        /* Append the level's queue to the ring */
+        loop->skipped[level] = 0;
+        loop->round_min = level;
+        for (t = loop->queue_head[level]; t; t = next)
+        {
+            next = t->next;
+            loop_schedule(loop, t);
+        }
+        loop->queue_head[level] = NULL;
+        loop->queue_tail[level] = NULL;
+    }
+
+    loop->round_max = top;
+}
+
+/* -------------------------------------------------------------------------- */
+static int loop_idle(struct casync_loop* loop)
+{
+    int level;
+    if (&loop->control_task != loop->control_task.next)
+        return 0;
+    if (loop->prioritized)
+        for (level = 0; level != CASYNC_PRIORITY_LEVELS; ++level)
+            if (loop->queue_head[level])
+                return 0;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_park(int (*unpark)(void* ctx), void* ctx)
+{
+    struct casync_loop* loop = casync_current_loop;
+    struct casync_task* task = loop->active;
+
+    if (task->canceled && unpark != NULL)
+    {
+        if (unpark(ctx))
+            return CASYNC_ECANCELED;
+        unpark = NULL;
+    }
+
+    /* The task keeps its "next" pointer, so casync_yield() will still switch
+     * to the task that followed it in the ring */
+    task->unpark = unpark;
+    task->unpark_ctx = ctx;
+#if defined(CASYNC_TRACE)
+    casync_trace_park(task);
+#endif
+    loop_unlink(task);
+    loop->parked++;
+    casync_yield();
+
+    if (task->interrupted)
+    {
+        task->interrupted = 0;
+        return CASYNC_ECANCELED;
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_wake(struct casync_task* task)
+{
+    struct casync_loop* loop = task->loop;
+#if defined(CASYNC_TRACE)
+    casync_trace_wake(task);
+#endif
+    task->unpark = NULL;
+    loop_ready(loop, task);
+    loop->parked--;
+
+    /* The loop parked its host task when it ran out of runnable tasks */
+    if (loop->host != NULL)
+    {
+        struct casync_task* host = loop->host;
+        loop->host = NULL;
+        casync_wake(host);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+static void loop_cancel(struct casync_loop* loop);
+static void task_cancel(struct casync_task* task)
+{
+    int (*unpark)(void*) = task->unpark;
+    if (task->canceled)
+        return;
+    task->canceled = 1;
+
+    /* A task running a nested gather waits for the gather's tasks, so cancel
+     * those instead. The gather returns once they have all given up */
+    if (task->inner != NULL)
+    {
+        loop_cancel(task->inner);
+        return;
+    }
+
+    if (unpark == NULL)
+        return;
+    task->unpark = NULL;
+    if (unpark(task->unpark_ctx))
+    {
+        task->interrupted = 1;
+        casync_wake(task);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+static void loop_cancel(struct casync_loop* loop)
+{
+    struct casync_task* t;
+    loop->canceled = 1;
+    for (t = loop->live; t; t = t->live_next)
+        task_cancel(t);
+}
+
+/* -------------------------------------------------------------------------- */
+static void deadline_expire(struct casync_timer* timer)
+{
+    task_cancel(timer->task);
+}
+
+/* -------------------------------------------------------------------------- */
+static int task_set_deadline(struct casync_task* task, uint64_t deadline_ns)
+{
+    struct casync_loop* root = task->loop->root;
+    if (task->deadline.index >= 0)
+        casync_timer_remove(root, &task->deadline);
+    if (deadline_ns == 0)
+        return 0;
+
+    task->deadline.deadline = deadline_ns;
+    return casync_timer_add(root, &task->deadline);
+}
+
+/* -------------------------------------------------------------------------- */
+static int wait_queue_unpark(void* ctx)
+{
+    struct casync_waiter*     waiter = ctx;
+    struct casync_wait_queue* queue = waiter->queue;
+    struct casync_waiter*     prev = NULL;
+    struct casync_waiter*     w;
+
+    for (w = queue->head; w != waiter; w = w->next)
+        prev = w;
+    if (prev)
+        prev->next = waiter->next;
+    else
+        queue->head = waiter->next;
+    if (queue->tail == waiter)
+        queue->tail = prev;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_wait_queue_park(struct casync_wait_queue* queue)
+{
+    struct casync_waiter  local;
+    struct casync_waiter* waiter = casync_wait_area(&local, sizeof local);
+    waiter->task = casync_current_loop->active;
+    waiter->next = NULL;
+    waiter->queue = queue;
+    if (queue->tail)
+        queue->tail->next = waiter;
+    else
+        queue->head = waiter;
+    queue->tail = waiter;
+
+    return casync_park(wait_queue_unpark, waiter);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_wait_queue_wake(struct casync_wait_queue* queue)
+{
+    struct casync_waiter* waiter = queue->head;
+    if (waiter == NULL)
+        return 0;
+
+    queue->head = waiter->next;
+    if (queue->head == NULL)
+        queue->tail = NULL;
+    casync_wake(waiter->task);
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+static void task_init(
+    struct casync_loop*       loop,
+    struct casync_task*       task,
+    const struct casync_attr* attr,
+    int (*function)(void*),
+    void* arg)
+{
+    int    fpu = attr ? attr->fpu : CASYNC_FPU_CONTROL;
+    size_t stack_size;
+
+    /* There is no room for an XSAVE area on a shared stack */
+    if (task->shared && fpu == CASYNC_FPU_FULL)
+        fpu = CASYNC_FPU_CONTROL;
+
+    /* The stack cache sorts tasks by stack_size, so it stays unchanged even if
+     * part of the stack is used for FPU state */
+    stack_size = casync_fpu_init(task, fpu);
+#if defined(CASYNC_STATS)
+    casync_stats_task_start(loop, task, stack_size);
+#endif
+    if (task->shared)
+        casync_shared_task_start(task, function, arg);
+    else
+        task->stack = casync_init_stack(
+            function,
+            arg,
+            casync_end_redirect,
+            task->stack_base,
+            (int)stack_size);
+    task->loop = loop;
+    task->name = attr ? attr->name : NULL;
+    task->priority = CASYNC_PRIORITY_NORMAL;
+    task->handle = NULL;
+    task->inner = NULL;
+    task->unpark = NULL;
+    task->canceled = loop->canceled;
+    task->interrupted = 0;
+    task->deadline.expire = deadline_expire;
+    task->deadline.task = task;
+    task->deadline.index = -1;
+
+    task->live_prev = NULL;
+    task->live_next = loop->live;
+    if (loop->live)
+        loop->live->live_prev = task;
+    loop->live = task;
+
+    /* A deadline we can't keep track of expires right away */
+    if (attr && attr->timeout_ns != 0 &&
+        task_set_deadline(task, casync_clock_ns() + attr->timeout_ns) != 0)
+        task->canceled = 1;
+
+    if (attr && attr->priority != CASYNC_PRIORITY_NORMAL)
+    {
+        task->priority = attr->priority;
+        if (task->priority < CASYNC_PRIORITY_LOW)
+            task->priority = CASYNC_PRIORITY_LOW;
+        if (task->priority > CASYNC_PRIORITY_HIGH)
+            task->priority = CASYNC_PRIORITY_HIGH;
+        loop->prioritized = 1;
+    }
+#if defined(CASYNC_TRACE)
+    casync_trace_task_start(loop, task);
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+static void task_start(
+    struct casync_loop*       loop,
+    struct casync_task*       task,
+    const struct casync_attr* attr,
+    int (*function)(void*),
+    void* arg)
+{
+    task_init(loop, task, attr, function, arg);
+    loop_ready(loop, task);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -69,28 +462,155 @@ loop_start_static(struct casync_loop* loop, int (*function)(void*), void* arg)
     struct casync_task* task = loop->finished;
     assert(task != NULL);
     loop->finished = loop->finished->next;
-    task->stack = casync_init_stack(
-        function, arg, casync_end_redirect, task, task->stack_size);
+    task_start(loop, task, NULL, function, arg);
+}
 
-    loop_schedule(loop, task);
+/* -------------------------------------------------------------------------- */
+static size_t attr_stack_size(const struct casync_attr* attr)
+{
+    if (attr != NULL && attr->stack_size != 0)
+        return attr->stack_size;
+    return CASYNC_DEFAULT_STACK_SIZE;
 }
 
 /* -------------------------------------------------------------------------- */
-static void
-loop_start(struct casync_loop* loop, int (*function)(void*), void* arg)
+static void loop_free_finished(struct casync_loop* loop)
 {
+    /* Finished tasks may have the wrong stack size for new ones. Hand them
+     * back to the stack cache, which sorts them by size */
+    casync_task_free_many(loop->ended);
+    loop->ended = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+static struct casync_task*
+loop_take_pooled(struct casync_loop* loop, const struct casync_attr* attr)
+{
+    /* Inside casync_gather_static(), dynamic co-routines run on the caller's
+     * pool as long as it has a stack that is large enough */
     struct casync_task* task = loop->finished;
-    if (task != NULL)
-        loop->finished = loop->finished->next;
-    else
+    if (task == NULL || (attr != NULL && attr->stack_size > task->stack_size))
+        return NULL;
+    loop->finished = task->next;
+    return task;
+}
+
+/* -------------------------------------------------------------------------- */
+static struct casync_task* loop_try_start(
+    struct casync_loop*       loop,
+    const struct casync_attr* attr,
+    int (*function)(void*),
+    void* arg)
+{
+    struct casync_task* task = NULL;
+
+    loop_free_finished(loop);
+
+    /* Backends that can't copy stacks fall back to a stack of its own */
+    if (attr != NULL && attr->shared_stack)
+        task = casync_shared_task_alloc();
+    if (task == NULL)
+        task = loop_take_pooled(loop, attr);
+    if (task == NULL &&
+        (task = casync_task_alloc(attr_stack_size(attr))) == NULL)
+        return NULL;
+
+    task_start(loop, task, attr, function, arg);
+    return task;
+}
+
+/* -------------------------------------------------------------------------- */
+static struct casync_task* loop_start(
+    struct casync_loop*       loop,
+    const struct casync_attr* attr,
+    int (*function)(void*),
+    void* arg)
+{
+    struct casync_task* task = loop_try_start(loop, attr, function, arg);
+
+    /* Out of memory. The task never runs, report it through gather */
+    if (task == NULL)
+        loop->return_code = -1;
+    return task;
+}
+
+/* -------------------------------------------------------------------------- */
+static void loop_start_many(
+    struct casync_loop* loop, const struct casync_spawn* spawns, size_t n)
+{
+    struct casync_task* stacks = NULL; /* Allocated for the current run */
+    struct casync_task* head = NULL;   /* Started, not scheduled yet */
+    struct casync_task* tail = NULL;
+    struct casync_task* task;
+    size_t              i, end;
+
+    loop_free_finished(loop);
+
+    for (i = 0; i != n; ++i)
     {
-        task = malloc(1024 * 1024);
-        task->stack_size = 1024 * 1024;
+        const struct casync_attr* attr = spawns[i].attr;
+        size_t                    stack_size = attr_stack_size(attr);
+
+        task = NULL;
+        if (attr != NULL && attr->shared_stack)
+            task = casync_shared_task_alloc();
+        if (task == NULL && stacks == NULL)
+            task = loop_take_pooled(loop, attr);
+
+        /* Allocate stacks for the whole run of tasks that need the same
+         * size at once, usually the entire array */
+        if (task == NULL && stacks == NULL)
+        {
+            for (end = i + 1; end != n; ++end)
+                if ((spawns[end].attr && spawns[end].attr->shared_stack) ||
+                    attr_stack_size(spawns[end].attr) != stack_size)
+                    break;
+            stacks = casync_task_alloc_many(stack_size, end - i);
+        }
+        if (task == NULL && (task = stacks) != NULL)
+            stacks = stacks->next;
+        if (task == NULL)
+        {
+            /* Out of memory. The task never runs, report it through gather */
+            loop->return_code = -1;
+            continue;
+        }
+
+        task_init(loop, task, attr, spawns[i].function, spawns[i].arg);
+
+        /* Link tasks of the current round into a chain, and the chain into
+         * the ring in one go. Others are queued by priority, and must come
+         * after the chain */
+        if (loop->prioritized)
+        {
+            if (head != NULL)
+                loop_schedule_chain(loop, head, tail);
+            head = NULL;
+            loop_ready(loop, task);
+        }
+        else if (head == NULL)
+            head = tail = task;
+        else
+        {
+            tail->next = task;
+            task->prev = tail;
+            tail = task;
+        }
     }
-    task->stack = casync_init_stack(
-        function, arg, casync_end_redirect, task, task->stack_size);
 
-    loop_schedule(loop, task);
+    if (head != NULL)
+        loop_schedule_chain(loop, head, tail);
+    assert(stacks == NULL);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_loop_start(
+    struct casync_loop*       loop,
+    const struct casync_attr* attr,
+    int (*function)(void*),
+    void* arg)
+{
+    return loop_try_start(loop, attr, function, arg) ? 0 : -1;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -102,32 +622,353 @@ void casync_start_static(int (*function)(void*), void* arg)
 /* -------------------------------------------------------------------------- */
 void casync_start(int (*function)(void*), void* arg)
 {
-    loop_start(casync_current_loop, function, arg);
+    casync_start_ex(NULL, function, arg);
 }
 
 /* -------------------------------------------------------------------------- */
-static int casync_run_loop(struct casync_loop* loop)
+void casync_start_ex(
+    const struct casync_attr* attr, int (*function)(void*), void* arg)
+{
+    struct casync_loop* loop = casync_current_loop;
+    if (loop->spawner != NULL)
+        loop->spawner->spawn(loop->spawner, attr, function, arg);
+    else
+        loop_start(loop, attr, function, arg);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_start_many(const struct casync_spawn* spawns, size_t n)
+{
+    struct casync_loop* loop = casync_current_loop;
+    size_t              i;
+
+    if (loop->spawner == NULL)
+    {
+        loop_start_many(loop, spawns, n);
+        return;
+    }
+    for (i = 0; i != n; ++i)
+        loop->spawner->spawn(
+            loop->spawner, spawns[i].attr, spawns[i].function, spawns[i].arg);
+}
+
+/* -------------------------------------------------------------------------- */
+struct casync_handle* casync_start_joinable(
+    const struct casync_attr* attr, int (*function)(void*), void* arg)
+{
+    struct casync_handle* handle = calloc(1, sizeof *handle);
+    struct casync_task*   task;
+    if (handle == NULL)
+        return NULL;
+
+    /* Bypass the spawner of casync_gather_parallel(), so the task and
+     * whoever joins it run on the same thread */
+    if ((task = loop_start(casync_current_loop, attr, function, arg)) == NULL)
+    {
+        free(handle);
+        return NULL;
+    }
+
+    task->handle = handle;
+    handle->task = task;
+    return handle;
+}
+
+/* -------------------------------------------------------------------------- */
+static int join_unpark(void* ctx)
+{
+    struct casync_join_wait* wait = ctx;
+    wait->woken = 1;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_join(struct casync_handle* handle)
+{
+    struct casync_join_wait  local;
+    struct casync_join_wait* wait;
+    int                      return_code;
+
+    if (!handle->done)
+    {
+        if (casync_current_loop == NULL)
+            return -1;
+        wait = casync_wait_area(&local, sizeof local);
+        wait->task = casync_current_loop->active;
+        wait->woken = 0;
+        handle->wait = wait;
+        return_code = casync_park(join_unpark, wait);
+        handle->wait = NULL;
+        if (return_code != 0)
+            return return_code;
+    }
+
+    return_code = handle->return_code;
+    free(handle);
+    return return_code;
+}
+
+/* -------------------------------------------------------------------------- */
+static int find_done(struct casync_handle** handles, int n)
+{
+    int i;
+    for (i = 0; i != n; ++i)
+        if (handles[i] != NULL && handles[i]->done)
+            return i;
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_join_any(struct casync_handle** handles, int n, int* return_code)
+{
+    struct casync_join_wait  local;
+    struct casync_join_wait* wait;
+    int                      i, rc, waiting = 0;
+    int                      done = find_done(handles, n);
+
+    if (done < 0)
+    {
+        if (casync_current_loop == NULL)
+            return -1;
+
+        wait = casync_wait_area(&local, sizeof local);
+        wait->task = casync_current_loop->active;
+        wait->woken = 0;
+        for (i = 0; i != n; ++i)
+            if (handles[i] != NULL)
+            {
+                handles[i]->wait = wait;
+                waiting++;
+            }
+        if (waiting == 0)
+            return -1;
+
+        rc = casync_park(join_unpark, wait);
+
+        for (i = 0; i != n; ++i)
+            if (handles[i] != NULL)
+                handles[i]->wait = NULL;
+        if (rc != 0)
+            return rc;
+        done = find_done(handles, n);
+    }
+
+    if (return_code != NULL)
+        *return_code = handles[done]->return_code;
+    free(handles[done]);
+    handles[done] = NULL;
+    return done;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_detach(struct casync_handle* handle)
+{
+    if (handle->done)
+        free(handle);
+    else
+        handle->detached = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_cancel(struct casync_handle* handle)
+{
+    if (!handle->done)
+        task_cancel(handle->task);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_canceled(void)
+{
+    if (casync_current_loop == NULL)
+        return 0;
+    return casync_current_loop->active->canceled;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_set_deadline(uint64_t deadline_ns)
+{
+    if (casync_current_loop == NULL)
+        return -1;
+    return task_set_deadline(casync_current_loop->active, deadline_ns);
+}
+
+/* -------------------------------------------------------------------------- */
+const char* casync_name(void)
+{
+    if (casync_current_loop == NULL)
+        return NULL;
+    return casync_current_loop->active->name;
+}
+
+/* -------------------------------------------------------------------------- */
+static void loop_init(struct casync_loop* loop, struct casync_task* freelist)
 {
+    int i;
+
+    /* The loop lives on the caller's stack, which has to stay in place */
+    assert(casync_current_loop == NULL || !casync_current_loop->active->shared);
+
+    loop->control_task.next = &loop->control_task;
+    loop->control_task.prev = &loop->control_task;
+    loop->control_task.loop = loop;
+    loop->control_task.name = NULL;
+    loop->control_task.priority = 0;
+    loop->control_task.fpu = CASYNC_FPU_CONTROL;
+    loop->control_task.shared = 0;
+    loop->active = &loop->control_task;
+    loop->finished = freelist;
+    loop->ended = NULL;
+    loop->parent = casync_current_loop;
+    loop->root = loop->parent ? loop->parent->root : loop;
+    loop->host = NULL;
+    loop->io = NULL;
+    loop->timers = NULL;
+    loop->timer_count = 0;
+    loop->timer_capacity = 0;
+    loop->polled_at = 0;
+    loop->parked = 0;
     loop->return_code = 0;
+    loop->spawner = NULL;
+    loop->live = NULL;
+    loop->timeout.index = -1;
+    loop->canceled = 0;
+    loop->prioritized = 0;
+    loop->round_min = 0;
+    loop->round_max = CASYNC_PRIORITY_LEVELS - 1;
+    for (i = 0; i != CASYNC_PRIORITY_LEVELS; ++i)
+    {
+        loop->queue_head[i] = NULL;
+        loop->queue_tail[i] = NULL;
+        loop->skipped[i] = 0;
+    }
+    loop->submitted = NULL;
+    loop->pending = NULL;
+    loop->notifier = NULL;
+    loop->sleeping = 0;
+    loop->closing = 0;
+    loop->closed = 0;
+#if defined(CASYNC_STATS)
+    casync_stats_loop_init(loop);
+#endif
+
+    /* Let casync_cancel() on the task running us reach our tasks */
+    if (loop->parent)
+    {
+        loop->parent->active->inner = loop;
+        loop->canceled = loop->parent->active->canceled;
+    }
+#if defined(CASYNC_TRACE)
+    casync_trace_loop_init(loop);
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+static void loop_poll(struct casync_loop* root)
+{
+    int64_t  timeout = -1;
+    uint64_t now = 0;
+
+    if (root->timer_count > 0)
+        timeout = casync_timer_expire(root, now = casync_clock_ns());
+    if (root->parked == 0)
+        return;
+
+    /* Only block if there is nothing to run. A busy loop only collects
+     * events now and then, since the system call may well cost more than a
+     * whole round */
+    if (!loop_idle(root))
+    {
+        if (now == 0)
+            now = casync_clock_ns();
+        if (now - root->polled_at < BUSY_POLL_NS)
+            return;
+        root->polled_at = now;
+        timeout = 0;
+    }
+
+#if defined(CASYNC_THREADS)
+    if (timeout != 0 && !casync_submit_sleep(root))
+        timeout = 0;
+    casync_io_poll(root, timeout);
+    casync_submit_awake(root);
+#else
+    casync_io_poll(root, timeout);
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+static int casync_run_loop(struct casync_loop* loop)
+{
+    struct casync_loop* store_loop = loop->parent;
 
     while (1)
     {
+#if defined(CASYNC_THREADS)
+        /* Start what other threads submitted, see src/submit.c */
+        if (loop->pending != NULL || casync_atomic_load_ptr(&loop->submitted))
+            casync_submit_drain(loop);
+#endif
+
+        /* Decide which priority levels run in this round */
+        if (loop->prioritized)
+            loop_rebalance(loop);
+#if defined(CASYNC_STATS)
+        casync_stats_round(loop);
+#endif
+
         /* Run our chain */
-        struct casync_loop* store_loop = casync_current_loop;
         casync_current_loop = loop;
         assert(loop->active == &loop->control_task);
         casync_yield();
         casync_current_loop = store_loop;
 
-        if (&loop->control_task == loop->control_task.next)
-            break;
+        /* The outermost gather wakes sleeping tasks and tasks waiting for
+         * I/O. If nothing is runnable, this blocks until something is */
+        if (casync_current_loop == NULL)
+            loop_poll(loop);
+
+        if (loop_idle(loop))
+        {
+            if (loop->parked == 0)
+                break;
+
+            /* Every remaining task is waiting on something. Take ourselves
+             * out of the parent casync_gather() until one of them is woken */
+            if (casync_current_loop)
+            {
+                loop->host = casync_current_loop->active;
+                casync_park(NULL, NULL);
+            }
+            continue;
+        }
 
         /* Context switch to parent casync_gather(), if one exists */
         if (casync_current_loop)
             casync_yield();
     }
 
-    return loop->return_code;
+    if (loop->timeout.index >= 0)
+        casync_timer_remove(loop->root, &loop->timeout);
+    if (store_loop == NULL)
+    {
+        casync_io_destroy(loop);
+        free(loop->timers);
+    }
+    else
+        store_loop->active->inner = NULL;
+#if defined(CASYNC_TRACE)
+    casync_trace_loop_end(loop);
+#endif
+
+    return loop->canceled ? CASYNC_ECANCELED : loop->return_code;
+}
+
+/* -------------------------------------------------------------------------- */
+static int loop_run_and_free(struct casync_loop* loop)
+{
+    int rc = casync_run_loop(loop);
+    loop_free_finished(loop);
+    return rc;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -136,9 +977,7 @@ int casync_gather_static(struct casync_task* freelist, int n, ...)
     va_list            ap;
     struct casync_loop loop;
 
-    loop.control_task.next = &loop.control_task;
-    loop.active = &loop.control_task;
-    loop.finished = freelist;
+    loop_init(&loop, freelist);
 
     va_start(ap, n);
     while (n--)
@@ -149,40 +988,94 @@ int casync_gather_static(struct casync_task* freelist, int n, ...)
     }
     va_end(ap);
 
-    return casync_run_loop(&loop);
+    /* Co-routines started with casync_start() once the pool ran out got
+     * stacks from the cache */
+    return loop_run_and_free(&loop);
 }
 
 /* -------------------------------------------------------------------------- */
 int casync_gather(int n, ...)
 {
-    va_list             ap;
-    struct casync_loop  loop;
-    struct casync_task* t;
-    struct casync_task* next;
-    int                 rc;
+    va_list            ap;
+    struct casync_loop loop;
 
-    loop.control_task.next = &loop.control_task;
-    loop.active = &loop.control_task;
-    loop.finished = NULL;
+    loop_init(&loop, NULL);
 
     va_start(ap, n);
     while (n--)
     {
         void* function = va_arg(ap, void*);
         void* arg = va_arg(ap, void*);
-        loop_start(&loop, function, arg);
+        loop_start(&loop, NULL, function, arg);
     }
     va_end(ap);
 
-    rc = casync_run_loop(&loop);
+    return loop_run_and_free(&loop);
+}
 
-    for (t = loop.finished; t; t = next)
+/* -------------------------------------------------------------------------- */
+int casync_gather_ex(int n, ...)
+{
+    va_list            ap;
+    struct casync_loop loop;
+
+    loop_init(&loop, NULL);
+
+    va_start(ap, n);
+    while (n--)
     {
-        next = t->next;
-        free(t);
+        const struct casync_attr* attr = va_arg(ap, const struct casync_attr*);
+        void*                     function = va_arg(ap, void*);
+        void*                     arg = va_arg(ap, void*);
+        loop_start(&loop, attr, function, arg);
     }
+    va_end(ap);
 
-    return rc;
+    return loop_run_and_free(&loop);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_gather_array(const struct casync_spawn* spawns, size_t n)
+{
+    struct casync_loop loop;
+
+    loop_init(&loop, NULL);
+    loop_start_many(&loop, spawns, n);
+    return loop_run_and_free(&loop);
+}
+
+/* -------------------------------------------------------------------------- */
+static void loop_timeout(struct casync_timer* timer)
+{
+    char* loop = (char*)timer - offsetof(struct casync_loop, timeout);
+    loop_cancel((struct casync_loop*)loop);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_gather_timeout(uint64_t timeout_ns, int n, ...)
+{
+    va_list            ap;
+    struct casync_loop loop;
+
+    loop_init(&loop, NULL);
+    loop.timeout.deadline = casync_clock_ns() + timeout_ns;
+    loop.timeout.expire = loop_timeout;
+    loop.timeout.task = NULL;
+
+    /* A timeout we can't keep track of expires right away */
+    if (casync_timer_add(loop.root, &loop.timeout) != 0)
+        loop.canceled = 1;
+
+    va_start(ap, n);
+    while (n--)
+    {
+        void* function = va_arg(ap, void*);
+        void* arg = va_arg(ap, void*);
+        loop_start(&loop, NULL, function, arg);
+    }
+    va_end(ap);
+
+    return loop_run_and_free(&loop);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -195,7 +1088,11 @@ struct casync_task* casync_stack_pool_init_linear(
     {
         uint8_t*            offset = (uint8_t*)stacks_memory + stack_size * i;
         struct casync_task* t = (struct casync_task*)offset;
-        t->stack_size = stack_size;
+        t->stack_base = t + 1;
+        t->stack_size = stack_size - sizeof(*t);
+        t->shared = 0;
+        t->arena = 0;
+        t->pooled = 1;
         t->next = freelist;
         freelist = t;
     }
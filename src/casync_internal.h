@@ -0,0 +1,450 @@
+#pragma once
+
+#include "casync/casync.h"
+#include "casync/stats.h"
+#include "casync/trace.h"
+
+#define CASYNC_DEFAULT_STACK_SIZE (1024 * 1024)
+#define CASYNC_PRIORITY_LEVELS    (CASYNC_PRIORITY_HIGH - CASYNC_PRIORITY_LOW + 1)
+
+#if defined(_MSC_VER)
+#    define THREADLOCAL __declspec(thread)
+#else
+#    define THREADLOCAL __thread
+#endif
+
+#if defined(CASYNC_STATS)
+/*!
+ * @brief Counters of a task, see src/stats.c. Times are in ticks of
+ * casync_stats_ticks().
+ */
+struct casync_task_counters
+{
+    uint64_t switches;
+    uint64_t ticks;     /* Time spent running, including nested gathers */
+    uint64_t max_slice; /* Longest stretch between two switches */
+    char*    paint;     /* Lowest painted byte of the stack, see stats.c */
+    char*    top;       /* End of the usable stack */
+    size_t   saved;     /* Largest copy of a shared stack instead */
+};
+
+/*!
+ * @brief Counters of a loop. Tasks fold theirs in when they finish.
+ */
+struct casync_loop_counters
+{
+    uint64_t last_switch; /* When the active task got control */
+    uint64_t rounds;
+    uint64_t switches;
+    uint64_t started;
+    uint64_t finished;
+    uint64_t ticks;
+    uint64_t max_slice;
+    size_t   stack_used;
+    uint64_t stack_copies;
+    uint64_t stack_copied;
+    uint64_t queue_histogram[CASYNC_STATS_BUCKETS];
+    int      dumps; /* Dump requests handled, see casync_stats_request_dump() */
+};
+#endif
+
+struct casync_timer
+{
+    uint64_t deadline; /* casync_clock_ns() time to expire at */
+    void (*expire)(struct casync_timer* timer);
+    struct casync_task* task;
+    int                 index; /* Position in the heap, or -1 */
+};
+
+/*
+ * NOTE: The assembly in src/arch/ depends on the offsets of "stack", "next",
+ * "fpu" and "fpu_area" in casync_task, and on the offset of "active" in
+ * casync_loop. Don't move them. The assembly only ever follows "next", so
+ * "prev" is maintained by the C code alone.
+ */
+struct casync_task
+{
+    void*                 stack;
+    struct casync_task*   next;
+    uintptr_t             fpu;      /* CASYNC_FPU_*, see casync_fpu_init() */
+    void*                 fpu_area; /* XSAVE area if CASYNC_FPU_FULL */
+    struct casync_task*   prev;
+    void*                 stack_base; /* Lowest address of the stack memory */
+    size_t                stack_size;
+    int                   shared; /* See src/shared_stack.c */
+    int                   arena;  /* See src/stack_arena.c */
+    int                   pooled; /* casync_stack_pool_init_linear() */
+    struct casync_loop*   loop;
+    const char*           name;
+    int                   priority;
+    struct casync_handle* handle; /* Set if joinable */
+    struct casync_task*   live_next; /* See casync_loop.live */
+    struct casync_task*   live_prev;
+    struct casync_loop*   inner; /* Nested casync_gather() we are running */
+    int (*unpark)(void* ctx);    /* Set while parked, see casync_park() */
+    void*               unpark_ctx;
+    int                 canceled;
+    int                 interrupted; /* Woken by cancellation */
+    struct casync_timer deadline;
+#if defined(CASYNC_STATS)
+    struct casync_task_counters stats;
+#endif
+#if defined(CASYNC_TRACE)
+    uint32_t trace_id; /* Track in the exported trace, see src/trace.c */
+#endif
+};
+
+/*!
+ * @brief Lives on the stack of a task in casync_join() or casync_join_any().
+ */
+struct casync_join_wait
+{
+    struct casync_task* task;
+    int                 woken;
+};
+
+struct casync_handle
+{
+    struct casync_task*      task; /* Until it returns */
+    struct casync_join_wait* wait; /* Set while someone is joining */
+    int                      done;
+    int                      detached;
+    int                      return_code;
+};
+
+/*!
+ * @brief Redirects casync_start() and casync_start_ex() of a loop. Used by the
+ * parallel runtime to hand new co-routines to whichever worker is idle.
+ */
+struct casync_spawner
+{
+    void (*spawn)(
+        struct casync_spawner*    spawner,
+        const struct casync_attr* attr,
+        int (*function)(void*),
+        void* arg);
+};
+
+struct casync_loop
+{
+    struct casync_task*    active;
+    struct casync_task*    finished; /* Free pool of casync_gather_static() */
+    struct casync_task*    ended;    /* Finished tasks with stacks of ours */
+    struct casync_task     control_task;
+    struct casync_loop*    parent; /* Enclosing gather, or NULL */
+    struct casync_loop*    root;   /* Outermost gather, owns reactor & timers */
+    struct casync_task*    host;   /* Our task in the parent while parked */
+    void*                  io;     /* Reactor state, see src/io_*.c */
+    struct casync_timer**  timers; /* 4-ary min-heap of sleeping tasks */
+    int                    timer_count;
+    int                    timer_capacity;
+    uint64_t               polled_at; /* Last poll while busy, see loop_poll() */
+    int                    parked; /* Number of our tasks not in the ring */
+    int                    return_code;
+    struct casync_spawner* spawner; /* Overrides casync_start(), or NULL */
+    struct casync_task*    live;    /* All started tasks that haven't ended */
+    struct casync_timer    timeout; /* casync_gather_timeout() */
+    int                    canceled;
+
+    /* Only used once a task with a priority other than normal was started.
+     * Runnable tasks of levels that aren't part of the current round wait in
+     * per-level queues, linked through "next" */
+    int                 prioritized;
+    int                 round_min; /* Lowest level in the ring */
+    int                 round_max; /* Highest level in the ring */
+    struct casync_task* queue_head[CASYNC_PRIORITY_LEVELS];
+    struct casync_task* queue_tail[CASYNC_PRIORITY_LEVELS];
+    int                 skipped[CASYNC_PRIORITY_LEVELS]; /* Rounds passed over */
+
+    /* casync_loop_submit() from other threads, see src/submit.c. Only used in
+     * root loops */
+    void* volatile submitted; /* Lock-free stack of casync_submission */
+    void*          pending;   /* Taken off the stack, not started yet */
+    void* volatile notifier;  /* Set while casync_loop_serve() runs */
+    volatile long  sleeping;  /* About to sleep in the reactor */
+    volatile long  closing;
+    volatile long  closed;
+#if defined(CASYNC_STATS)
+    struct casync_loop_counters stats;
+#endif
+};
+
+extern THREADLOCAL struct casync_loop* casync_current_loop;
+
+/*!
+ * @brief Takes the active task out of the current loop's ring and switches to
+ * the next task. The call returns once someone passes the task to
+ * casync_wake(), or once the task is canceled.
+ * @param[in] unpark Called with ctx when the task is canceled, to take it off
+ * whatever it is waiting on. Returns 1 if the task may be woken right away, or
+ * 0 if it stays parked until it is woken as usual, e.g. because the kernel
+ * still owns its buffers. NULL if the wait can't be canceled.
+ * @return Returns 0 if the task was woken, or CASYNC_ECANCELED if it was
+ * canceled. Cancellation is sticky, so a canceled task returns right away.
+ */
+int casync_park(int (*unpark)(void* ctx), void* ctx);
+
+/*!
+ * @brief Puts a task that was parked with casync_park() back into its loop's
+ * ring. If the loop itself was parked because all of its tasks were waiting,
+ * the loop is woken as well.
+ */
+void casync_wake(struct casync_task* task);
+
+struct casync_waiter
+{
+    struct casync_task*       task;
+    struct casync_waiter*     next;
+    struct casync_wait_queue* queue;
+};
+
+/*!
+ * @brief Starts a dynamic co-routine in a specific loop, bypassing the loop's
+ * spawner.
+ * @return Returns 0 on success, -1 if out of memory. Unlike casync_start(),
+ * the failure is left to the caller to report.
+ */
+int casync_loop_start(
+    struct casync_loop*       loop,
+    const struct casync_attr* attr,
+    int (*function)(void*),
+    void* arg);
+
+/*!
+ * @brief Allocates a task for the dynamic API, along with at least stack_size
+ * bytes of stack memory. Stacks are recycled through a per-thread cache, see
+ * src/stack_cache.c.
+ * @return Returns NULL if out of memory.
+ */
+struct casync_task* casync_task_alloc(size_t stack_size);
+
+/*!
+ * @brief Allocates n tasks like casync_task_alloc(). Whatever the cache can't
+ * provide is mapped in one block, see casync_stack_map_many().
+ * @return Returns the tasks as a list linked through "next", or NULL if out
+ * of memory.
+ */
+struct casync_task* casync_task_alloc_many(size_t stack_size, size_t n);
+
+/*!
+ * @brief Returns a task allocated with casync_task_alloc() to the cache.
+ */
+void casync_task_free(struct casync_task* task);
+
+/*!
+ * @brief Returns a list of tasks linked through "next" to the cache. Those
+ * that don't fit are unmapped together, see casync_stack_unmap_many().
+ */
+void casync_task_free_many(struct casync_task* list);
+
+/*!
+ * @brief Maps a task along with stack_size bytes of stack memory. The memory
+ * is only reserved, so untouched pages cost nothing. The stack has a guard
+ * page below it, and the task lives above the stack, so an overflow faults
+ * instead of corrupting the task. Implemented in src/mem_*.c.
+ * @return Returns NULL if out of memory.
+ */
+struct casync_task* casync_stack_map(size_t stack_size);
+
+/*!
+ * @brief Maps n tasks like casync_stack_map(), in one block of memory where
+ * the system allows. Each of them may still be unmapped on its own.
+ * @return Returns the tasks as a list linked through "next", or NULL if out
+ * of memory.
+ */
+struct casync_task* casync_stack_map_many(size_t stack_size, size_t n);
+
+/*!
+ * @brief Unmaps a task mapped with casync_stack_map().
+ */
+void casync_stack_unmap(struct casync_task* task);
+
+/*!
+ * @brief Unmaps a list of tasks linked through "next", merging neighbours in
+ * memory into one system call where the system allows.
+ */
+void casync_stack_unmap_many(struct casync_task* list);
+
+/*!
+ * @brief Gives the physical memory behind an unused stack back to the OS,
+ * while keeping the mapping.
+ */
+void casync_stack_trim(struct casync_task* task);
+
+/*!
+ * @brief Stacks of casync_stack_arena(), see src/stack_arena.c.
+ * casync_arena_alloc() returns NULL if the arena is off, if stack_size is too
+ * large for it, or if out of memory. casync_arena_release() unmaps the arena
+ * if none of its stacks is in use.
+ */
+struct casync_task* casync_arena_alloc(size_t stack_size);
+
+void casync_arena_free(struct casync_task* task);
+void casync_arena_release(void);
+
+/*!
+ * @brief Returns the lowest address a suspended task still uses on its stack,
+ * given casync_task::stack. Returns NULL if the backend can't tell, which
+ * rules out shared stacks. Implemented in src/arch/stack_*.c.
+ */
+void* casync_stack_low(void* stack);
+
+/*!
+ * @brief Tasks that run on the shared stack of their thread, see
+ * src/shared_stack.c. casync_shared_task_alloc() returns NULL if out of
+ * memory, or if the backend can't copy stacks. casync_shared_task_start()
+ * takes the place of casync_init_stack(). casync_shared_task_end() is called
+ * once the task no longer needs the contents of the shared stack.
+ */
+struct casync_task* casync_shared_task_alloc(void);
+
+void casync_shared_task_start(
+    struct casync_task* task, int (*function)(void*), void* arg);
+void casync_shared_task_end(struct casync_task* task);
+void casync_shared_task_free(struct casync_task* task);
+
+/*!
+ * @brief Returns memory for what the active task shares with whoever wakes it
+ * while it is parked. That is local, unless the task runs on a shared stack,
+ * whose contents are copied away while it is suspended. Then it is size bytes
+ * of the task, which only ever waits for one thing at a time.
+ */
+void* casync_wait_area(void* local, size_t size);
+
+/*!
+ * @brief Sets up how the assembly saves the FPU and SIMD state of a task that
+ * is about to start. CASYNC_FPU_FULL reserves an XSAVE area at the top of the
+ * stack, and falls back to CASYNC_FPU_CONTROL if the CPU or OS lacks XSAVE.
+ * Implemented in src/arch/fpu_*.c.
+ * @return Returns the number of bytes left for the stack.
+ */
+size_t casync_fpu_init(struct casync_task* task, int mode);
+
+#if defined(CASYNC_STATS)
+/*!
+ * @brief Hooks that keep the counters of src/stats.c up to date.
+ * casync_stats_task_start() paints the stack, so it has to be called before
+ * the initial stack frame is set up.
+ */
+void casync_stats_loop_init(struct casync_loop* loop);
+void casync_stats_round(struct casync_loop* loop);
+void casync_stats_switch(struct casync_loop* loop, struct casync_task* task);
+void casync_stats_task_start(
+    struct casync_loop* loop, struct casync_task* task, size_t stack_size);
+void casync_stats_task_end(struct casync_task* task);
+#endif
+
+#if defined(CASYNC_TRACE)
+/*!
+ * @brief Hooks that record events into the calling thread's trace buffer, see
+ * src/trace.c. Tasks and the control tasks of loops get their IDs even while
+ * nothing is recorded.
+ */
+void casync_trace_loop_init(struct casync_loop* loop);
+void casync_trace_loop_end(struct casync_loop* loop);
+void casync_trace_task_start(
+    struct casync_loop* loop, struct casync_task* task);
+void casync_trace_task_end(struct casync_task* task, struct casync_task* next);
+void casync_trace_switch(struct casync_loop* loop);
+void casync_trace_park(struct casync_task* task);
+void casync_trace_wake(struct casync_task* task);
+#endif
+
+#if defined(CASYNC_THREADS)
+/*!
+ * @brief Starts the co-routines other threads submitted to a root loop.
+ */
+void casync_submit_drain(struct casync_loop* root);
+
+/*!
+ * @brief Called around sleeping in the reactor, so casync_loop_submit()
+ * knows when it has to wake the loop.
+ * @return casync_submit_sleep() returns 0 if something was submitted in the
+ * meantime, so the reactor must not sleep.
+ */
+int  casync_submit_sleep(struct casync_loop* root);
+void casync_submit_awake(struct casync_loop* root);
+#endif
+
+/*!
+ * @brief Waits for I/O events and wakes all tasks whose file descriptors
+ * became ready. Only ever called on the root loop. The call sleeps for at most
+ * timeout_ns nanoseconds, or until an event arrives if timeout_ns is negative.
+ * A timeout of 0 only collects events that are already pending.
+ */
+void casync_io_poll(struct casync_loop* root, int64_t timeout_ns);
+
+/*!
+ * @brief Releases the reactor state of the root loop, if any was created.
+ */
+void casync_io_destroy(struct casync_loop* root);
+
+/*!
+ * @brief Adds a timer to the heap of the root loop. The timer's expire
+ * callback is called once casync_clock_ns() reaches its deadline.
+ * @return Returns -1 if out of memory.
+ */
+int casync_timer_add(struct casync_loop* root, struct casync_timer* timer);
+
+/*!
+ * @brief Removes a timer that hasn't expired yet, and sets its index to -1.
+ */
+void casync_timer_remove(struct casync_loop* root, struct casync_timer* timer);
+
+/*!
+ * @brief Expires all timers whose deadline has passed.
+ * @return Returns the number of nanoseconds until the next deadline, or -1 if
+ * no timers are pending.
+ */
+int64_t casync_timer_expire(struct casync_loop* root, uint64_t now_ns);
+
+/*!
+ * @brief Minimal threading primitives used by the parallel runtime. They are
+ * implemented in src/thread_*.c. Threads, mutexes and atomics are not exposed
+ * by C89, so each platform has its own implementation.
+ */
+void* casync_thread_start(void (*function)(void*), void* arg);
+void  casync_thread_join(void* thread);
+int   casync_cpu_count(void);
+
+void* casync_thread_mutex_create(void);
+void  casync_thread_mutex_destroy(void* mutex);
+void  casync_thread_mutex_lock(void* mutex);
+void  casync_thread_mutex_unlock(void* mutex);
+
+void* casync_thread_cond_create(void);
+void  casync_thread_cond_destroy(void* cond);
+void  casync_thread_cond_wait(void* cond, void* mutex);
+void  casync_thread_cond_signal(void* cond);
+
+/*!
+ * @brief Calls function unless *done is set, and then sets it. Threads that
+ * get here while another one is calling it wait until it returned.
+ */
+void casync_thread_once(volatile long* done, void (*function)(void));
+
+/*!
+ * @brief A file descriptor that other threads can make readable, so that
+ * casync_wait_fd() wakes up. Signaling is idempotent until it is drained.
+ * casync_thread_notifier_create() returns NULL where this isn't available.
+ */
+void* casync_thread_notifier_create(void);
+void  casync_thread_notifier_destroy(void* notifier);
+int   casync_thread_notifier_fd(void* notifier);
+void  casync_thread_notifier_signal(void* notifier);
+void  casync_thread_notifier_drain(void* notifier);
+
+/*!
+ * @brief Atomic operations. All of them are sequentially consistent, so a
+ * store followed by a load of another variable can't be reordered, see
+ * src/submit.c and src/runtime.c.
+ * @return casync_atomic_add() returns the new value.
+ * casync_atomic_exchange*() return the previous value.
+ * casync_atomic_cas_ptr() returns 1 if *ptr was expected and was replaced.
+ */
+long  casync_atomic_add(volatile long* value, long delta);
+long  casync_atomic_load(volatile long* value);
+long  casync_atomic_exchange(volatile long* value, long new_value);
+void* casync_atomic_load_ptr(void* volatile* ptr);
+void* casync_atomic_exchange_ptr(void* volatile* ptr, void* value);
+int   casync_atomic_cas_ptr(void* volatile* ptr, void* expected, void* desired);
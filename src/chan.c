@@ -0,0 +1,237 @@
+#include "casync/chan.h"
+#include "casync_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_UNBOUNDED_CAPACITY 16
+
+/*
+ * Items are stored in a ring buffer. A bounded channel allocates all of its
+ * slots up front. An unbounded one doubles its buffer whenever it fills up.
+ */
+struct casync_chan
+{
+    char*                    buffer;
+    size_t                   item_size;
+    size_t                   capacity; /* Allocated slots */
+    size_t                   limit;    /* 0 if unbounded */
+    size_t                   head;
+    size_t                   count;
+    int                      closed;
+    struct casync_wait_queue senders;
+    struct casync_wait_queue receivers;
+};
+
+/* -------------------------------------------------------------------------- */
+struct casync_chan* casync_chan_create(size_t item_size, size_t capacity)
+{
+    struct casync_chan* chan = calloc(1, sizeof *chan);
+    if (chan == NULL)
+        return NULL;
+
+    chan->item_size = item_size;
+    chan->limit = capacity;
+    chan->capacity = capacity ? capacity : INITIAL_UNBOUNDED_CAPACITY;
+    chan->buffer = malloc(item_size * chan->capacity);
+    if (chan->buffer == NULL)
+    {
+        free(chan);
+        return NULL;
+    }
+
+    return chan;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_chan_destroy(struct casync_chan* chan)
+{
+    free(chan->buffer);
+    free(chan);
+}
+
+/* -------------------------------------------------------------------------- */
+static void wake_many(struct casync_wait_queue* queue, size_t n)
+{
+    while (n-- && casync_wait_queue_wake(queue))
+    {
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_chan_close(struct casync_chan* chan)
+{
+    chan->closed = 1;
+    wake_many(&chan->senders, (size_t)-1);
+    wake_many(&chan->receivers, (size_t)-1);
+}
+
+/* -------------------------------------------------------------------------- */
+static int chan_grow(struct casync_chan* chan, size_t min_capacity)
+{
+    size_t new_capacity = chan->capacity * 2;
+    char*  new_buffer;
+    size_t first;
+
+    while (new_capacity < min_capacity)
+        new_capacity *= 2;
+    new_buffer = malloc(chan->item_size * new_capacity);
+    if (new_buffer == NULL)
+        return -1;
+
+    /* Unwrap the ring, so it starts at the beginning of the new buffer */
+    first = chan->capacity - chan->head;
+    if (first > chan->count)
+        first = chan->count;
+    memcpy(
+        new_buffer,
+        chan->buffer + chan->head * chan->item_size,
+        first * chan->item_size);
+    memcpy(
+        new_buffer + first * chan->item_size,
+        chan->buffer,
+        (chan->count - first) * chan->item_size);
+
+    free(chan->buffer);
+    chan->buffer = new_buffer;
+    chan->capacity = new_capacity;
+    chan->head = 0;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void chan_put(struct casync_chan* chan, const char* items, size_t n)
+{
+    size_t tail = (chan->head + chan->count) % chan->capacity;
+    size_t first = chan->capacity - tail;
+    if (first > n)
+        first = n;
+
+    memcpy(
+        chan->buffer + tail * chan->item_size, items, first * chan->item_size);
+    memcpy(
+        chan->buffer,
+        items + first * chan->item_size,
+        (n - first) * chan->item_size);
+    chan->count += n;
+}
+
+/* -------------------------------------------------------------------------- */
+static void chan_take(struct casync_chan* chan, char* items, size_t n)
+{
+    size_t first = chan->capacity - chan->head;
+    if (first > n)
+        first = n;
+
+    memcpy(
+        items,
+        chan->buffer + chan->head * chan->item_size,
+        first * chan->item_size);
+    memcpy(
+        items + first * chan->item_size,
+        chan->buffer,
+        (n - first) * chan->item_size);
+    chan->head = (chan->head + n) % chan->capacity;
+    chan->count -= n;
+}
+
+/* -------------------------------------------------------------------------- */
+static size_t chan_send(
+    struct casync_chan* chan, const void* items, size_t n, int* status)
+{
+    const char* src = items;
+    size_t      sent = 0;
+
+    *status = -1;
+
+    while (sent != n)
+    {
+        size_t batch = n - sent;
+
+        if (chan->closed)
+            break;
+
+        if (chan->limit == 0)
+        {
+            if (chan->count + batch > chan->capacity &&
+                chan_grow(chan, chan->count + batch) != 0)
+                break;
+        }
+        else if (chan->count == chan->limit)
+        {
+            if (casync_current_loop == NULL)
+                break;
+            if (casync_wait_queue_park(&chan->senders) != 0)
+            {
+                *status = CASYNC_ECANCELED;
+                break;
+            }
+            continue;
+        }
+        else if (batch > chan->limit - chan->count)
+            batch = chan->limit - chan->count;
+
+        chan_put(chan, src + sent * chan->item_size, batch);
+        sent += batch;
+        wake_many(&chan->receivers, batch);
+    }
+
+    return sent;
+}
+
+/* -------------------------------------------------------------------------- */
+static size_t
+chan_recv(struct casync_chan* chan, void* items, size_t max, int* status)
+{
+    size_t batch;
+
+    /* A woken receiver may find the channel empty again if another
+     * co-routine got there first */
+    *status = -1;
+    while (chan->count == 0)
+    {
+        if (chan->closed || casync_current_loop == NULL)
+            return 0;
+        if (casync_wait_queue_park(&chan->receivers) != 0)
+        {
+            *status = CASYNC_ECANCELED;
+            return 0;
+        }
+    }
+
+    batch = chan->count < max ? chan->count : max;
+    chan_take(chan, items, batch);
+    if (chan->limit != 0)
+        wake_many(&chan->senders, batch);
+
+    return batch;
+}
+
+/* -------------------------------------------------------------------------- */
+size_t
+casync_chan_send_many(struct casync_chan* chan, const void* items, size_t n)
+{
+    int status;
+    return chan_send(chan, items, n, &status);
+}
+
+/* -------------------------------------------------------------------------- */
+size_t casync_chan_recv_many(struct casync_chan* chan, void* items, size_t max)
+{
+    int status;
+    return chan_recv(chan, items, max, &status);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_chan_send(struct casync_chan* chan, const void* item)
+{
+    int status;
+    return chan_send(chan, item, 1, &status) == 1 ? 0 : status;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_chan_recv(struct casync_chan* chan, void* item)
+{
+    int status;
+    return chan_recv(chan, item, 1, &status) == 1 ? 0 : status;
+}
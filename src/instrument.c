@@ -0,0 +1,24 @@
+#include "casync_internal.h"
+
+#if defined(CASYNC_STATS) || defined(CASYNC_TRACE)
+
+/* The wrapper switches with the real casync_yield() */
+#    undef casync_yield
+
+/* -------------------------------------------------------------------------- */
+void casync_yield_instrumented(void)
+{
+    struct casync_loop* loop = casync_current_loop;
+    if (loop != NULL)
+    {
+#    if defined(CASYNC_STATS)
+        casync_stats_switch(loop, loop->active);
+#    endif
+#    if defined(CASYNC_TRACE)
+        casync_trace_switch(loop);
+#    endif
+    }
+    casync_yield();
+}
+
+#endif
@@ -0,0 +1,303 @@
+#include "casync_internal.h"
+
+/* src/io_uring.c falls back to this backend if io_uring is unavailable */
+#if defined(CASYNC_IO_URING)
+#    define casync_wait_fd    casync_epoll_wait_fd
+#    define casync_io_poll    casync_epoll_io_poll
+#    define casync_io_submit  casync_epoll_io_submit
+#    define casync_io_destroy casync_epoll_io_destroy
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+
+struct io_state;
+struct io_waiter
+{
+    struct casync_task* task;
+    struct io_state*    io;
+    int                 fd;
+    int                 revents;
+};
+
+struct io_fd
+{
+    struct io_waiter* reader;
+    struct io_waiter* writer;
+    int               registered;
+};
+
+struct io_state
+{
+    struct io_fd* fds;
+    int           fd_count;
+    int           epoll_fd;
+    int           waiting;
+};
+
+/* -------------------------------------------------------------------------- */
+static struct io_state* io_get(struct casync_loop* root)
+{
+    struct io_state* io = root->io;
+    if (io != NULL)
+        return io;
+
+    io = calloc(1, sizeof *io);
+    if (io == NULL)
+        return NULL;
+    io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (io->epoll_fd == -1)
+    {
+        free(io);
+        return NULL;
+    }
+
+    root->io = io;
+    return io;
+}
+
+/* -------------------------------------------------------------------------- */
+static struct io_fd* io_entry(struct io_state* io, int fd)
+{
+    if (fd >= io->fd_count)
+    {
+        int           new_count = io->fd_count ? io->fd_count : 64;
+        struct io_fd* new_fds;
+        while (new_count <= fd)
+            new_count *= 2;
+        new_fds = realloc(io->fds, sizeof(*new_fds) * new_count);
+        if (new_fds == NULL)
+            return NULL;
+        memset(
+            new_fds + io->fd_count,
+            0,
+            sizeof(*new_fds) * (new_count - io->fd_count));
+        io->fds = new_fds;
+        io->fd_count = new_count;
+    }
+
+    return &io->fds[fd];
+}
+
+/* -------------------------------------------------------------------------- */
+static int io_arm(struct io_state* io, int fd, struct io_fd* entry)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLONESHOT;
+    if (entry->reader)
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (entry->writer)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+
+    /* The kernel drops registrations when the fd is closed, so "registered"
+     * is only a hint of which call will most likely succeed */
+    if (entry->registered)
+    {
+        if (epoll_ctl(io->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0)
+            return 0;
+        if (errno != ENOENT)
+            return -1;
+    }
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+    {
+        entry->registered = 1;
+        return 0;
+    }
+    if (errno != EEXIST)
+        return -1;
+    entry->registered = 1;
+    return epoll_ctl(io->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* -------------------------------------------------------------------------- */
+static void io_dispatch(struct io_state* io, int fd, uint32_t events)
+{
+    struct io_fd*     entry = &io->fds[fd];
+    struct io_waiter* r = entry->reader;
+    struct io_waiter* w = entry->writer;
+    uint32_t          err = events & (EPOLLERR | EPOLLHUP);
+
+    if (r && (err || (events & (EPOLLIN | EPOLLRDHUP))))
+        r->revents |= CASYNC_READ;
+    if (w && (err || (events & EPOLLOUT)))
+        w->revents |= CASYNC_WRITE;
+
+    /* A task waiting for both directions is registered in both slots */
+    if (r && r->revents)
+    {
+        entry->reader = NULL;
+        if (w == r)
+            entry->writer = NULL;
+        casync_wake(r->task);
+    }
+    if (w && w != r && w->revents)
+    {
+        entry->writer = NULL;
+        casync_wake(w->task);
+    }
+
+    /* The registration is one-shot. Re-arm for whoever is still waiting */
+    if (entry->reader || entry->writer)
+        io_arm(io, fd, entry);
+}
+
+/* -------------------------------------------------------------------------- */
+static int to_ms(int64_t timeout_ns)
+{
+    /* Round up, so we never wake up before a timer expires */
+    if (timeout_ns < 0)
+        return -1;
+    if (timeout_ns > (int64_t)INT_MAX * 1000000)
+        return INT_MAX;
+    return (int)((timeout_ns + 999999) / 1000000);
+}
+
+/* -------------------------------------------------------------------------- */
+static int wait_fd_blocking(int fd, int events)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = 0;
+    pfd.revents = 0;
+    if (events & CASYNC_READ)
+        pfd.events |= POLLIN;
+    if (events & CASYNC_WRITE)
+        pfd.events |= POLLOUT;
+
+    while (poll(&pfd, 1, -1) == -1)
+        if (errno != EINTR)
+            return -1;
+
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+        return events;
+    return ((pfd.revents & POLLIN) ? CASYNC_READ : 0) |
+           ((pfd.revents & POLLOUT) ? CASYNC_WRITE : 0);
+}
+
+/* -------------------------------------------------------------------------- */
+static int io_unpark(void* ctx)
+{
+    struct io_waiter* waiter = ctx;
+    struct io_fd*     entry = &waiter->io->fds[waiter->fd];
+
+    /* The registration may stay armed. If it fires, nobody is woken */
+    if (entry->reader == waiter)
+        entry->reader = NULL;
+    if (entry->writer == waiter)
+        entry->writer = NULL;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_wait_fd(int fd, int events)
+{
+    struct casync_loop* loop = casync_current_loop;
+    struct io_state*    io;
+    struct io_fd*       entry;
+    struct io_waiter    local;
+    struct io_waiter*   waiter;
+    int                 rc;
+
+    if (loop == NULL)
+        return wait_fd_blocking(fd, events);
+
+    if (fd < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if ((io = io_get(loop->root)) == NULL)
+        return -1;
+    if ((entry = io_entry(io, fd)) == NULL)
+        return -1;
+    if (((events & CASYNC_READ) && entry->reader) ||
+        ((events & CASYNC_WRITE) && entry->writer))
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    waiter = casync_wait_area(&local, sizeof local);
+    waiter->task = loop->active;
+    waiter->io = io;
+    waiter->fd = fd;
+    waiter->revents = 0;
+    if (events & CASYNC_READ)
+        entry->reader = waiter;
+    if (events & CASYNC_WRITE)
+        entry->writer = waiter;
+
+    if (io_arm(io, fd, entry) != 0)
+    {
+        int error = errno;
+        if (entry->reader == waiter)
+            entry->reader = NULL;
+        if (entry->writer == waiter)
+            entry->writer = NULL;
+
+        /* Regular files can't be polled, but they are always ready */
+        if (error == EPERM)
+            return events;
+        errno = error;
+        return -1;
+    }
+
+    io->waiting++;
+    rc = casync_park(io_unpark, waiter);
+    io->waiting--;
+
+    if (rc != 0)
+    {
+        errno = ECANCELED;
+        return rc;
+    }
+    return waiter->revents & events;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_io_poll(struct casync_loop* root, int64_t timeout_ns)
+{
+    struct io_state*   io = root->io;
+    struct epoll_event events[MAX_EVENTS];
+    int                i, n;
+
+    /* Without waiters, only sleep if a timer is pending */
+    if (io == NULL || io->waiting == 0)
+        if (timeout_ns <= 0 || (io = io_get(root)) == NULL)
+            return;
+
+    n = epoll_wait(io->epoll_fd, events, MAX_EVENTS, to_ms(timeout_ns));
+    for (i = 0; i < n; ++i)
+        io_dispatch(io, events[i].data.fd, events[i].events);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_io_submit(const struct casync_io_op* op, int* result)
+{
+    /* Only readiness is supported, util/ falls back to non-blocking calls */
+    (void)op;
+    (void)result;
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_io_destroy(struct casync_loop* root)
+{
+    struct io_state* io = root->io;
+    if (io == NULL)
+        return;
+
+    close(io->epoll_fd);
+    free(io->fds);
+    free(io);
+    root->io = NULL;
+}
@@ -0,0 +1,230 @@
+#include "casync_internal.h"
+
+#if defined(_WIN32)
+#    define WIN32_LEAN_AND_MEAN
+#    include "winsock2.h"
+#    define poll(fds, n, timeout) WSAPoll(fds, n, timeout)
+#    define sleep_ms(ms)          Sleep(ms)
+#else
+#    include <poll.h>
+#    define sleep_ms(ms) poll(NULL, 0, ms)
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+/*
+ * Portable reactor for platforms without epoll. Every waiting co-routine owns
+ * one entry in a dense array that is converted to a pollfd array each time the
+ * scheduler polls, so the cost of a poll is linear in the number of waiters.
+ */
+
+struct io_state;
+struct io_waiter
+{
+    struct casync_task* task;
+    struct io_state*    io;
+    int                 fd;
+    int                 events;
+    int                 revents;
+};
+
+struct io_state
+{
+    struct io_waiter** waiters;
+    struct pollfd*     pfds;
+    int                waiting;
+    int                capacity;
+};
+
+/* -------------------------------------------------------------------------- */
+static short to_poll_events(int events)
+{
+    return (short)(((events & CASYNC_READ) ? POLLIN : 0) |
+                   ((events & CASYNC_WRITE) ? POLLOUT : 0));
+}
+
+/* -------------------------------------------------------------------------- */
+static int from_poll_events(short revents, int events)
+{
+    if (revents & (POLLERR | POLLHUP | POLLNVAL))
+        return events;
+    return (((revents & POLLIN) ? CASYNC_READ : 0) |
+            ((revents & POLLOUT) ? CASYNC_WRITE : 0)) &
+           events;
+}
+
+/* -------------------------------------------------------------------------- */
+static int to_ms(int64_t timeout_ns)
+{
+    /* Round up, so we never wake up before a timer expires */
+    if (timeout_ns < 0)
+        return -1;
+    if (timeout_ns > (int64_t)INT_MAX * 1000000)
+        return INT_MAX;
+    return (int)((timeout_ns + 999999) / 1000000);
+}
+
+/* -------------------------------------------------------------------------- */
+static int wait_fd_blocking(int fd, int events)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = to_poll_events(events);
+    pfd.revents = 0;
+
+    while (poll(&pfd, 1, -1) == -1)
+        if (errno != EINTR)
+            return -1;
+
+    return from_poll_events(pfd.revents, events);
+}
+
+/* -------------------------------------------------------------------------- */
+static int io_reserve(struct casync_loop* root)
+{
+    struct io_state* io = root->io;
+    if (io == NULL)
+    {
+        io = calloc(1, sizeof *io);
+        if (io == NULL)
+            return -1;
+        root->io = io;
+    }
+
+    if (io->waiting == io->capacity)
+    {
+        int                new_capacity = io->capacity ? io->capacity * 2 : 64;
+        struct io_waiter** new_waiters;
+        struct pollfd*     new_pfds;
+
+        new_waiters =
+            realloc(io->waiters, sizeof(*new_waiters) * new_capacity);
+        if (new_waiters == NULL)
+            return -1;
+        io->waiters = new_waiters;
+
+        new_pfds = realloc(io->pfds, sizeof(*new_pfds) * new_capacity);
+        if (new_pfds == NULL)
+            return -1;
+        io->pfds = new_pfds;
+
+        io->capacity = new_capacity;
+    }
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int io_unpark(void* ctx)
+{
+    struct io_waiter* waiter = ctx;
+    struct io_state*  io = waiter->io;
+    int               i;
+
+    for (i = 0; io->waiters[i] != waiter; ++i)
+    {
+    }
+    io->waiters[i] = io->waiters[--io->waiting];
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_wait_fd(int fd, int events)
+{
+    struct casync_loop* loop = casync_current_loop;
+    struct io_state*    io;
+    struct io_waiter    local;
+    struct io_waiter*   waiter;
+    int                 rc;
+
+    if (loop == NULL)
+        return wait_fd_blocking(fd, events);
+
+    if (io_reserve(loop->root) != 0)
+        return -1;
+
+    io = loop->root->io;
+    waiter = casync_wait_area(&local, sizeof local);
+    waiter->task = loop->active;
+    waiter->io = io;
+    waiter->fd = fd;
+    waiter->events = events;
+    waiter->revents = 0;
+    io->waiters[io->waiting++] = waiter;
+
+    if ((rc = casync_park(io_unpark, waiter)) != 0)
+    {
+        errno = ECANCELED;
+        return rc;
+    }
+    return waiter->revents;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_io_poll(struct casync_loop* root, int64_t timeout_ns)
+{
+    struct io_state* io = root->io;
+    int              i, n;
+
+    /* Without waiters, only sleep if a timer is pending. WSAPoll() refuses
+     * to wait on an empty set, so sleep explicitly */
+    if (io == NULL || io->waiting == 0)
+    {
+        if (timeout_ns > 0)
+            sleep_ms(to_ms(timeout_ns));
+        return;
+    }
+
+    for (i = 0; i != io->waiting; ++i)
+    {
+        io->pfds[i].fd = io->waiters[i]->fd;
+        io->pfds[i].events = to_poll_events(io->waiters[i]->events);
+        io->pfds[i].revents = 0;
+    }
+
+    n = poll(io->pfds, io->waiting, to_ms(timeout_ns));
+    if (n <= 0)
+        return;
+
+    /* Remove ready waiters by swapping in the last element. The pollfd array
+     * is kept in sync so the remaining entries still line up */
+    for (i = 0; i < io->waiting;)
+    {
+        struct io_waiter* w = io->waiters[i];
+        if (io->pfds[i].revents == 0)
+        {
+            ++i;
+            continue;
+        }
+
+        w->revents = from_poll_events(io->pfds[i].revents, w->events);
+        io->waiting--;
+        io->waiters[i] = io->waiters[io->waiting];
+        io->pfds[i] = io->pfds[io->waiting];
+        casync_wake(w->task);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_io_submit(const struct casync_io_op* op, int* result)
+{
+    /* Only readiness is supported, util/ falls back to non-blocking calls */
+    (void)op;
+    (void)result;
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_io_destroy(struct casync_loop* root)
+{
+    struct io_state* io = root->io;
+    if (io == NULL)
+        return;
+
+    free(io->waiters);
+    free(io->pfds);
+    free(io);
+    root->io = NULL;
+}
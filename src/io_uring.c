@@ -0,0 +1,451 @@
+#include "casync_internal.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * io_uring reactor. Co-routines queue submission entries and park. Nothing is
+ * submitted until the root loop has run every runnable task, so all the
+ * system calls of one scheduler round go to the kernel in a single
+ * io_uring_enter(), which also waits for completions if nothing is runnable.
+ * Completions are reaped straight from the shared ring without a system call.
+ *
+ * Waiting for readiness with casync_wait_fd() uses IORING_OP_POLL_ADD, so the
+ * same ring serves both styles of I/O. Requires Linux 5.11. If io_uring is
+ * unavailable (too old, or disabled by seccomp or sysctl), everything is
+ * forwarded to the epoll backend instead.
+ *
+ * A canceled co-routine can't be woken while its operation is in flight,
+ * because the kernel may still write to its buffers. Instead, the operation is
+ * canceled with IORING_OP_ASYNC_CANCEL, and the co-routine is woken by the
+ * completion as usual, which then usually reports -ECANCELED.
+ */
+
+#define RING_ENTRIES 256
+
+int  casync_epoll_wait_fd(int fd, int events);
+void casync_epoll_io_poll(struct casync_loop* root, int64_t timeout_ns);
+void casync_epoll_io_destroy(struct casync_loop* root);
+
+struct io_state;
+struct io_request
+{
+    struct casync_task* task;
+    struct io_state*    io;
+    int                 result;
+};
+
+struct io_state
+{
+    int                  ring_fd;
+    void*                ring;
+    size_t               ring_size;
+    struct io_uring_sqe* sqes;
+    size_t               sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned  sq_mask;
+    unsigned  sq_entries;
+
+    unsigned*            cq_head;
+    unsigned*            cq_tail;
+    struct io_uring_cqe* cqes;
+    unsigned             cq_mask;
+
+    int           in_flight;
+    unsigned char supported[IORING_OP_LAST];
+};
+
+/* Set once io_uring has failed to initialize on this thread */
+static THREADLOCAL int unavailable;
+
+/* -------------------------------------------------------------------------- */
+static int uring_enter(
+    int ring_fd, unsigned to_submit, unsigned min_complete, const int64_t* ns)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec      ts;
+    unsigned                      flags = 0;
+
+    if (min_complete > 0)
+        flags |= IORING_ENTER_GETEVENTS;
+    if (ns == NULL)
+        return (int)syscall(
+            __NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, 0, 0);
+
+    ts.tv_sec = *ns / 1000000000;
+    ts.tv_nsec = *ns % 1000000000;
+    memset(&arg, 0, sizeof arg);
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    return (int)syscall(
+        __NR_io_uring_enter,
+        ring_fd,
+        to_submit,
+        min_complete,
+        flags | IORING_ENTER_EXT_ARG,
+        &arg,
+        sizeof arg);
+}
+
+/* -------------------------------------------------------------------------- */
+static void uring_probe(struct io_state* io, unsigned features)
+{
+    struct io_uring_probe* probe;
+    size_t                 size =
+        sizeof(*probe) + sizeof(struct io_uring_probe_op) * IORING_OP_LAST;
+    int i;
+
+    if ((probe = calloc(1, size)) == NULL)
+        return;
+    if (syscall(
+            __NR_io_uring_register,
+            io->ring_fd,
+            IORING_REGISTER_PROBE,
+            probe,
+            IORING_OP_LAST) == 0)
+        for (i = 0; i != probe->ops_len && i != IORING_OP_LAST; ++i)
+            io->supported[i] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+
+    /* An offset of -1 only means "current position" with this feature */
+    if (!(features & IORING_FEAT_RW_CUR_POS))
+    {
+        io->supported[IORING_OP_READ] = 0;
+        io->supported[IORING_OP_WRITE] = 0;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+static void uring_destroy(struct io_state* io)
+{
+    if (io->sqes != NULL && io->sqes != MAP_FAILED)
+        munmap(io->sqes, io->sqes_size);
+    if (io->ring != NULL && io->ring != MAP_FAILED)
+        munmap(io->ring, io->ring_size);
+    close(io->ring_fd);
+    free(io);
+}
+
+/* -------------------------------------------------------------------------- */
+static struct io_state* uring_create(void)
+{
+    struct io_uring_params p;
+    struct io_state*       io;
+    size_t                 cq_size;
+    uint8_t*               ring;
+    const unsigned         required =
+        IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+
+    if ((io = calloc(1, sizeof *io)) == NULL)
+        return NULL;
+
+    memset(&p, 0, sizeof p);
+    io->ring_fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (io->ring_fd < 0)
+    {
+        free(io);
+        return NULL;
+    }
+    if ((p.features & required) != required)
+    {
+        uring_destroy(io);
+        return NULL;
+    }
+
+    /* The SQ and CQ rings share one mapping */
+    io->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > io->ring_size)
+        io->ring_size = cq_size;
+    io->ring = mmap(
+        NULL,
+        io->ring_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        io->ring_fd,
+        IORING_OFF_SQ_RING);
+    io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(
+        NULL,
+        io->sqes_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        io->ring_fd,
+        IORING_OFF_SQES);
+    if (io->ring == MAP_FAILED || io->sqes == MAP_FAILED)
+    {
+        uring_destroy(io);
+        return NULL;
+    }
+
+    ring = io->ring;
+    io->sq_head = (unsigned*)(ring + p.sq_off.head);
+    io->sq_tail = (unsigned*)(ring + p.sq_off.tail);
+    io->sq_array = (unsigned*)(ring + p.sq_off.array);
+    io->sq_mask = *(unsigned*)(ring + p.sq_off.ring_mask);
+    io->sq_entries = p.sq_entries;
+    io->cq_head = (unsigned*)(ring + p.cq_off.head);
+    io->cq_tail = (unsigned*)(ring + p.cq_off.tail);
+    io->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+    io->cq_mask = *(unsigned*)(ring + p.cq_off.ring_mask);
+
+    uring_probe(io, p.features);
+    return io;
+}
+
+/* -------------------------------------------------------------------------- */
+static struct io_state* io_get(struct casync_loop* root)
+{
+    if (root->io == NULL && !unavailable)
+        if ((root->io = uring_create()) == NULL)
+            unavailable = 1;
+    return unavailable ? NULL : root->io;
+}
+
+/* -------------------------------------------------------------------------- */
+static unsigned sq_pending(struct io_state* io)
+{
+    /* The kernel advances the head as it consumes entries */
+    return *io->sq_tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* -------------------------------------------------------------------------- */
+static struct io_uring_sqe* sqe_get(struct io_state* io)
+{
+    unsigned             tail = *io->sq_tail;
+    struct io_uring_sqe* sqe;
+
+    /* The kernel copies entries when they are submitted, so submitting early
+     * frees up the queue */
+    if (sq_pending(io) == io->sq_entries)
+    {
+        uring_enter(io->ring_fd, io->sq_entries, 0, NULL);
+        if (sq_pending(io) == io->sq_entries)
+            return NULL;
+    }
+
+    sqe = &io->sqes[tail & io->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    io->sq_array[tail & io->sq_mask] = tail & io->sq_mask;
+    return sqe;
+}
+
+/* -------------------------------------------------------------------------- */
+static void sqe_push(struct io_state* io)
+{
+    __atomic_store_n(io->sq_tail, *io->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* -------------------------------------------------------------------------- */
+static int request_unpark(void* ctx)
+{
+    struct io_request*   req = ctx;
+    struct io_uring_sqe* sqe = sqe_get(req->io);
+
+    /* The completion of the cancel request itself has no user data and is
+     * ignored. If the queue is full, the operation just runs to completion */
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t)(uintptr_t)req;
+        sqe_push(req->io);
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int sqe_submit_and_park(struct io_state* io, struct io_uring_sqe* sqe)
+{
+    struct io_request  local;
+    struct io_request* req = casync_wait_area(&local, sizeof local);
+    req->task = casync_current_loop->active;
+    req->io = io;
+    req->result = 0;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+
+    sqe_push(io);
+    io->in_flight++;
+
+    casync_park(request_unpark, req);
+    return req->result;
+}
+
+/* -------------------------------------------------------------------------- */
+static int opcode_of(enum casync_io_opcode op)
+{
+    switch (op)
+    {
+        case CASYNC_OP_READ: return IORING_OP_READ;
+        case CASYNC_OP_WRITE: return IORING_OP_WRITE;
+        case CASYNC_OP_RECV: return IORING_OP_RECV;
+        case CASYNC_OP_SEND: return IORING_OP_SEND;
+        case CASYNC_OP_ACCEPT: return IORING_OP_ACCEPT;
+        case CASYNC_OP_OPENAT: return IORING_OP_OPENAT;
+    }
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_io_submit(const struct casync_io_op* op, int* result)
+{
+    struct io_state*     io;
+    struct io_uring_sqe* sqe;
+    int                  opcode = opcode_of(op->opcode);
+
+    if (casync_current_loop == NULL || opcode < 0)
+        return -1;
+    if ((io = io_get(casync_current_loop->root)) == NULL)
+        return -1;
+    if (casync_current_loop->active->canceled)
+    {
+        *result = -ECANCELED;
+        return 0;
+    }
+    /* The kernel would access buffers on a shared stack after they moved, see
+     * casync_attr::shared_stack. The caller falls back to waiting for
+     * readiness */
+    if (casync_current_loop->active->shared)
+        return -1;
+    if (!io->supported[opcode] || (sqe = sqe_get(io)) == NULL)
+        return -1;
+
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = op->fd;
+    sqe->addr = (uint64_t)(uintptr_t)op->buf;
+    sqe->len = op->len > 0x7FFFF000 ? 0x7FFFF000 : (uint32_t)op->len;
+    switch (op->opcode)
+    {
+        case CASYNC_OP_READ:
+        case CASYNC_OP_WRITE: sqe->off = (uint64_t)-1; break;
+        case CASYNC_OP_RECV:
+        case CASYNC_OP_SEND: sqe->msg_flags = (uint32_t)op->flags; break;
+        case CASYNC_OP_ACCEPT:
+            sqe->addr = (uint64_t)(uintptr_t)op->addr;
+            sqe->addr2 = (uint64_t)(uintptr_t)op->addr_len;
+            sqe->len = 0;
+            sqe->accept_flags = (uint32_t)op->flags;
+            break;
+        case CASYNC_OP_OPENAT:
+            sqe->addr = (uint64_t)(uintptr_t)op->path;
+            sqe->len = op->mode;
+            sqe->open_flags = (uint32_t)op->flags;
+            break;
+    }
+
+    *result = sqe_submit_and_park(io, sqe);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_wait_fd(int fd, int events)
+{
+    struct io_state*     io;
+    struct io_uring_sqe* sqe;
+    int                  revents;
+
+    if (casync_current_loop == NULL)
+        return casync_epoll_wait_fd(fd, events);
+    if ((io = io_get(casync_current_loop->root)) == NULL)
+        return casync_epoll_wait_fd(fd, events);
+    if (casync_current_loop->active->canceled)
+        revents = -ECANCELED;
+    else if ((sqe = sqe_get(io)) == NULL)
+        return -1;
+    else
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        if (events & CASYNC_READ)
+            sqe->poll32_events |= POLLIN;
+        if (events & CASYNC_WRITE)
+            sqe->poll32_events |= POLLOUT;
+        revents = sqe_submit_and_park(io, sqe);
+    }
+
+    if (revents < 0)
+    {
+        errno = -revents;
+        return revents == -ECANCELED ? CASYNC_ECANCELED : -1;
+    }
+    if (revents & (POLLERR | POLLHUP))
+        return events;
+    return (((revents & POLLIN) ? CASYNC_READ : 0) |
+            ((revents & POLLOUT) ? CASYNC_WRITE : 0)) &
+           events;
+}
+
+/* -------------------------------------------------------------------------- */
+static void uring_reap(struct io_state* io)
+{
+    unsigned head = *io->cq_head;
+    unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head)
+    {
+        struct io_uring_cqe* cqe = &io->cqes[head & io->cq_mask];
+        struct io_request*   req = (struct io_request*)(uintptr_t)cqe->user_data;
+        if (req == NULL)
+            continue;
+        req->result = cqe->res;
+        io->in_flight--;
+        casync_wake(req->task);
+    }
+
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_io_poll(struct casync_loop* root, int64_t timeout_ns)
+{
+    struct io_state* io = root->io;
+
+    /* Only create a ring to sleep on if a timer is pending */
+    if (io == NULL && timeout_ns > 0)
+        io = io_get(root);
+    if (unavailable)
+    {
+        casync_epoll_io_poll(root, timeout_ns);
+        return;
+    }
+    if (io == NULL)
+        return;
+
+    if (timeout_ns != 0 && (io->in_flight > 0 || timeout_ns > 0))
+    {
+        /* Submit everything and sleep until something completes */
+        uring_enter(
+            io->ring_fd,
+            sq_pending(io),
+            1,
+            timeout_ns > 0 ? &timeout_ns : NULL);
+    }
+    else if (sq_pending(io) > 0)
+        uring_enter(io->ring_fd, sq_pending(io), 0, NULL);
+
+    uring_reap(io);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_io_destroy(struct casync_loop* root)
+{
+    if (unavailable)
+    {
+        casync_epoll_io_destroy(root);
+        return;
+    }
+    if (root->io == NULL)
+        return;
+
+    uring_destroy(root->io);
+    root->io = NULL;
+}
@@ -0,0 +1,242 @@
+#include "casync_internal.h"
+
+#include <limits.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#    include <sys/syscall.h>
+#endif
+
+#if !defined(MAP_NORESERVE)
+#    define MAP_NORESERVE 0
+#endif
+#if !defined(MAP_STACK)
+#    define MAP_STACK 0
+#endif
+
+/*
+ * Memory layout of a dynamically allocated task:
+ *
+ *   | guard page | stack ...           | struct casync_task |
+ *   ^ mapping                          ^ task
+ *
+ * The stack grows down towards the guard page, away from the task. Pages are
+ * only committed by the kernel when they are first touched.
+ */
+
+#define ROUND_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
+#define HEADER_SIZE        ROUND_UP(sizeof(struct casync_task), 64)
+#define HUGE_PAGE_SIZE     ((size_t)2 * 1024 * 1024)
+#define MPOL_PREFERRED     1
+
+/* -------------------------------------------------------------------------- */
+static size_t page_size(void)
+{
+    static THREADLOCAL size_t size;
+    if (size == 0)
+        size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/* -------------------------------------------------------------------------- */
+struct casync_task* casync_stack_map(size_t stack_size)
+{
+    size_t              page = page_size();
+    size_t              total = page + ROUND_UP(stack_size + HEADER_SIZE, page);
+    uint8_t*            mem;
+    struct casync_task* task;
+
+    mem = mmap(
+        NULL,
+        total,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+        -1,
+        0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    /* The guard page is only a safety net. If it can't be set up, because
+     * splitting the mapping exceeds vm.max_map_count, carry on without */
+    mprotect(mem, page, PROT_NONE);
+
+    task = (struct casync_task*)(mem + total - HEADER_SIZE);
+    task->stack_base = mem + page;
+    task->stack_size = total - page - HEADER_SIZE;
+    return task;
+}
+
+/* -------------------------------------------------------------------------- */
+struct casync_task* casync_stack_map_many(size_t stack_size, size_t n)
+{
+    size_t              page = page_size();
+    size_t              slot = page + ROUND_UP(stack_size + HEADER_SIZE, page);
+    uint8_t*            mem;
+    struct casync_task* list = NULL;
+    int                 guard = 1;
+
+    if (n == 0 || slot > SIZE_MAX / n)
+        return NULL;
+    mem = mmap(
+        NULL,
+        slot * n,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+        -1,
+        0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    /* Every slot is laid out like a mapping of its own, so each task can be
+     * unmapped on its own as well. Build the list backwards, so it is in
+     * address order */
+    while (n--)
+    {
+        uint8_t*            slot_mem = mem + slot * n;
+        struct casync_task* task =
+            (struct casync_task*)(slot_mem + slot - HEADER_SIZE);
+
+        /* Once the mapping can't be split any further, the other guard pages
+         * would fail the same way */
+        if (guard && mprotect(slot_mem, page, PROT_NONE) != 0)
+            guard = 0;
+
+        task->stack_base = slot_mem + page;
+        task->stack_size = slot - page - HEADER_SIZE;
+        task->next = list;
+        list = task;
+    }
+    return list;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_unmap(struct casync_task* task)
+{
+    size_t   page = page_size();
+    uint8_t* mem = (uint8_t*)task->stack_base - page;
+    munmap(mem, page + task->stack_size + HEADER_SIZE);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_unmap_many(struct casync_task* list)
+{
+    size_t   page = page_size();
+    uint8_t* low = NULL;
+    uint8_t* high = NULL;
+
+    /* Tasks of one casync_stack_map_many() block tend to finish in order, so
+     * neighbours are usually next to each other in the list as well. Unmap
+     * each stretch of neighbours at once */
+    for (; list != NULL; list = list->next)
+    {
+        uint8_t* mem = (uint8_t*)list->stack_base - page;
+        uint8_t* end = (uint8_t*)list->stack_base + list->stack_size +
+                       HEADER_SIZE;
+
+        if (mem == high)
+            high = end;
+        else if (end == low)
+            low = mem;
+        else
+        {
+            if (low != NULL)
+                munmap(low, (size_t)(high - low));
+            low = mem;
+            high = end;
+        }
+    }
+    if (low != NULL)
+        munmap(low, (size_t)(high - low));
+}
+
+/* -------------------------------------------------------------------------- */
+static void arena_bind_local(void* mem, size_t size)
+{
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+    /* Prefer, rather than bind, so the kernel can still fall back to other
+     * nodes once ours is full. This avoids a dependency on libnuma */
+    unsigned long mask[16] = {0};
+    unsigned      cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 ||
+        node >= sizeof mask * CHAR_BIT)
+        return;
+    mask[node / (sizeof *mask * CHAR_BIT)] |=
+        1ul << (node % (sizeof *mask * CHAR_BIT));
+    syscall(
+        SYS_mbind,
+        mem,
+        size,
+        MPOL_PREFERRED,
+        mask,
+        (unsigned long)(sizeof mask * CHAR_BIT),
+        0);
+#else
+    (void)mem;
+    (void)size;
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_stack_arena_map(size_t size, int flags)
+{
+    uint8_t* mem = MAP_FAILED;
+    uint8_t* aligned;
+
+    size = ROUND_UP(size, HUGE_PAGE_SIZE);
+
+#if defined(MAP_HUGETLB)
+    /* Reserved huge pages are always 2 MiB aligned, but there usually aren't
+     * any */
+    if (flags & CASYNC_ARENA_HUGE_PAGES)
+        mem = mmap(
+            NULL,
+            size,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+            -1,
+            0);
+#endif
+    if (mem == MAP_FAILED)
+    {
+        /* Transparent huge pages need the range to be aligned. Map one more
+         * huge page than needed, and cut off what lies outside */
+        mem = mmap(
+            NULL,
+            size + HUGE_PAGE_SIZE,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+            -1,
+            0);
+        if (mem == MAP_FAILED)
+            return NULL;
+        aligned = (uint8_t*)ROUND_UP((uintptr_t)mem, HUGE_PAGE_SIZE);
+        if (aligned != mem)
+            munmap(mem, (size_t)(aligned - mem));
+        munmap(aligned + size, (size_t)(mem + HUGE_PAGE_SIZE - aligned));
+        mem = aligned;
+#if defined(MADV_HUGEPAGE)
+        if (flags & CASYNC_ARENA_HUGE_PAGES)
+            madvise(mem, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    /* Before anything touches it, which is when pages are placed */
+    if (flags & CASYNC_ARENA_NUMA_LOCAL)
+        arena_bind_local(mem, size);
+    return mem;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_arena_unmap(void* memory, size_t size)
+{
+    munmap(memory, ROUND_UP(size, HUGE_PAGE_SIZE));
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_trim(struct casync_task* task)
+{
+    /* The last page is shared with the task, leave it alone */
+    size_t page = page_size();
+    madvise(task->stack_base, task->stack_size & ~(page - 1), MADV_DONTNEED);
+}
@@ -0,0 +1,146 @@
+#include "casync_internal.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+
+/*
+ * Memory layout of a dynamically allocated task:
+ *
+ *   | guard page | stack ...           | struct casync_task |
+ *   ^ allocation                       ^ task
+ *
+ * The stack grows down towards the guard page, away from the task. Windows
+ * only backs committed pages with physical memory when they are first touched.
+ */
+
+#define ROUND_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
+#define HEADER_SIZE        ROUND_UP(sizeof(struct casync_task), 64)
+#define HUGE_PAGE_SIZE     ((size_t)2 * 1024 * 1024)
+
+/* -------------------------------------------------------------------------- */
+static size_t page_size(void)
+{
+    static THREADLOCAL size_t size;
+    if (size == 0)
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        size = info.dwPageSize;
+    }
+    return size;
+}
+
+/* -------------------------------------------------------------------------- */
+struct casync_task* casync_stack_map(size_t stack_size)
+{
+    size_t              page = page_size();
+    size_t              total = page + ROUND_UP(stack_size + HEADER_SIZE, page);
+    uint8_t*            mem;
+    struct casync_task* task;
+    DWORD               old_protect;
+
+    mem = VirtualAlloc(NULL, total, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (mem == NULL)
+        return NULL;
+    VirtualProtect(mem, page, PAGE_NOACCESS, &old_protect);
+
+    task = (struct casync_task*)(mem + total - HEADER_SIZE);
+    task->stack_base = mem + page;
+    task->stack_size = total - page - HEADER_SIZE;
+    return task;
+}
+
+/* -------------------------------------------------------------------------- */
+struct casync_task* casync_stack_map_many(size_t stack_size, size_t n)
+{
+    struct casync_task* list = NULL;
+    struct casync_task* task;
+
+    /* VirtualFree() can only release a whole allocation, and the tasks are
+     * freed one by one. So each gets an allocation of its own */
+    while (n--)
+    {
+        if ((task = casync_stack_map(stack_size)) == NULL)
+        {
+            for (; list != NULL; list = task)
+            {
+                task = list->next;
+                casync_stack_unmap(list);
+            }
+            return NULL;
+        }
+        task->next = list;
+        list = task;
+    }
+    return list;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_unmap(struct casync_task* task)
+{
+    VirtualFree((uint8_t*)task->stack_base - page_size(), 0, MEM_RELEASE);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_unmap_many(struct casync_task* list)
+{
+    struct casync_task* next;
+    for (; list != NULL; list = next)
+    {
+        next = list->next;
+        casync_stack_unmap(list);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_stack_arena_map(size_t size, int flags)
+{
+    DWORD            type = MEM_RESERVE | MEM_COMMIT;
+    DWORD            node = NUMA_NO_PREFERRED_NODE;
+    PROCESSOR_NUMBER processor;
+    USHORT           numa_node;
+    void*            mem = NULL;
+
+    size = ROUND_UP(size, HUGE_PAGE_SIZE);
+    if (flags & CASYNC_ARENA_NUMA_LOCAL)
+    {
+        GetCurrentProcessorNumberEx(&processor);
+        if (GetNumaProcessorNodeEx(&processor, &numa_node))
+            node = numa_node;
+    }
+
+    /* Large pages need SeLockMemoryPrivilege, which processes rarely have.
+     * Windows has no transparent huge pages to fall back to */
+    if ((flags & CASYNC_ARENA_HUGE_PAGES) && GetLargePageMinimum() != 0 &&
+        size % GetLargePageMinimum() == 0)
+        mem = VirtualAllocExNuma(
+            GetCurrentProcess(),
+            NULL,
+            size,
+            type | MEM_LARGE_PAGES,
+            PAGE_READWRITE,
+            node);
+    if (mem == NULL)
+        mem = VirtualAllocExNuma(
+            GetCurrentProcess(), NULL, size, type, PAGE_READWRITE, node);
+    return mem;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_arena_unmap(void* memory, size_t size)
+{
+    (void)size;
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_trim(struct casync_task* task)
+{
+    /* The last page is shared with the task, leave it alone */
+    size_t page = page_size();
+    VirtualAlloc(
+        task->stack_base,
+        task->stack_size & ~(page - 1),
+        MEM_RESET,
+        PAGE_READWRITE);
+}
@@ -0,0 +1,436 @@
+#include "casync_internal.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Parallel runtime. Every worker thread runs its own casync_gather() with a
+ * dispatcher co-routine in it. Co-routines started in a worker aren't put into
+ * the ring right away. Instead, a descriptor is pushed onto the worker's deque.
+ * The dispatcher pops descriptors from the bottom (newest first, while its
+ * data is still in the cache), and idle workers steal from the top.
+ *
+ * A worker with nothing to run or steal waits on its notifier, see
+ * casync_thread_notifier_create(), so its loop still services the I/O and
+ * timers of its parked jobs. It sets "idle" first, and whoever queues a job
+ * or finishes the last one signals idle workers. Both sides store one
+ * variable and then load the other, the same way as in src/submit.c, so
+ * either the worker sees the job, or the other side sees the worker is idle.
+ *
+ * Only co-routines that haven't started yet are stolen. Once started, a
+ * co-routine stays on its worker, because its stack may hold pointers to
+ * thread-local state and its loop can't be shared between threads.
+ */
+
+/* Where there are no notifiers, idle workers poll instead */
+#define IDLE_POLL_NS 100000
+
+struct runtime;
+struct worker;
+
+struct job
+{
+    int (*function)(void*);
+    void*              arg;
+    struct casync_attr attr;
+    struct worker*     worker; /* Worker that started the job */
+};
+
+struct worker
+{
+    struct casync_spawner spawner; /* Must be first */
+    struct runtime*       runtime;
+    void*                 lock;
+    struct job**          jobs; /* Ring buffer, protected by lock */
+    size_t                head;
+    size_t                count;
+    size_t                capacity;
+    int                   index;
+    void*                 notifier; /* NULL if not available */
+    volatile long         idle;     /* Waiting on the notifier */
+};
+
+struct runtime
+{
+    struct worker* workers;
+    int            worker_count;
+    volatile long  pending; /* Jobs spawned and not finished */
+    volatile long  queued;  /* Jobs in the deques */
+    void*          lock;
+    int            return_code;
+};
+
+/* -------------------------------------------------------------------------- */
+static int deque_push(struct worker* w, struct job* job)
+{
+    casync_thread_mutex_lock(w->lock);
+    if (w->count == w->capacity)
+    {
+        size_t       new_capacity = w->capacity ? w->capacity * 2 : 64;
+        struct job** new_jobs = malloc(sizeof(*new_jobs) * new_capacity);
+        size_t       i;
+        if (new_jobs == NULL)
+        {
+            casync_thread_mutex_unlock(w->lock);
+            return -1;
+        }
+        for (i = 0; i != w->count; ++i)
+            new_jobs[i] = w->jobs[(w->head + i) % w->capacity];
+        free(w->jobs);
+        w->jobs = new_jobs;
+        w->head = 0;
+        w->capacity = new_capacity;
+    }
+    w->jobs[(w->head + w->count) % w->capacity] = job;
+    w->count++;
+    casync_thread_mutex_unlock(w->lock);
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static struct job* deque_pop(struct worker* w)
+{
+    struct job* job = NULL;
+    casync_thread_mutex_lock(w->lock);
+    if (w->count > 0)
+    {
+        w->count--;
+        job = w->jobs[(w->head + w->count) % w->capacity];
+    }
+    casync_thread_mutex_unlock(w->lock);
+    if (job != NULL)
+        casync_atomic_add(&w->runtime->queued, -1);
+    return job;
+}
+
+/* -------------------------------------------------------------------------- */
+static struct job* deque_steal(struct worker* w)
+{
+    struct job* job = NULL;
+    casync_thread_mutex_lock(w->lock);
+    if (w->count > 0)
+    {
+        job = w->jobs[w->head];
+        w->head = (w->head + 1) % w->capacity;
+        w->count--;
+    }
+    casync_thread_mutex_unlock(w->lock);
+    if (job != NULL)
+        casync_atomic_add(&w->runtime->queued, -1);
+    return job;
+}
+
+/* -------------------------------------------------------------------------- */
+static int worker_wake(struct worker* w)
+{
+    /* Only the first to clear the flag signals */
+    if (!casync_atomic_load(&w->idle) || !casync_atomic_exchange(&w->idle, 0))
+        return 0;
+    casync_thread_notifier_signal(w->notifier);
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+static void runtime_wake(struct worker* w)
+{
+    struct runtime* rt = w->runtime;
+    int             i;
+
+    /* The owner of the deque, whose dispatcher may still wait while the job
+     * that queued this one runs, and one idle worker to steal it meanwhile */
+    worker_wake(w);
+    for (i = 1; i < rt->worker_count; ++i)
+        if (worker_wake(&rt->workers[(w->index + i) % rt->worker_count]))
+            return;
+}
+
+/* -------------------------------------------------------------------------- */
+static void runtime_job_done(struct runtime* rt)
+{
+    int i;
+
+    /* Idle workers return once every job is done */
+    if (casync_atomic_add(&rt->pending, -1) != 0)
+        return;
+    for (i = 0; i != rt->worker_count; ++i)
+        worker_wake(&rt->workers[i]);
+}
+
+/* -------------------------------------------------------------------------- */
+static void runtime_set_error(struct runtime* rt, int return_code)
+{
+    casync_thread_mutex_lock(rt->lock);
+    rt->return_code = return_code;
+    casync_thread_mutex_unlock(rt->lock);
+}
+
+/* -------------------------------------------------------------------------- */
+static int runtime_push(
+    struct worker*            w,
+    const struct casync_attr* attr,
+    int (*function)(void*),
+    void* arg)
+{
+    struct job* job = malloc(sizeof *job);
+    if (job == NULL)
+        return -1;
+
+    job->function = function;
+    job->arg = arg;
+    job->worker = NULL;
+    if (attr != NULL)
+        job->attr = *attr;
+    else
+        memset(&job->attr, 0, sizeof job->attr);
+
+    /* Count the job before anyone can see it, so workers can't observe zero
+     * pending jobs while it sits in the deque */
+    casync_atomic_add(&w->runtime->pending, 1);
+    if (deque_push(w, job) != 0)
+    {
+        casync_atomic_add(&w->runtime->pending, -1);
+        free(job);
+        return -1;
+    }
+
+    casync_atomic_add(&w->runtime->queued, 1);
+    runtime_wake(w);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void worker_spawn(
+    struct casync_spawner*    spawner,
+    const struct casync_attr* attr,
+    int (*function)(void*),
+    void* arg)
+{
+    struct worker* w = (struct worker*)spawner;
+    if (runtime_push(w, attr, function, arg) != 0)
+        runtime_set_error(w->runtime, -1);
+}
+
+/* -------------------------------------------------------------------------- */
+static int run_job(void* arg)
+{
+    struct job*    job = arg;
+    struct worker* w = job->worker;
+    int            rc = job->function(job->arg);
+
+    free(job);
+    if (rc != 0)
+        runtime_set_error(w->runtime, rc);
+    runtime_job_done(w->runtime);
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void
+start_job(struct worker* w, struct casync_loop* loop, struct job* job)
+{
+    job->worker = w;
+    if (casync_loop_start(loop, &job->attr, run_job, job) == 0)
+        return;
+
+    free(job);
+    runtime_set_error(w->runtime, -1);
+    runtime_job_done(w->runtime);
+}
+
+/* -------------------------------------------------------------------------- */
+static struct job* steal(struct worker* thief)
+{
+    struct runtime* rt = thief->runtime;
+    int             i;
+
+    if (casync_atomic_load(&rt->queued) == 0)
+        return NULL;
+    for (i = 1; i < rt->worker_count; ++i)
+    {
+        struct worker* victim =
+            &rt->workers[(thief->index + i) % rt->worker_count];
+        struct job* job = deque_steal(victim);
+        if (job != NULL)
+            return job;
+    }
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+static int ring_empty(struct casync_loop* loop)
+{
+    /* Nothing but the dispatcher and the control task */
+    return loop->active->next == &loop->control_task &&
+           loop->active->prev == &loop->control_task;
+}
+
+/* -------------------------------------------------------------------------- */
+static void worker_idle(struct worker* w)
+{
+    struct runtime* rt = w->runtime;
+
+    /* Parking lets the loop service the I/O and timers of our parked jobs */
+    if (w->notifier == NULL)
+    {
+        casync_sleep_ns(IDLE_POLL_NS);
+        return;
+    }
+
+    casync_atomic_exchange(&w->idle, 1);
+    if (casync_atomic_load(&rt->queued) == 0 &&
+        casync_atomic_load(&rt->pending) != 0)
+    {
+        casync_wait_fd(casync_thread_notifier_fd(w->notifier), CASYNC_READ);
+        casync_thread_notifier_drain(w->notifier);
+    }
+    casync_atomic_exchange(&w->idle, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+static int worker_main(void* arg)
+{
+    struct worker*      w = arg;
+    struct casync_loop* loop = casync_current_loop;
+
+    loop->spawner = &w->spawner;
+
+    while (casync_atomic_load(&w->runtime->pending) != 0)
+    {
+        struct job* job = deque_pop(w);
+        int         idle = ring_empty(loop);
+
+        /* Only steal once our own jobs are all parked or done. A busy worker
+         * would only contend for the others' locks and take on more work */
+        if (job == NULL && idle)
+            job = steal(w);
+        if (job != NULL)
+            start_job(w, loop, job);
+        else if (idle)
+        {
+            /* Nothing to run and nothing to steal */
+            worker_idle(w);
+            continue;
+        }
+
+        casync_yield();
+    }
+
+    loop->spawner = NULL;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void worker_thread(void* arg)
+{
+    casync_gather(1, worker_main, arg);
+    casync_stack_cache_flush();
+}
+
+/* -------------------------------------------------------------------------- */
+static void runtime_deinit(struct runtime* rt)
+{
+    int i;
+    for (i = 0; i != rt->worker_count; ++i)
+    {
+        if (rt->workers[i].lock != NULL)
+            casync_thread_mutex_destroy(rt->workers[i].lock);
+        if (rt->workers[i].notifier != NULL)
+            casync_thread_notifier_destroy(rt->workers[i].notifier);
+        free(rt->workers[i].jobs);
+    }
+    if (rt->lock != NULL)
+        casync_thread_mutex_destroy(rt->lock);
+    free(rt->workers);
+}
+
+/* -------------------------------------------------------------------------- */
+static int runtime_init(struct runtime* rt, int workers)
+{
+    int i;
+
+    rt->pending = 0;
+    rt->queued = 0;
+    rt->return_code = 0;
+    rt->worker_count = 0;
+    rt->lock = casync_thread_mutex_create();
+    rt->workers = calloc(workers, sizeof(*rt->workers));
+    if (rt->workers == NULL || rt->lock == NULL)
+    {
+        runtime_deinit(rt);
+        return -1;
+    }
+
+    rt->worker_count = workers;
+    for (i = 0; i != workers; ++i)
+    {
+        rt->workers[i].spawner.spawn = worker_spawn;
+        rt->workers[i].runtime = rt;
+        rt->workers[i].index = i;
+        rt->workers[i].notifier = casync_thread_notifier_create();
+        if ((rt->workers[i].lock = casync_thread_mutex_create()) == NULL)
+        {
+            runtime_deinit(rt);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_gather_parallel(int workers, int n, ...)
+{
+    va_list        ap;
+    struct runtime rt;
+    void**         threads;
+    struct job*    job;
+    int            i;
+
+    if (workers <= 0)
+        workers = casync_cpu_count();
+
+    if ((threads = calloc(workers, sizeof(*threads))) == NULL)
+        return -1;
+    if (runtime_init(&rt, workers) != 0)
+    {
+        free(threads);
+        return -1;
+    }
+
+    /* Deal the initial co-routines out round-robin, so workers don't have to
+     * start by stealing */
+    va_start(ap, n);
+    for (i = 0; i != n; ++i)
+    {
+        void* function = va_arg(ap, void*);
+        void* arg = va_arg(ap, void*);
+        if (runtime_push(&rt.workers[i % workers], NULL, function, arg) != 0)
+            rt.return_code = -1;
+    }
+    va_end(ap);
+
+    /* The calling thread is worker 0. If a thread fails to start, the other
+     * workers steal its share */
+    for (i = 1; i < workers; ++i)
+        threads[i] = casync_thread_start(worker_thread, &rt.workers[i]);
+    casync_gather(1, worker_main, &rt.workers[0]);
+    for (i = 1; i < workers; ++i)
+        if (threads[i] != NULL)
+            casync_thread_join(threads[i]);
+    free(threads);
+
+    /* Only left over if worker 0 couldn't start and no thread could either */
+    for (i = 0; i != workers; ++i)
+        while ((job = deque_pop(&rt.workers[i])) != NULL)
+        {
+            free(job);
+            rt.return_code = -1;
+        }
+
+    runtime_deinit(&rt);
+    return rt.return_code;
+}
@@ -0,0 +1,276 @@
+#include "casync_internal.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+void casync_end_redirect(void);
+
+/*
+ * Tasks started with casync_attr::shared_stack all run on one stack per
+ * thread. Whoever ran on it last stays "resident" until another shared task
+ * needs the stack. Only then are the resident's frames copied out, from the
+ * stack pointer to the top, and the other task's frames copied back in to
+ * where they were. Switching between a shared task and ordinary ones costs no
+ * copying at all.
+ *
+ * The copying happens on the swapper, a task with a small stack of its own
+ * that is never part of a ring. Evicted tasks don't point to their stack
+ * frame, which isn't there anymore, but to the swapper's. So when
+ * casync_yield() switches to one, it resumes the swapper instead, with the
+ * evicted task still active. The swapper copies it in and then suspends
+ * itself into the proxy, whose "next" is the task, the same way every time.
+ * That keeps its frame where the evicted tasks point, and needs nothing from
+ * the assembly.
+ *
+ * Locals of a task that is evicted aren't where they used to be, so nothing
+ * may access them in the meantime. Whatever a parked task shares with whoever
+ * wakes it goes to its wait area instead, see casync_wait_area().
+ */
+
+/* The instrumented wrapper would count the swapper's switches */
+#undef casync_yield
+
+#define SWAPPER_STACK_SIZE (64 * 1024)
+#define SAVE_GRANULARITY   256
+#define WAIT_AREA_WORDS    8
+
+#define ROUND_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
+
+struct shared_task
+{
+    struct casync_task task; /* First, so the two convert */
+    int (*function)(void*);
+    void*  arg;
+    void*  resume; /* casync_task::stack while evicted, NULL until started */
+    char*  low;    /* Where the saved part of the stack goes back to */
+    char*  saved;
+    size_t saved_size;
+    size_t saved_capacity;
+    void*  wait_area[WAIT_AREA_WORDS];
+};
+
+struct shared_state
+{
+    struct casync_task* stack;    /* Only its stack memory is used */
+    struct casync_task* swapper;  /* Copies stacks around, see above */
+    struct casync_task  proxy;    /* Holds the frame of the suspended swapper */
+    struct casync_task* resident; /* Whose frames are on the stack */
+    size_t              tasks;    /* Shared tasks allocated on this thread */
+};
+
+static THREADLOCAL struct shared_state shared;
+
+/* -------------------------------------------------------------------------- */
+static void evict(struct shared_task* t, char* top)
+{
+    char*  low = casync_stack_low(t->task.stack);
+    size_t size = (size_t)(top - low);
+
+    /* Only shrink once the buffer got much too large, so a task whose depth
+     * varies doesn't reallocate on every switch */
+    if (size > t->saved_capacity || size < t->saved_capacity / 4)
+    {
+        size_t capacity = ROUND_UP(size, SAVE_GRANULARITY);
+        char*  saved = realloc(t->saved, capacity);
+
+        /* There is no way to report this in the middle of a switch, and the
+         * other task can't run without the stack */
+        if (saved == NULL)
+            abort();
+        t->saved = saved;
+        t->saved_capacity = capacity;
+    }
+
+    memcpy(t->saved, low, size);
+    t->saved_size = size;
+    t->low = low;
+    t->resume = t->task.stack;
+    t->task.stack = shared.proxy.stack;
+#if defined(CASYNC_STATS)
+    if (t->task.stats.saved < size)
+        t->task.stats.saved = size;
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+static void swap_in(struct casync_loop* loop, struct shared_task* t)
+{
+    char*  base = shared.stack->stack_base;
+    char*  top = base + shared.stack->stack_size;
+    size_t copied = 0;
+
+    if (shared.resident != NULL)
+    {
+        evict((struct shared_task*)shared.resident, top);
+        copied += ((struct shared_task*)shared.resident)->saved_size;
+    }
+    shared.resident = &t->task;
+
+    if (t->resume == NULL)
+        t->task.stack = casync_init_stack(
+            t->function,
+            t->arg,
+            casync_end_redirect,
+            base,
+            (int)shared.stack->stack_size);
+    else
+    {
+        memcpy(t->low, t->saved, t->saved_size);
+        copied += t->saved_size;
+        t->task.stack = t->resume;
+    }
+
+#if defined(CASYNC_STATS)
+    loop->stats.stack_copies++;
+    loop->stats.stack_copied += copied;
+#else
+    (void)loop;
+    (void)copied;
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+static int swapper_main(void* arg)
+{
+    /* The first time around, shared_init() only wants us to suspend */
+    struct casync_task* task = arg;
+
+    while (1)
+    {
+        /* casync_yield() saves the active task's frame into its "stack", and
+         * switches to its "next". So this always leaves our frame in the
+         * proxy, at the same address */
+        shared.proxy.next = task;
+        casync_current_loop->active = &shared.proxy;
+        casync_yield();
+
+        /* Someone switched to an evicted task, which brought us here */
+        task = casync_current_loop->active;
+        swap_in(casync_current_loop, (struct shared_task*)task);
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void shared_release(void)
+{
+    if (shared.stack)
+        casync_task_free(shared.stack);
+    if (shared.swapper)
+        casync_task_free(shared.swapper);
+    shared.stack = NULL;
+    shared.swapper = NULL;
+    shared.resident = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+static int shared_init(void)
+{
+    struct casync_loop* store_loop = casync_current_loop;
+    struct casync_loop  loop;
+    struct casync_task  self;
+
+    /* The assembly backends know where a suspended stack ends, ucontext
+     * doesn't */
+    if (casync_stack_low(&self) == NULL)
+        return -1;
+
+    shared.stack = casync_task_alloc(CASYNC_DEFAULT_STACK_SIZE);
+    shared.swapper = casync_task_alloc(SWAPPER_STACK_SIZE);
+    if (shared.stack == NULL || shared.swapper == NULL)
+    {
+        shared_release();
+        return -1;
+    }
+
+    memset(&shared.proxy, 0, sizeof shared.proxy);
+    casync_fpu_init(shared.swapper, CASYNC_FPU_CONTROL);
+    casync_fpu_init(&shared.proxy, CASYNC_FPU_CONTROL);
+    shared.swapper->stack = casync_init_stack(
+        swapper_main,
+        &self,
+        casync_end_redirect,
+        shared.swapper->stack_base,
+        (int)shared.swapper->stack_size);
+
+    /* Run the swapper once, through a loop of our own, so it is suspended
+     * where evicted tasks expect it before there are any */
+    memset(&loop, 0, sizeof loop);
+    memset(&self, 0, sizeof self);
+    casync_fpu_init(&self, CASYNC_FPU_CONTROL);
+    self.next = shared.swapper;
+    loop.active = &self;
+    casync_current_loop = &loop;
+    casync_yield();
+    casync_current_loop = store_loop;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+struct casync_task* casync_shared_task_alloc(void)
+{
+    struct shared_task* t;
+
+    if (shared.stack == NULL && shared_init() != 0)
+        return NULL;
+    if ((t = calloc(1, sizeof *t)) == NULL)
+    {
+        if (shared.tasks == 0)
+            shared_release();
+        return NULL;
+    }
+
+    t->task.shared = 1;
+    t->task.stack_base = shared.stack->stack_base;
+    t->task.stack_size = shared.stack->stack_size;
+    shared.tasks++;
+    return &t->task;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_shared_task_start(
+    struct casync_task* task, int (*function)(void*), void* arg)
+{
+    struct shared_task* t = (struct shared_task*)task;
+
+    /* Like an evicted task, whose frames are set up once it is swapped in */
+    t->function = function;
+    t->arg = arg;
+    t->resume = NULL;
+    task->stack = shared.proxy.stack;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_shared_task_end(struct casync_task* task)
+{
+    /* Whatever is left on the stack can be overwritten */
+    (void)task;
+    assert(shared.resident == task);
+    shared.resident = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_shared_task_free(struct casync_task* task)
+{
+    struct shared_task* t = (struct shared_task*)task;
+
+    free(t->saved);
+    free(t);
+
+    /* Nothing points to the swapper anymore */
+    if (--shared.tasks == 0)
+        shared_release();
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_wait_area(void* local, size_t size)
+{
+    struct casync_task* task = casync_current_loop->active;
+    (void)size;
+    if (!task->shared)
+        return local;
+
+    assert(size <= sizeof ((struct shared_task*)task)->wait_area);
+    return ((struct shared_task*)task)->wait_area;
+}
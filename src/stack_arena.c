@@ -0,0 +1,130 @@
+#include "casync_internal.h"
+
+/*
+ * Optional arenas for the stacks of the dynamic API, see casync_stack_arena().
+ * Stacks are packed back to back into chunks from casync_stack_arena_map(),
+ * without guard pages, so that a few huge pages hold thousands of small
+ * stacks:
+ *
+ *   | chunk | stack ... | task | stack ... | task | ... |
+ *
+ * Each chunk is carved into slots of one size class, powers of two from
+ * ARENA_MIN_STACK_SIZE up. Freed slots go back to the free list of their
+ * class, and stay backed by memory: trimming would split the huge pages. The
+ * chunks are only unmapped by casync_stack_cache_flush(), once none of their
+ * stacks is in use.
+ */
+
+#define ARENA_CHUNK_SIZE     ((size_t)2 * 1024 * 1024)
+#define ARENA_MIN_STACK_SIZE ((size_t)2 * 1024)
+#define ARENA_CLASS_COUNT    8 /* Up to 256 KiB, at least 8 per chunk */
+
+#define ROUND_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
+#define HEADER_SIZE        ROUND_UP(sizeof(struct casync_task), 64)
+
+struct arena_chunk
+{
+    struct arena_chunk* next;
+};
+
+struct arena
+{
+    struct casync_task* free[ARENA_CLASS_COUNT];
+    struct arena_chunk* chunks;
+    size_t              used; /* Stacks handed out and not freed yet */
+    int                 flags;
+};
+
+static THREADLOCAL struct arena arena;
+
+/* -------------------------------------------------------------------------- */
+static int arena_class(size_t stack_size)
+{
+    int c;
+    for (c = 0; c != ARENA_CLASS_COUNT; ++c)
+        if (stack_size <= ARENA_MIN_STACK_SIZE << c)
+            return c;
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+static int arena_grow(int c)
+{
+    size_t              stack_size = ARENA_MIN_STACK_SIZE << c;
+    size_t              slot = stack_size + HEADER_SIZE;
+    uint8_t*            mem;
+    uint8_t*            end;
+    struct arena_chunk* chunk;
+
+    if ((mem = casync_stack_arena_map(ARENA_CHUNK_SIZE, arena.flags)) == NULL)
+        return -1;
+    chunk = (struct arena_chunk*)mem;
+    chunk->next = arena.chunks;
+    arena.chunks = chunk;
+
+    /* Carve it up backwards, so the free list hands out ascending addresses */
+    end = mem + ARENA_CHUNK_SIZE;
+    for (mem += HEADER_SIZE; mem + slot <= end; end -= slot)
+    {
+        struct casync_task* t = (struct casync_task*)(end - HEADER_SIZE);
+        t->stack_base = end - slot;
+        t->stack_size = stack_size;
+        t->shared = 0;
+        t->arena = 1;
+        t->pooled = 0;
+        t->next = arena.free[c];
+        arena.free[c] = t;
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_arena(int flags)
+{
+    arena.flags = flags;
+}
+
+/* -------------------------------------------------------------------------- */
+struct casync_task* casync_arena_alloc(size_t stack_size)
+{
+    struct casync_task* t;
+    int                 c = arena_class(stack_size);
+
+    if (!arena.flags || c < 0)
+        return NULL;
+    if (arena.free[c] == NULL && arena_grow(c) != 0)
+        return NULL;
+
+    t = arena.free[c];
+    arena.free[c] = t->next;
+    arena.used++;
+    return t;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_arena_free(struct casync_task* task)
+{
+    int c = arena_class(task->stack_size);
+    task->next = arena.free[c];
+    arena.free[c] = task;
+    arena.used--;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_arena_release(void)
+{
+    struct arena_chunk* next;
+    int                 c;
+
+    /* Slots of one chunk are spread over the free lists, so chunks can only
+     * go all at once */
+    if (arena.used != 0)
+        return;
+    for (; arena.chunks != NULL; arena.chunks = next)
+    {
+        next = arena.chunks->next;
+        casync_stack_arena_unmap(arena.chunks, ARENA_CHUNK_SIZE);
+    }
+    for (c = 0; c != ARENA_CLASS_COUNT; ++c)
+        arena.free[c] = NULL;
+}
@@ -0,0 +1,286 @@
+#include "casync_internal.h"
+
+#include <assert.h>
+
+/*
+ * Stacks of the dynamic API are recycled through a per-thread cache instead of
+ * being mapped and unmapped for every casync_gather(). Stacks are binned into
+ * power-of-two size classes. Each class keeps recently freed stacks "dirty"
+ * (still backed by memory) up to max_dirty, and trims older ones so that they
+ * only cost a mapping. At most max_cached stacks are kept per class.
+ */
+
+#define CLASS_COUNT        10
+#define MIN_CLASS_SIZE     ((size_t)16 * 1024)
+#define DEFAULT_MAX_CACHED 256
+#define DEFAULT_MAX_DIRTY  16
+
+struct size_class
+{
+    struct casync_task* dirty_head; /* Most recently freed */
+    struct casync_task* dirty_tail; /* Next to be trimmed */
+    struct casync_task* clean;
+    size_t              dirty_count;
+    size_t              clean_count;
+};
+
+struct stack_cache
+{
+    struct size_class classes[CLASS_COUNT];
+    size_t            max_cached;
+    size_t            max_dirty;
+    int               configured;
+};
+
+static THREADLOCAL struct stack_cache cache;
+
+/* -------------------------------------------------------------------------- */
+static void cache_init(void)
+{
+    if (cache.configured)
+        return;
+    cache.max_cached = DEFAULT_MAX_CACHED;
+    cache.max_dirty = DEFAULT_MAX_DIRTY;
+    cache.configured = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+static int class_for_alloc(size_t stack_size)
+{
+    int c;
+    for (c = 0; c != CLASS_COUNT; ++c)
+        if (stack_size <= MIN_CLASS_SIZE << c)
+            return c;
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+static int class_for_free(size_t stack_size)
+{
+    /* Mapped stacks are a bit larger than their class, never smaller */
+    int c;
+    if (stack_size >= MIN_CLASS_SIZE << CLASS_COUNT)
+        return -1;
+    for (c = CLASS_COUNT - 1; c != 0; --c)
+        if (stack_size >= MIN_CLASS_SIZE << c)
+            return c;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static struct casync_task* dirty_pop_tail(struct size_class* sc)
+{
+    struct casync_task* t = sc->dirty_tail;
+    sc->dirty_tail = t->prev;
+    if (sc->dirty_tail)
+        sc->dirty_tail->next = NULL;
+    else
+        sc->dirty_head = NULL;
+    sc->dirty_count--;
+    return t;
+}
+
+/* -------------------------------------------------------------------------- */
+static void class_enforce_limits(struct size_class* sc)
+{
+    while (sc->dirty_count > cache.max_dirty)
+    {
+        struct casync_task* t = dirty_pop_tail(sc);
+        casync_stack_trim(t);
+        t->next = sc->clean;
+        sc->clean = t;
+        sc->clean_count++;
+    }
+
+    while (sc->dirty_count + sc->clean_count > cache.max_cached)
+    {
+        struct casync_task* t;
+        if (sc->clean)
+        {
+            t = sc->clean;
+            sc->clean = t->next;
+            sc->clean_count--;
+        }
+        else
+            t = dirty_pop_tail(sc);
+        casync_stack_unmap(t);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+static struct casync_task* class_pop(struct size_class* sc)
+{
+    struct casync_task* t;
+
+    /* Dirty stacks first, their memory is already there */
+    if ((t = sc->dirty_head) != NULL)
+    {
+        sc->dirty_head = t->next;
+        if (sc->dirty_head)
+            sc->dirty_head->prev = NULL;
+        else
+            sc->dirty_tail = NULL;
+        sc->dirty_count--;
+        return t;
+    }
+    if ((t = sc->clean) != NULL)
+    {
+        sc->clean = t->next;
+        sc->clean_count--;
+        return t;
+    }
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+struct casync_task* casync_task_alloc(size_t stack_size)
+{
+    struct casync_task* t;
+    int                 c = class_for_alloc(stack_size);
+
+    if ((t = casync_arena_alloc(stack_size)) != NULL)
+        return t;
+    if (c < 0)
+        return casync_stack_map(stack_size);
+    if ((t = class_pop(&cache.classes[c])) != NULL)
+        return t;
+    return casync_stack_map(MIN_CLASS_SIZE << c);
+}
+
+/* -------------------------------------------------------------------------- */
+struct casync_task* casync_task_alloc_many(size_t stack_size, size_t n)
+{
+    struct casync_task*  list = NULL;
+    struct casync_task** tail = &list;
+    struct casync_task*  t;
+    int                  c = class_for_alloc(stack_size);
+
+    /* The arena, if it is on, packs them into chunks of its own */
+    for (; n != 0 && (t = casync_arena_alloc(stack_size)) != NULL; --n)
+    {
+        *tail = t;
+        tail = &t->next;
+    }
+
+    /* Then cached stacks, they are the ones that are already backed */
+    if (n != 0 && c >= 0)
+    {
+        stack_size = MIN_CLASS_SIZE << c;
+        for (; n != 0 && (t = class_pop(&cache.classes[c])) != NULL; --n)
+        {
+            *tail = t;
+            tail = &t->next;
+        }
+    }
+    *tail = NULL;
+    if (n == 0)
+        return list;
+
+    if ((*tail = casync_stack_map_many(stack_size, n)) == NULL)
+    {
+        /* Back into the cache, for whoever needs them next */
+        for (; list != NULL; list = t)
+        {
+            t = list->next;
+            casync_task_free(list);
+        }
+        return NULL;
+    }
+    return list;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_task_free(struct casync_task* task)
+{
+    struct size_class* sc;
+    int                c = class_for_free(task->stack_size);
+
+    /* The caller of casync_gather_static() owns those */
+    assert(!task->pooled);
+
+    /* Those have no stack of their own, see src/shared_stack.c */
+    if (task->shared)
+    {
+        casync_shared_task_free(task);
+        return;
+    }
+    if (task->arena)
+    {
+        casync_arena_free(task);
+        return;
+    }
+
+    cache_init();
+    if (c < 0 || cache.max_cached == 0)
+    {
+        casync_stack_unmap(task);
+        return;
+    }
+
+    sc = &cache.classes[c];
+    task->prev = NULL;
+    task->next = sc->dirty_head;
+    if (sc->dirty_head)
+        sc->dirty_head->prev = task;
+    else
+        sc->dirty_tail = task;
+    sc->dirty_head = task;
+    sc->dirty_count++;
+
+    class_enforce_limits(sc);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_task_free_many(struct casync_task* list)
+{
+    struct casync_task*  unmap = NULL;
+    struct casync_task** tail = &unmap;
+    struct casync_task*  next;
+    struct size_class*   sc;
+    int                  c;
+
+    cache_init();
+    for (; list != NULL; list = next)
+    {
+        next = list->next;
+        c = class_for_free(list->stack_size);
+        sc = c >= 0 ? &cache.classes[c] : NULL;
+
+        /* What casync_task_free() would unmap right away. Keep the list's
+         * order, so neighbours stay next to each other */
+        if (!list->shared && !list->arena &&
+            (sc == NULL ||
+             sc->dirty_count + sc->clean_count >= cache.max_cached))
+        {
+            *tail = list;
+            tail = &list->next;
+        }
+        else
+            casync_task_free(list);
+    }
+    *tail = NULL;
+    casync_stack_unmap_many(unmap);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_cache_limits(size_t max_cached, size_t max_dirty)
+{
+    int c;
+    cache.max_cached = max_cached;
+    cache.max_dirty = max_dirty;
+    cache.configured = 1;
+    for (c = 0; c != CLASS_COUNT; ++c)
+        class_enforce_limits(&cache.classes[c]);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stack_cache_flush(void)
+{
+    size_t max_cached, max_dirty;
+    cache_init();
+    max_cached = cache.max_cached;
+    max_dirty = cache.max_dirty;
+    casync_stack_cache_limits(0, 0);
+    casync_stack_cache_limits(max_cached, max_dirty);
+    casync_arena_release();
+}
@@ -0,0 +1,349 @@
+#include "casync/stats.h"
+#include "casync_internal.h"
+
+#include <string.h>
+
+#if defined(CASYNC_STATS)
+
+#    include <signal.h>
+
+#    if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#        include <intrin.h>
+#        define HAVE_TSC
+#    elif defined(__x86_64__) || defined(__i386__)
+#        include <x86intrin.h>
+#        define HAVE_TSC
+#    endif
+
+#    define PAINT 0xCA
+
+static volatile sig_atomic_t dump_requests;
+
+/* Time stamp counter and clock when the thread's first loop started, to
+ * convert ticks to nanoseconds */
+static THREADLOCAL uint64_t calibration_ticks;
+static THREADLOCAL uint64_t calibration_ns;
+
+/* -------------------------------------------------------------------------- */
+static uint64_t ticks(void)
+{
+#    if defined(HAVE_TSC)
+    return __rdtsc();
+#    elif defined(__aarch64__)
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#    else
+    return casync_clock_ns();
+#    endif
+}
+
+/* -------------------------------------------------------------------------- */
+static double ticks_per_ns(void)
+{
+    uint64_t ns = casync_clock_ns() - calibration_ns;
+    if (ns == 0)
+        return 1.0;
+    return (double)(ticks() - calibration_ticks) / (double)ns;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stats_switch(struct casync_loop* loop, struct casync_task* task)
+{
+    uint64_t now = ticks();
+    uint64_t slice = now - loop->stats.last_switch;
+
+    task->stats.switches++;
+    task->stats.ticks += slice;
+    if (task->stats.max_slice < slice)
+        task->stats.max_slice = slice;
+    loop->stats.switches++;
+    loop->stats.last_switch = now;
+}
+
+/* -------------------------------------------------------------------------- */
+static size_t stack_used(const struct casync_task* task)
+{
+    const uintptr_t pattern = (uintptr_t)-1 / 0xFF * PAINT;
+    const char*     p = task->stats.paint;
+    const char*     top = task->stats.top;
+
+    if (task->shared)
+        return task->stats.saved;
+
+    /* Skip whole words first. The paint is where the stack is usually
+     * untouched, so this is where the time goes */
+    while (((uintptr_t)p & (sizeof pattern - 1)) && p != top &&
+           *(const unsigned char*)p == PAINT)
+        ++p;
+    if (((uintptr_t)p & (sizeof pattern - 1)) == 0)
+        while ((size_t)(top - p) >= sizeof pattern &&
+               *(const uintptr_t*)p == pattern)
+            p += sizeof pattern;
+    while (p != top && *(const unsigned char*)p == PAINT)
+        ++p;
+
+    return (size_t)(top - p);
+}
+
+/* -------------------------------------------------------------------------- */
+static int bucket(size_t n)
+{
+    int b = 0;
+    while (n != 0 && b != CASYNC_STATS_BUCKETS - 1)
+    {
+        n >>= 1;
+        ++b;
+    }
+    return b;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stats_loop_init(struct casync_loop* loop)
+{
+    if (calibration_ns == 0)
+    {
+        calibration_ticks = ticks();
+        calibration_ns = casync_clock_ns();
+    }
+
+    memset(&loop->stats, 0, sizeof loop->stats);
+    memset(&loop->control_task.stats, 0, sizeof loop->control_task.stats);
+    loop->stats.last_switch = ticks();
+    loop->stats.dumps = dump_requests;
+}
+
+/* -------------------------------------------------------------------------- */
+static void dump_loop(FILE* fp, struct casync_loop* loop, int depth);
+
+/* -------------------------------------------------------------------------- */
+void casync_stats_round(struct casync_loop* loop)
+{
+    struct casync_task* control = &loop->control_task;
+    struct casync_task* t;
+    size_t              n = 0;
+
+    for (t = control->next; t != control; t = t->next)
+        ++n;
+    loop->stats.queue_histogram[bucket(n)]++;
+    loop->stats.rounds++;
+
+    /* Only the outermost gather dumps, nested ones are part of its dump */
+    if (loop->parent == NULL && loop->stats.dumps != dump_requests)
+    {
+        loop->stats.dumps = dump_requests;
+        dump_loop(stderr, loop, 0);
+    }
+
+    /* The time in between was spent polling or in the parent gather */
+    loop->stats.last_switch = ticks();
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stats_task_start(
+    struct casync_loop* loop, struct casync_task* task, size_t stack_size)
+{
+    char* top = (char*)task->stack_base + stack_size;
+    char* paint = (char*)task->stack_base;
+
+    memset(&task->stats, 0, sizeof task->stats);
+    loop->stats.started++;
+
+    /* A shared stack belongs to whoever runs on it */
+    if (task->shared)
+        return;
+
+    if (stack_size > CASYNC_STATS_PAINT_SIZE)
+        paint = top - CASYNC_STATS_PAINT_SIZE;
+    memset(paint, PAINT, (size_t)(top - paint));
+    task->stats.paint = paint;
+    task->stats.top = top;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stats_task_end(struct casync_task* task)
+{
+    struct casync_loop* loop = task->loop;
+    size_t              used = stack_used(task);
+
+    casync_stats_switch(loop, task);
+    loop->stats.finished++;
+    loop->stats.ticks += task->stats.ticks;
+    if (loop->stats.max_slice < task->stats.max_slice)
+        loop->stats.max_slice = task->stats.max_slice;
+    if (loop->stats.stack_used < used)
+        loop->stats.stack_used = used;
+}
+
+/* -------------------------------------------------------------------------- */
+static void
+loop_snapshot(struct casync_loop* loop, struct casync_loop_stats* stats)
+{
+    struct casync_task* t;
+
+    memset(stats, 0, sizeof *stats);
+    stats->rounds = loop->stats.rounds;
+    stats->switches = loop->stats.switches;
+    stats->started = loop->stats.started;
+    stats->finished = loop->stats.finished;
+    stats->ticks = loop->stats.ticks;
+    stats->max_slice = loop->stats.max_slice;
+    stats->stack_used = loop->stats.stack_used;
+    stats->stack_copies = loop->stats.stack_copies;
+    stats->stack_copied = loop->stats.stack_copied;
+    stats->parked = (size_t)loop->parked;
+    stats->ticks_per_ns = ticks_per_ns();
+    memcpy(
+        stats->queue_histogram,
+        loop->stats.queue_histogram,
+        sizeof stats->queue_histogram);
+    for (t = loop->live; t; t = t->live_next)
+        stats->live++;
+}
+
+/* -------------------------------------------------------------------------- */
+static void
+task_snapshot(struct casync_task* task, struct casync_task_stats* stats)
+{
+    stats->name = task->name;
+    stats->priority = task->priority;
+    stats->switches = task->stats.switches;
+    stats->ticks = task->stats.ticks;
+    stats->max_slice = task->stats.max_slice;
+    stats->stack_size = task->stack_size;
+    stats->stack_used = stack_used(task);
+}
+
+/* -------------------------------------------------------------------------- */
+static void dump_loop(FILE* fp, struct casync_loop* loop, int depth)
+{
+    struct casync_loop_stats ls;
+    struct casync_task_stats ts;
+    struct casync_task*      t;
+    double                   us;
+    int                      i;
+
+    loop_snapshot(loop, &ls);
+    us = ls.ticks_per_ns * 1000.0;
+    fprintf(
+        fp,
+        "%*scasync: gather %p: %llu rounds, %llu switches, %llu started, "
+        "%zu live, %zu parked, %llu finished (max slice %.1f us, "
+        "stack %zu)\n",
+        depth * 2,
+        "",
+        (void*)loop,
+        (unsigned long long)ls.rounds,
+        (unsigned long long)ls.switches,
+        (unsigned long long)ls.started,
+        ls.live,
+        ls.parked,
+        (unsigned long long)ls.finished,
+        (double)ls.max_slice / us,
+        ls.stack_used);
+
+    fprintf(fp, "%*s  queue:", depth * 2, "");
+    for (i = 0; i != CASYNC_STATS_BUCKETS; ++i)
+        if (ls.queue_histogram[i] != 0)
+            fprintf(
+                fp,
+                " %lu:%llu",
+                i ? 1ul << (i - 1) : 0ul,
+                (unsigned long long)ls.queue_histogram[i]);
+    fprintf(fp, "\n");
+    if (ls.stack_copies != 0)
+        fprintf(
+            fp,
+            "%*s  shared stack: %llu copies, %.0f bytes each\n",
+            depth * 2,
+            "",
+            (unsigned long long)ls.stack_copies,
+            (double)ls.stack_copied / (double)ls.stack_copies);
+
+    for (t = loop->live; t; t = t->live_next)
+    {
+        task_snapshot(t, &ts);
+        fprintf(
+            fp,
+            "%*s  %s: priority %d, %llu switches, %.3f ms running, "
+            "max slice %.1f us, stack %zu/%zu\n",
+            depth * 2,
+            "",
+            ts.name ? ts.name : "(unnamed)",
+            ts.priority,
+            (unsigned long long)ts.switches,
+            (double)ts.ticks / us / 1000.0,
+            (double)ts.max_slice / us,
+            ts.stack_used,
+            ts.stack_size);
+        if (t->inner)
+            dump_loop(fp, t->inner, depth + 2);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_stats_loop(struct casync_loop_stats* stats)
+{
+    if (casync_current_loop == NULL)
+        return -1;
+    loop_snapshot(casync_current_loop, stats);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+size_t casync_stats_tasks(struct casync_task_stats* tasks, size_t max)
+{
+    struct casync_task* t;
+    size_t              n = 0;
+
+    if (casync_current_loop == NULL)
+        return 0;
+    for (t = casync_current_loop->live; t; t = t->live_next, ++n)
+        if (n < max)
+            task_snapshot(t, &tasks[n]);
+    return n;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stats_dump(FILE* fp)
+{
+    if (casync_current_loop != NULL)
+        dump_loop(fp, casync_current_loop->root, 0);
+    fflush(fp);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stats_request_dump(void)
+{
+    dump_requests++;
+}
+
+#else
+
+/* -------------------------------------------------------------------------- */
+int casync_stats_loop(struct casync_loop_stats* stats)
+{
+    memset(stats, 0, sizeof *stats);
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+size_t casync_stats_tasks(struct casync_task_stats* tasks, size_t max)
+{
+    (void)tasks;
+    (void)max;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stats_dump(FILE* fp)
+{
+    fprintf(fp, "casync: statistics are disabled, build with CASYNC_STATS\n");
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_stats_request_dump(void)
+{
+}
+
+#endif
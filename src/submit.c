@@ -0,0 +1,172 @@
+#include "casync_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+/*
+ * Lets other threads start co-routines in a running loop. Submissions are
+ * pushed onto a lock-free stack in the root loop. At the start of each round,
+ * see casync_run_loop(), the loop takes the whole stack at once and starts a
+ * batch of them.
+ *
+ * Only a loop that is about to sleep in the reactor has to be woken. It says
+ * so in "sleeping", and the first submitter to clear the flag signals the
+ * notifier casync_loop_serve() waits on. A busy loop costs submitters no
+ * system call.
+ *
+ * All shared fields are written with exchanges and read with sequentially
+ * consistent loads, because each side stores one variable and then loads the
+ * other: the submitter pushes and then checks "sleeping", the loop sets
+ * "sleeping" and then checks for submissions. Either the loop sees the
+ * submission, or the submitter sees that the loop is asleep.
+ */
+
+#define DRAIN_BATCH 256
+
+struct casync_submission
+{
+    int (*function)(void*);
+    void*                     arg;
+    struct casync_submission* next;
+};
+
+/* -------------------------------------------------------------------------- */
+struct casync_loop* casync_loop_current(void)
+{
+    return casync_current_loop ? casync_current_loop->root : NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_loop_submit(
+    struct casync_loop* loop, int (*function)(void*), void* arg)
+{
+    struct casync_submission* s = malloc(sizeof *s);
+    if (s == NULL)
+        return -1;
+
+    s->function = function;
+    s->arg = arg;
+    do
+        s->next = casync_atomic_load_ptr(&loop->submitted);
+    while (!casync_atomic_cas_ptr(&loop->submitted, s->next, s));
+
+    if (casync_atomic_exchange(&loop->sleeping, 0))
+        casync_thread_notifier_signal(loop->notifier);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_submit_drain(struct casync_loop* root)
+{
+    struct casync_submission* s;
+    struct casync_submission* next;
+    int                       n;
+
+    /* The stack has the newest submission on top. Reverse it, so
+     * co-routines start in the order they were submitted. Only take it once
+     * the older ones all started */
+    if (root->pending == NULL)
+    {
+        s = casync_atomic_exchange_ptr(&root->submitted, NULL);
+        for (; s != NULL; s = next)
+        {
+            next = s->next;
+            s->next = root->pending;
+            root->pending = s;
+        }
+    }
+
+    /* Every co-routine needs a stack, so a flood of submissions must not
+     * start all at once. The rest waits for the next round, by which time
+     * most of these may have finished and returned their stacks. The
+     * submitter was told the co-routine would run, so one that didn't get a
+     * stack stays in front and is retried then as well */
+    for (n = 0; n < DRAIN_BATCH && (s = root->pending) != NULL; ++n)
+    {
+        if (casync_loop_start(root, NULL, s->function, s->arg) != 0)
+            break;
+        root->pending = s->next;
+        free(s);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_submit_sleep(struct casync_loop* root)
+{
+    if (root->pending != NULL)
+        return 0;
+
+    /* Nobody could wake us. Submissions wait until the reactor wakes up for
+     * something else */
+    if (root->notifier == NULL)
+        return 1;
+
+    casync_atomic_exchange(&root->sleeping, 1);
+    if (casync_atomic_load_ptr(&root->submitted) == NULL)
+        return 1;
+    casync_atomic_exchange(&root->sleeping, 0);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_submit_awake(struct casync_loop* root)
+{
+    casync_atomic_exchange(&root->sleeping, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_loop_serve(void)
+{
+    struct casync_loop* loop = casync_current_loop;
+    void*               notifier;
+    int                 fd;
+    int                 rc = 0;
+
+    if (loop == NULL)
+        return -1;
+    loop = loop->root;
+    if (loop->notifier != NULL)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    if ((notifier = casync_thread_notifier_create()) == NULL)
+        return -1;
+    fd = casync_thread_notifier_fd(notifier);
+    casync_atomic_exchange_ptr(&loop->notifier, notifier);
+
+    /* casync_loop_close() sets "closing", signals, and then sets "closed" as
+     * the last thing it does with the loop. We may only return after that,
+     * and once everything submitted before was started */
+    while (1)
+    {
+        if (casync_atomic_load(&loop->closing))
+        {
+            if (casync_atomic_load(&loop->closed) && loop->pending == NULL &&
+                casync_atomic_load_ptr(&loop->submitted) == NULL)
+                break;
+            casync_yield();
+            continue;
+        }
+        if ((rc = casync_wait_fd(fd, CASYNC_READ)) < 0)
+            break;
+        casync_thread_notifier_drain(notifier);
+    }
+
+    /* Once the notifier is gone, the loop can no longer sleep with
+     * "sleeping" set */
+    casync_atomic_exchange_ptr(&loop->notifier, NULL);
+    casync_thread_notifier_destroy(notifier);
+    return rc < 0 ? rc : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_loop_close(struct casync_loop* loop)
+{
+    void* notifier;
+
+    casync_atomic_exchange(&loop->closing, 1);
+    if ((notifier = casync_atomic_load_ptr(&loop->notifier)) != NULL)
+        casync_thread_notifier_signal(notifier);
+    casync_atomic_exchange(&loop->closed, 1);
+}
@@ -0,0 +1,150 @@
+#include "casync/sync.h"
+#include "casync_internal.h"
+
+/* -------------------------------------------------------------------------- */
+void casync_mutex_init(struct casync_mutex* mutex)
+{
+    mutex->locked = 0;
+    mutex->waiters.head = NULL;
+    mutex->waiters.tail = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_mutex_trylock(struct casync_mutex* mutex)
+{
+    if (mutex->locked)
+        return -1;
+    mutex->locked = 1;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_mutex_lock(struct casync_mutex* mutex)
+{
+    if (!mutex->locked)
+    {
+        mutex->locked = 1;
+        return 0;
+    }
+    if (casync_current_loop == NULL)
+        return -1;
+
+    /* casync_mutex_unlock() hands the mutex over without unlocking it, so we
+     * own it once we are woken */
+    return casync_wait_queue_park(&mutex->waiters);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_mutex_unlock(struct casync_mutex* mutex)
+{
+    if (!casync_wait_queue_wake(&mutex->waiters))
+        mutex->locked = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_cond_init(struct casync_cond* cond)
+{
+    cond->waiters.head = NULL;
+    cond->waiters.tail = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_cond_wait(struct casync_cond* cond, struct casync_mutex* mutex)
+{
+    int rc;
+    if (casync_current_loop == NULL)
+        return -1;
+
+    casync_mutex_unlock(mutex);
+    if ((rc = casync_wait_queue_park(&cond->waiters)) != 0)
+        return rc;
+    return casync_mutex_lock(mutex);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_cond_signal(struct casync_cond* cond)
+{
+    casync_wait_queue_wake(&cond->waiters);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_cond_broadcast(struct casync_cond* cond)
+{
+    while (casync_wait_queue_wake(&cond->waiters))
+    {
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_sem_init(struct casync_sem* sem, size_t count)
+{
+    sem->count = count;
+    sem->waiters.head = NULL;
+    sem->waiters.tail = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_sem_tryacquire(struct casync_sem* sem)
+{
+    if (sem->count == 0)
+        return -1;
+    sem->count--;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_sem_acquire(struct casync_sem* sem)
+{
+    if (sem->count > 0)
+    {
+        sem->count--;
+        return 0;
+    }
+    if (casync_current_loop == NULL)
+        return -1;
+
+    /* casync_sem_release() hands its unit directly to us */
+    return casync_wait_queue_park(&sem->waiters);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_sem_release(struct casync_sem* sem)
+{
+    if (!casync_wait_queue_wake(&sem->waiters))
+        sem->count++;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_wait_group_init(struct casync_wait_group* wg)
+{
+    wg->count = 0;
+    wg->waiters.head = NULL;
+    wg->waiters.tail = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_wait_group_add(struct casync_wait_group* wg, size_t n)
+{
+    wg->count += n;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_wait_group_done(struct casync_wait_group* wg)
+{
+    if (--wg->count != 0)
+        return;
+    while (casync_wait_queue_wake(&wg->waiters))
+    {
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_wait_group_wait(struct casync_wait_group* wg)
+{
+    if (wg->count == 0)
+        return 0;
+    if (casync_current_loop == NULL)
+        return -1;
+
+    return casync_wait_queue_park(&wg->waiters);
+}
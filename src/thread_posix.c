@@ -0,0 +1,255 @@
+#include "casync_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#if defined(__linux__)
+#    include <sys/eventfd.h>
+#endif
+
+struct thread
+{
+    pthread_t id;
+    void (*function)(void*);
+    void* arg;
+};
+
+static pthread_mutex_t once_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* An eventfd on Linux, where both ends are the same. A pipe elsewhere */
+struct notifier
+{
+    int read_fd;
+    int write_fd;
+};
+
+/* -------------------------------------------------------------------------- */
+static void* thread_entry(void* arg)
+{
+    struct thread* t = arg;
+    t->function(t->arg);
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_thread_start(void (*function)(void*), void* arg)
+{
+    struct thread* t = malloc(sizeof *t);
+    if (t == NULL)
+        return NULL;
+
+    t->function = function;
+    t->arg = arg;
+    if (pthread_create(&t->id, NULL, thread_entry, t) != 0)
+    {
+        free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_join(void* thread)
+{
+    struct thread* t = thread;
+    pthread_join(t->id, NULL);
+    free(t);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_thread_mutex_create(void)
+{
+    pthread_mutex_t* m = malloc(sizeof *m);
+    if (m == NULL)
+        return NULL;
+    if (pthread_mutex_init(m, NULL) != 0)
+    {
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_mutex_destroy(void* mutex)
+{
+    pthread_mutex_destroy(mutex);
+    free(mutex);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_mutex_lock(void* mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_mutex_unlock(void* mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_thread_cond_create(void)
+{
+    pthread_cond_t* c = malloc(sizeof *c);
+    if (c == NULL)
+        return NULL;
+    if (pthread_cond_init(c, NULL) != 0)
+    {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_cond_destroy(void* cond)
+{
+    pthread_cond_destroy(cond);
+    free(cond);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_cond_wait(void* cond, void* mutex)
+{
+    pthread_cond_wait(cond, mutex);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_cond_signal(void* cond)
+{
+    pthread_cond_signal(cond);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_once(volatile long* done, void (*function)(void))
+{
+    if (casync_atomic_load(done))
+        return;
+    pthread_mutex_lock(&once_lock);
+    if (!casync_atomic_load(done))
+    {
+        function();
+        casync_atomic_exchange(done, 1);
+    }
+    pthread_mutex_unlock(&once_lock);
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_thread_notifier_create(void)
+{
+    struct notifier* n = malloc(sizeof *n);
+    if (n == NULL)
+        return NULL;
+
+#if defined(__linux__)
+    n->read_fd = n->write_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (n->read_fd != -1)
+        return n;
+#else
+    int fds[2];
+    if (pipe(fds) == 0)
+    {
+        int i;
+        for (i = 0; i != 2; ++i)
+        {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        n->read_fd = fds[0];
+        n->write_fd = fds[1];
+        return n;
+    }
+#endif
+
+    free(n);
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_notifier_destroy(void* notifier)
+{
+    struct notifier* n = notifier;
+    if (n->write_fd != n->read_fd)
+        close(n->write_fd);
+    close(n->read_fd);
+    free(n);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_thread_notifier_fd(void* notifier)
+{
+    return ((struct notifier*)notifier)->read_fd;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_notifier_signal(void* notifier)
+{
+    struct notifier* n = notifier;
+    uint64_t         one = 1;
+
+    /* Fails with EAGAIN if it is already readable, which is just as good. A
+     * pipe only needs one byte, an eventfd needs all eight */
+    while (write(n->write_fd, &one, sizeof one) == -1 && errno == EINTR)
+    {
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_notifier_drain(void* notifier)
+{
+    struct notifier* n = notifier;
+    uint64_t         buf[8];
+
+    while (read(n->read_fd, buf, sizeof buf) > 0)
+    {
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+long casync_atomic_add(volatile long* value, long delta)
+{
+    return __atomic_add_fetch(value, delta, __ATOMIC_SEQ_CST);
+}
+
+/* -------------------------------------------------------------------------- */
+long casync_atomic_load(volatile long* value)
+{
+    return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+}
+
+/* -------------------------------------------------------------------------- */
+long casync_atomic_exchange(volatile long* value, long new_value)
+{
+    return __atomic_exchange_n(value, new_value, __ATOMIC_SEQ_CST);
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_atomic_load_ptr(void* volatile* ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_atomic_exchange_ptr(void* volatile* ptr, void* value)
+{
+    return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_atomic_cas_ptr(void* volatile* ptr, void* expected, void* desired)
+{
+    return __atomic_compare_exchange_n(
+        ptr, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,200 @@
+#include "casync_internal.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <process.h>
+#include <stdlib.h>
+
+static SRWLOCK once_lock = SRWLOCK_INIT;
+
+struct thread
+{
+    HANDLE handle;
+    void (*function)(void*);
+    void* arg;
+};
+
+/* -------------------------------------------------------------------------- */
+static unsigned __stdcall thread_entry(void* arg)
+{
+    struct thread* t = arg;
+    t->function(t->arg);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_thread_start(void (*function)(void*), void* arg)
+{
+    struct thread* t = malloc(sizeof *t);
+    if (t == NULL)
+        return NULL;
+
+    t->function = function;
+    t->arg = arg;
+    t->handle = (HANDLE)_beginthreadex(NULL, 0, thread_entry, t, 0, NULL);
+    if (t->handle == 0)
+    {
+        free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_join(void* thread)
+{
+    struct thread* t = thread;
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+    free(t);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_thread_mutex_create(void)
+{
+    CRITICAL_SECTION* cs = malloc(sizeof *cs);
+    if (cs == NULL)
+        return NULL;
+    InitializeCriticalSection(cs);
+    return cs;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_mutex_destroy(void* mutex)
+{
+    DeleteCriticalSection(mutex);
+    free(mutex);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_mutex_lock(void* mutex)
+{
+    EnterCriticalSection(mutex);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_mutex_unlock(void* mutex)
+{
+    LeaveCriticalSection(mutex);
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_thread_cond_create(void)
+{
+    CONDITION_VARIABLE* c = malloc(sizeof *c);
+    if (c == NULL)
+        return NULL;
+    InitializeConditionVariable(c);
+    return c;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_cond_destroy(void* cond)
+{
+    free(cond);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_cond_wait(void* cond, void* mutex)
+{
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_cond_signal(void* cond)
+{
+    WakeConditionVariable(cond);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_once(volatile long* done, void (*function)(void))
+{
+    if (casync_atomic_load(done))
+        return;
+    AcquireSRWLockExclusive(&once_lock);
+    if (!casync_atomic_load(done))
+    {
+        function();
+        casync_atomic_exchange(done, 1);
+    }
+    ReleaseSRWLockExclusive(&once_lock);
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_thread_notifier_create(void)
+{
+    /* Not implemented yet. casync_run_blocking() then runs the function on
+     * the calling thread */
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_notifier_destroy(void* notifier)
+{
+    (void)notifier;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_thread_notifier_fd(void* notifier)
+{
+    (void)notifier;
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_notifier_signal(void* notifier)
+{
+    (void)notifier;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_thread_notifier_drain(void* notifier)
+{
+    (void)notifier;
+}
+
+/* -------------------------------------------------------------------------- */
+long casync_atomic_add(volatile long* value, long delta)
+{
+    return InterlockedExchangeAdd(value, delta) + delta;
+}
+
+/* -------------------------------------------------------------------------- */
+long casync_atomic_load(volatile long* value)
+{
+    return InterlockedCompareExchange(value, 0, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+long casync_atomic_exchange(volatile long* value, long new_value)
+{
+    return InterlockedExchange(value, new_value);
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_atomic_load_ptr(void* volatile* ptr)
+{
+    return InterlockedCompareExchangePointer(ptr, NULL, NULL);
+}
+
+/* -------------------------------------------------------------------------- */
+void* casync_atomic_exchange_ptr(void* volatile* ptr, void* value)
+{
+    return InterlockedExchangePointer(ptr, value);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_atomic_cas_ptr(void* volatile* ptr, void* expected, void* desired)
+{
+    return InterlockedCompareExchangePointer(ptr, desired, expected) ==
+           expected;
+}
@@ -0,0 +1,155 @@
+#include "casync_internal.h"
+
+#include <stdlib.h>
+
+/*
+ * Timers are kept in a 4-ary min-heap ordered by deadline, owned by the
+ * outermost casync_gather(). Besides sleeping tasks, they implement task
+ * deadlines and gather timeouts. A 4-ary heap is shallower than a binary heap
+ * and the four children of a node share a cache line.
+ */
+
+#define HEAP_ARITY 4
+
+/* -------------------------------------------------------------------------- */
+static void
+heap_place(struct casync_timer** heap, int index, struct casync_timer* timer)
+{
+    heap[index] = timer;
+    timer->index = index;
+}
+
+/* -------------------------------------------------------------------------- */
+static void heap_sift_up(struct casync_timer** heap, int index)
+{
+    struct casync_timer* timer = heap[index];
+    while (index > 0)
+    {
+        int parent = (index - 1) / HEAP_ARITY;
+        if (heap[parent]->deadline <= timer->deadline)
+            break;
+        heap_place(heap, index, heap[parent]);
+        index = parent;
+    }
+    heap_place(heap, index, timer);
+}
+
+/* -------------------------------------------------------------------------- */
+static void heap_sift_down(struct casync_timer** heap, int count, int index)
+{
+    struct casync_timer* timer = heap[index];
+    while (1)
+    {
+        int child = index * HEAP_ARITY + 1;
+        int last = child + HEAP_ARITY;
+        int best = child;
+        if (child >= count)
+            break;
+        if (last > count)
+            last = count;
+        for (++child; child < last; ++child)
+            if (heap[child]->deadline < heap[best]->deadline)
+                best = child;
+
+        if (heap[best]->deadline >= timer->deadline)
+            break;
+        heap_place(heap, index, heap[best]);
+        index = best;
+    }
+    heap_place(heap, index, timer);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_timer_add(struct casync_loop* root, struct casync_timer* timer)
+{
+    if (root->timer_count == root->timer_capacity)
+    {
+        int new_capacity = root->timer_capacity ? root->timer_capacity * 2 : 64;
+        struct casync_timer** new_timers =
+            realloc(root->timers, sizeof(*new_timers) * new_capacity);
+        if (new_timers == NULL)
+            return -1;
+        root->timers = new_timers;
+        root->timer_capacity = new_capacity;
+    }
+
+    root->timers[root->timer_count] = timer;
+    heap_sift_up(root->timers, root->timer_count++);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_timer_remove(struct casync_loop* root, struct casync_timer* timer)
+{
+    struct casync_timer* last = root->timers[--root->timer_count];
+    int                  index = timer->index;
+
+    timer->index = -1;
+    if (last == timer)
+        return;
+
+    heap_place(root->timers, index, last);
+    if (last->deadline < timer->deadline)
+        heap_sift_up(root->timers, last->index);
+    else
+        heap_sift_down(root->timers, root->timer_count, last->index);
+}
+
+/* -------------------------------------------------------------------------- */
+static void timer_wake(struct casync_timer* timer)
+{
+    casync_wake(timer->task);
+}
+
+/* -------------------------------------------------------------------------- */
+static int timer_unpark(void* ctx)
+{
+    struct casync_timer* timer = ctx;
+    casync_timer_remove(timer->task->loop->root, timer);
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_timer_wait(uint64_t deadline_ns)
+{
+    struct casync_loop*  loop = casync_current_loop;
+    struct casync_timer  local;
+    struct casync_timer* timer;
+
+    if (loop == NULL)
+        return -1;
+
+    timer = casync_wait_area(&local, sizeof local);
+    timer->deadline = deadline_ns;
+    timer->expire = timer_wake;
+    timer->task = loop->active;
+    if (casync_timer_add(loop->root, timer) != 0)
+    {
+        /* Out of memory. Fall back to spinning */
+        while (casync_clock_ns() < deadline_ns)
+        {
+            if (loop->active->canceled)
+                return CASYNC_ECANCELED;
+            casync_yield();
+        }
+        return 0;
+    }
+
+    return casync_park(timer_unpark, timer);
+}
+
+/* -------------------------------------------------------------------------- */
+int64_t casync_timer_expire(struct casync_loop* root, uint64_t now_ns)
+{
+    while (root->timer_count > 0)
+    {
+        struct casync_timer* timer = root->timers[0];
+        if (timer->deadline > now_ns)
+            return (int64_t)(timer->deadline - now_ns);
+
+        casync_timer_remove(root, timer);
+        timer->expire(timer);
+    }
+
+    return -1;
+}
@@ -0,0 +1,297 @@
+#include "casync/trace.h"
+#include "casync_internal.h"
+
+#if defined(CASYNC_TRACE)
+
+#    include <stdlib.h>
+#    include <string.h>
+
+/* Slices that can be open at the same time, one per nested gather */
+#    define MAX_OPEN 64
+
+enum event_type
+{
+    EVENT_START,  /* "other" started "task", or 0 */
+    EVENT_SWITCH, /* "task" yielded to "other" */
+    EVENT_PARK,   /* "task" is waiting */
+    EVENT_WAKE,   /* "other" woke "task", or 0 */
+    EVENT_END     /* "task" returned, "other" runs next, or 0 */
+};
+
+struct event
+{
+    uint64_t time_ns;
+    uint32_t task;
+    uint32_t other;
+    int      type;
+    char     name[16]; /* Copied, names may not outlive their task */
+};
+
+struct trace
+{
+    struct event* events;
+    size_t        capacity;
+    size_t        count; /* Total recorded, the ring wraps at capacity */
+    int           recording;
+};
+
+static THREADLOCAL struct trace trace;
+static THREADLOCAL uint32_t     last_id;
+
+/* -------------------------------------------------------------------------- */
+static struct event* record(int type, uint32_t task, uint32_t other)
+{
+    struct event* e;
+    if (!trace.recording)
+        return NULL;
+
+    e = &trace.events[trace.count++ % trace.capacity];
+    e->time_ns = casync_clock_ns();
+    e->task = task;
+    e->other = other;
+    e->type = type;
+    e->name[0] = '\0';
+    return e;
+}
+
+/* -------------------------------------------------------------------------- */
+static void record_start(uint32_t task, uint32_t parent, const char* name)
+{
+    struct event* e = record(EVENT_START, task, parent);
+    if (e != NULL && name != NULL)
+    {
+        strncpy(e->name, name, sizeof e->name - 1);
+        e->name[sizeof e->name - 1] = '\0';
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_loop_init(struct casync_loop* loop)
+{
+    loop->control_task.trace_id = ++last_id;
+    record_start(
+        loop->control_task.trace_id,
+        loop->parent ? loop->parent->active->trace_id : 0,
+        "gather");
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_loop_end(struct casync_loop* loop)
+{
+    record(EVENT_END, loop->control_task.trace_id, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_task_start(
+    struct casync_loop* loop, struct casync_task* task)
+{
+    task->trace_id = ++last_id;
+    record_start(task->trace_id, loop->active->trace_id, task->name);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_task_end(struct casync_task* task, struct casync_task* next)
+{
+    record(EVENT_END, task->trace_id, next->trace_id);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_switch(struct casync_loop* loop)
+{
+    record(EVENT_SWITCH, loop->active->trace_id, loop->active->next->trace_id);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_park(struct casync_task* task)
+{
+    record(EVENT_PARK, task->trace_id, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_wake(struct casync_task* task)
+{
+    struct casync_loop* loop = casync_current_loop;
+    record(EVENT_WAKE, task->trace_id, loop ? loop->active->trace_id : 0);
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_trace_start(size_t capacity)
+{
+    casync_trace_free();
+    if (capacity == 0)
+        return -1;
+    trace.events = malloc(capacity * sizeof *trace.events);
+    if (trace.events == NULL)
+        return -1;
+    trace.capacity = capacity;
+    trace.recording = 1;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_stop(void)
+{
+    trace.recording = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_free(void)
+{
+    free(trace.events);
+    trace.events = NULL;
+    trace.capacity = 0;
+    trace.count = 0;
+    trace.recording = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void write_string(FILE* fp, const char* str)
+{
+    /* Escape what JSON strings can't contain */
+    for (; *str; ++str)
+    {
+        if (*str == '"' || *str == '\\')
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(fp, "\\u%04x", (unsigned)*str);
+        else
+            fputc(*str, fp);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+static void write_event(
+    FILE*               fp,
+    const char**        sep,
+    const char*         name,
+    const char*         phase,
+    uint32_t            task,
+    const struct event* e,
+    uint64_t            t0)
+{
+    uint64_t t = e->time_ns - t0;
+
+    fprintf(
+        fp,
+        "%s\n  {\"name\": \"%s\", \"ph\": \"%s\", \"pid\": 1, \"tid\": %lu, "
+        "\"ts\": %llu.%03u",
+        *sep,
+        name,
+        phase,
+        (unsigned long)task,
+        (unsigned long long)(t / 1000),
+        (unsigned)(t % 1000));
+    if (phase[0] == 'i')
+        fprintf(fp, ", \"s\": \"t\"");
+    if (e->type == EVENT_START || e->type == EVENT_WAKE)
+        fprintf(fp, ", \"args\": {\"by\": %lu}", (unsigned long)e->other);
+    fprintf(fp, "}");
+    *sep = ",";
+}
+
+/* -------------------------------------------------------------------------- */
+static void
+write_thread_name(FILE* fp, const char** sep, const struct event* e)
+{
+    fprintf(
+        fp,
+        "%s\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+        "\"tid\": %lu, \"args\": {\"name\": \"",
+        *sep,
+        (unsigned long)e->task);
+    if (e->name[0])
+        write_string(fp, e->name);
+    else
+        fprintf(fp, "task %lu", (unsigned long)e->task);
+    fprintf(fp, "\"}}");
+    *sep = ",";
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_trace_export(FILE* fp)
+{
+    uint32_t    open[MAX_OPEN];
+    int         open_count = 0;
+    size_t      first, i;
+    uint64_t    t0;
+    const char* sep = "";
+
+    if (trace.count == 0)
+        return -1;
+
+    /* Once the ring has wrapped, the oldest event is the one at count */
+    first = trace.count > trace.capacity ? trace.count - trace.capacity : 0;
+    t0 = trace.events[first % trace.capacity].time_ns;
+
+    fprintf(fp, "{\"traceEvents\": [");
+    for (i = first; i != trace.count; ++i)
+    {
+        const struct event* e = &trace.events[i % trace.capacity];
+        int                 j;
+
+        switch (e->type)
+        {
+            case EVENT_START:
+                write_thread_name(fp, &sep, e);
+                write_event(fp, &sep, "start", "i", e->task, e, t0);
+                continue;
+            case EVENT_PARK:
+                write_event(fp, &sep, "park", "i", e->task, e, t0);
+                continue;
+            case EVENT_WAKE:
+                write_event(fp, &sep, "wake", "i", e->task, e, t0);
+                continue;
+        }
+
+        /* Switches and ends close the slice of the task giving up control.
+         * Slices whose start was overwritten are dropped */
+        for (j = 0; j != open_count && open[j] != e->task; ++j)
+        {
+        }
+        if (j != open_count)
+        {
+            open[j] = open[--open_count];
+            write_event(fp, &sep, "run", "E", e->task, e, t0);
+        }
+        if (e->type == EVENT_END)
+            write_event(fp, &sep, "end", "i", e->task, e, t0);
+
+        /* ...and open one for the task getting control */
+        if (e->other != 0)
+        {
+            write_event(fp, &sep, "run", "B", e->other, e, t0);
+            if (open_count != MAX_OPEN)
+                open[open_count++] = e->other;
+        }
+    }
+    fprintf(fp, "\n], \"displayTimeUnit\": \"ns\"}\n");
+    return 0;
+}
+
+#else
+
+/* -------------------------------------------------------------------------- */
+int casync_trace_start(size_t capacity)
+{
+    (void)capacity;
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_stop(void)
+{
+}
+
+/* -------------------------------------------------------------------------- */
+int casync_trace_export(FILE* fp)
+{
+    (void)fp;
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+void casync_trace_free(void)
+{
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include "casync/casync.h"
+#include "check.h"
+
+#include <string.h>
+
+/*
+ * Stack arenas: stacks packed back to back without guard pages must not
+ * overlap, so what each co-routine keeps on its stack survives while all of
+ * them take turns. The same holds for the static API on memory of
+ * casync_stack_arena_map(), and after the arenas were released and mapped
+ * again.
+ */
+
+#define STACK_SIZE    (1024 * 32)
+#define TASKS         1000
+#define STATIC_TASKS  100
+#define PATTERN_BYTES 1024
+#define ROUNDS        3
+
+static int corrupted;
+
+/* -------------------------------------------------------------------------- */
+static int fill_and_yield(void* arg)
+{
+    /* Volatile, or the compiler would know it can't change */
+    volatile unsigned char pattern[PATTERN_BYTES];
+    unsigned char          id = (unsigned char)(size_t)arg;
+    int                    i;
+    int                    round;
+
+    for (i = 0; i != PATTERN_BYTES; ++i)
+        pattern[i] = id;
+    for (round = 0; round != ROUNDS; ++round)
+    {
+        casync_yield();
+        for (i = 0; i != PATTERN_BYTES; ++i)
+            if (pattern[i] != id)
+            {
+                corrupted++;
+                break;
+            }
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int start_dynamic(void* arg)
+{
+    struct casync_attr attr;
+    size_t             i;
+
+    (void)arg;
+    memset(&attr, 0, sizeof attr);
+    attr.stack_size = STACK_SIZE;
+    for (i = 0; i != TASKS; ++i)
+        casync_start_ex(&attr, fill_and_yield, (void*)i);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int start_static(void* arg)
+{
+    size_t i;
+
+    (void)arg;
+    for (i = 0; i != STATIC_TASKS; ++i)
+        casync_start_static(fill_and_yield, (void*)i);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int main(void)
+{
+    size_t size = (STATIC_TASKS + 1) * STACK_SIZE;
+    void*  stacks;
+    int    pass;
+
+    casync_stack_arena(CASYNC_ARENA_HUGE_PAGES | CASYNC_ARENA_NUMA_LOCAL);
+    for (pass = 0; pass != 2; ++pass)
+    {
+        /* The second pass takes the stacks the first one freed */
+        CHECK(casync_gather(1, start_dynamic, NULL) == 0);
+        CHECK(corrupted == 0);
+    }
+
+    /* Unmaps the arenas, so the next gather has to map them again */
+    casync_stack_cache_flush();
+    CHECK(casync_gather(1, start_dynamic, NULL) == 0);
+    CHECK(corrupted == 0);
+    casync_stack_arena(0);
+    casync_stack_cache_flush();
+
+    stacks = casync_stack_arena_map(size, CASYNC_ARENA_HUGE_PAGES);
+    CHECK(stacks != NULL);
+    if (stacks != NULL)
+    {
+        CHECK(
+            casync_gather_static(
+                casync_stack_pool_init_linear(
+                    stacks, STACK_SIZE, STATIC_TASKS + 1),
+                1,
+                start_static,
+                NULL) == 0);
+        CHECK(corrupted == 0);
+        casync_stack_arena_unmap(stacks, size);
+    }
+    return check_result();
+}
@@ -0,0 +1,182 @@
+#include "casync/casync.h"
+#include "check.h"
+
+#include <string.h>
+
+/*
+ * Checks the context switch backend against a recorded order of yields,
+ * gathers and nested gathers. Every backend has to produce the same order,
+ * since the scheduler is the same. Built once per backend, see
+ * CMakeLists.txt.
+ */
+
+#if defined(CASYNC_UCONTEXT)
+/* Two ucontext_t live on a suspended stack, which are 1K each on x86_64 and
+ * 4.5K on AArch64 */
+#    define SMALL_STACK_SIZE (1024 * 16)
+#else
+#    define SMALL_STACK_SIZE (1024 * 2)
+#endif
+#define ROUNDS 3
+
+struct order
+{
+    char   log[64];
+    size_t len;
+};
+
+struct logger
+{
+    struct order* order;
+    char          id;
+    int           return_code;
+};
+
+/* -------------------------------------------------------------------------- */
+static int log_yields(void* arg)
+{
+    struct logger* t = arg;
+    int            i;
+
+    for (i = 0; i != ROUNDS; ++i)
+    {
+        t->order->log[t->order->len++] = t->id;
+        casync_yield();
+    }
+    return t->return_code;
+}
+
+/* -------------------------------------------------------------------------- */
+static int log_nested(void* arg)
+{
+    struct logger* t = arg;
+    struct logger  inner[2];
+
+    inner[0].order = inner[1].order = t->order;
+    inner[0].id = 'x';
+    inner[1].id = 'y';
+    inner[0].return_code = 0;
+    inner[1].return_code = 5;
+
+    t->order->log[t->order->len++] = t->id;
+    if (casync_gather(2, log_yields, &inner[0], log_yields, &inner[1]) != 5)
+        return -1;
+    t->order->log[t->order->len++] = t->id;
+    return t->return_code;
+}
+
+/* -------------------------------------------------------------------------- */
+static int log_static_start(void* arg)
+{
+    struct logger*       t = arg;
+    static struct logger started;
+    int                  rc = log_yields(t);
+
+    /* By now, "a" returned its pool stack to the static gather */
+    started.order = t->order;
+    started.id = 'd';
+    started.return_code = 0;
+    casync_start(log_yields, &started);
+    return rc;
+}
+
+/* -------------------------------------------------------------------------- */
+static void check_scenario(
+    const char*               name,
+    int                       static_api,
+    const struct casync_attr* attr,
+    int (*function)(void*),
+    int                       expected_return_code,
+    const char*               expected_log)
+{
+    static size_t       stacks[3][SMALL_STACK_SIZE / sizeof(size_t)];
+    struct order        o;
+    struct logger       tasks[3];
+    struct casync_task* freelist;
+    int                 rc;
+    int                 i;
+
+    o.len = 0;
+    for (i = 0; i != 3; ++i)
+    {
+        tasks[i].order = &o;
+        tasks[i].id = (char)('a' + i);
+        tasks[i].return_code = i == 2 ? 7 : 0;
+    }
+
+    if (static_api)
+    {
+        /* Static API, whose stacks are set up the same way. They must never
+         * reach the stack cache, which would unmap them here */
+        freelist = casync_stack_pool_init_linear(stacks, sizeof(stacks[0]), 3);
+        rc = casync_gather_static(
+            freelist,
+            3,
+            log_yields,
+            &tasks[0],
+            function,
+            &tasks[1],
+            log_yields,
+            &tasks[2]);
+        casync_stack_cache_flush();
+    }
+    else if (attr != NULL)
+        rc = casync_gather_ex(
+            3,
+            attr,
+            log_yields,
+            &tasks[0],
+            attr,
+            function,
+            &tasks[1],
+            attr,
+            log_yields,
+            &tasks[2]);
+    else
+        rc = casync_gather(
+            3,
+            log_yields,
+            &tasks[0],
+            function,
+            &tasks[1],
+            log_yields,
+            &tasks[2]);
+
+    o.log[o.len] = '\0';
+    if (rc == expected_return_code && strcmp(o.log, expected_log) == 0)
+        return;
+
+    fprintf(
+        stderr,
+        "Scenario \"%s\" failed: returned %d, expected %d. Order was \"%s\", "
+        "expected \"%s\"\n",
+        name,
+        rc,
+        expected_return_code,
+        o.log,
+        expected_log);
+    check_failures++;
+}
+
+/* -------------------------------------------------------------------------- */
+int main(void)
+{
+    struct casync_attr shared;
+
+    /* Resolve the lazy binding of the clock now. The dynamic linker saves
+     * the full register state on the stack, which doesn't fit into the tiny
+     * stacks used here */
+    casync_clock_ns();
+
+    memset(&shared, 0, sizeof shared);
+    shared.shared_stack = 1;
+
+    check_scenario("yield", 0, NULL, log_yields, 7, "abcabcabc");
+    check_scenario(
+        "gather_static_start", 1, NULL, log_static_start, 7, "abcabcabcddd");
+    check_scenario("gather_static", 1, NULL, log_yields, 7, "abcabcabc");
+    check_scenario("nested_gather", 0, NULL, log_nested, 7, "abxycaxycaxycb");
+    check_scenario("shared_stack", 0, &shared, log_yields, 7, "abcabcabc");
+
+    return check_result();
+}
@@ -0,0 +1,173 @@
+#include "casync/casync.h"
+#include "casync/chan.h"
+#include "casync/sync.h"
+#include "check.h"
+
+#include <string.h>
+
+/*
+ * Cancellation and deadlines: a canceled co-routine is woken from whatever
+ * it waits on, including inside a nested gather, and every later wait fails
+ * the same way. Timeouts of co-routines and gathers cancel them once they
+ * pass, long before the sleeps they interrupt would have ended.
+ */
+
+#define MS        1000000ULL
+#define LONG_WAIT 10000
+
+static struct casync_chan* chan;
+static struct casync_mutex mutex = CASYNC_MUTEX_INIT;
+
+/* -------------------------------------------------------------------------- */
+static int sleep_long(void* arg)
+{
+    (void)arg;
+    return casync_sleep_ms(LONG_WAIT);
+}
+
+/* -------------------------------------------------------------------------- */
+static int sleep_twice(void* arg)
+{
+    (void)arg;
+    CHECK(casync_sleep_ms(LONG_WAIT) == CASYNC_ECANCELED);
+    CHECK(casync_canceled());
+    return casync_sleep_ms(LONG_WAIT);
+}
+
+/* -------------------------------------------------------------------------- */
+static int receive(void* arg)
+{
+    int item;
+
+    (void)arg;
+    return casync_chan_recv(chan, &item);
+}
+
+/* -------------------------------------------------------------------------- */
+static int lock(void* arg)
+{
+    int rc = casync_mutex_lock(&mutex);
+
+    (void)arg;
+    if (rc == 0)
+        casync_mutex_unlock(&mutex);
+    return rc;
+}
+
+/* -------------------------------------------------------------------------- */
+static int quick(void* arg)
+{
+    (void)arg;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int spin(void* arg)
+{
+    (void)arg;
+    while (!casync_canceled())
+        casync_yield();
+    return 5;
+}
+
+/* -------------------------------------------------------------------------- */
+static int nested(void* arg)
+{
+    (void)arg;
+    return casync_gather(2, sleep_long, NULL, sleep_long, NULL);
+}
+
+/* -------------------------------------------------------------------------- */
+static int idle_deadline(void* arg)
+{
+    (void)arg;
+    CHECK(casync_set_deadline(casync_clock_ns() + 20 * MS) == 0);
+    return casync_sleep_ms(LONG_WAIT);
+}
+
+/* -------------------------------------------------------------------------- */
+static int removed_deadline(void* arg)
+{
+    (void)arg;
+    CHECK(casync_set_deadline(casync_clock_ns() + 5 * MS) == 0);
+    CHECK(casync_set_deadline(0) == 0);
+    return casync_sleep_ms(20);
+}
+
+/* -------------------------------------------------------------------------- */
+static int cancel_after_start(int (*function)(void*))
+{
+    struct casync_handle* h = casync_start_joinable(NULL, function, NULL);
+
+    casync_sleep_ms(1);
+    casync_cancel(h);
+    return casync_join(h);
+}
+
+/* -------------------------------------------------------------------------- */
+static int check_cancel(void* arg)
+{
+    struct casync_attr    attr;
+    struct casync_handle* h;
+    struct casync_handle* waiting;
+    int                   item = 3;
+
+    (void)arg;
+    CHECK(cancel_after_start(sleep_long) == CASYNC_ECANCELED);
+    CHECK(cancel_after_start(sleep_twice) == CASYNC_ECANCELED);
+    CHECK(cancel_after_start(spin) == 5);
+    CHECK(cancel_after_start(nested) == CASYNC_ECANCELED);
+
+    chan = casync_chan_create(sizeof(int), 1);
+    CHECK(cancel_after_start(receive) == CASYNC_ECANCELED);
+    CHECK(casync_chan_send(chan, &item) == 0);
+    CHECK(casync_join(casync_start_joinable(NULL, receive, NULL)) == 0);
+    casync_chan_destroy(chan);
+
+    /* The canceled waiter leaves the queue, the next one gets the mutex */
+    CHECK(casync_mutex_lock(&mutex) == 0);
+    waiting = casync_start_joinable(NULL, lock, NULL);
+    h = casync_start_joinable(NULL, lock, NULL);
+    casync_yield();
+    casync_cancel(waiting);
+    casync_mutex_unlock(&mutex);
+    CHECK(casync_join(waiting) == CASYNC_ECANCELED);
+    CHECK(casync_join(h) == 0);
+
+    /* Canceling a co-routine that already returned does nothing */
+    h = casync_start_joinable(NULL, quick, NULL);
+    casync_yield();
+    casync_yield();
+    casync_cancel(h);
+    CHECK(casync_join(h) == 0);
+
+    memset(&attr, 0, sizeof attr);
+    attr.timeout_ns = 10 * MS;
+    CHECK(
+        casync_join(casync_start_joinable(&attr, sleep_long, NULL)) ==
+        CASYNC_ECANCELED);
+    CHECK(
+        casync_join(casync_start_joinable(NULL, idle_deadline, NULL)) ==
+        CASYNC_ECANCELED);
+    CHECK(
+        casync_join(casync_start_joinable(NULL, removed_deadline, NULL)) == 0);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int main(void)
+{
+    uint64_t start = casync_clock_ns();
+
+    CHECK(casync_gather(1, check_cancel, NULL) == 0);
+    CHECK(
+        casync_gather_timeout(
+            20 * MS, 3, sleep_long, NULL, nested, NULL, spin, NULL) ==
+        CASYNC_ECANCELED);
+    CHECK(casync_gather_timeout(1000 * MS, 1, quick, NULL) == 0);
+
+    /* Nothing waited for the long sleeps */
+    CHECK(casync_clock_ns() - start < LONG_WAIT * MS / 2);
+    CHECK(casync_set_deadline(casync_clock_ns()) == -1);
+    return check_result();
+}
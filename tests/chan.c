@@ -0,0 +1,136 @@
+#include "casync/chan.h"
+#include "check.h"
+
+/*
+ * Channels: every item arrives once and in order, through bounded and
+ * unbounded channels, sent and received one by one or in batches, and by a
+ * receiver in a nested gather. Closing wakes the receivers once the buffered
+ * items are gone.
+ */
+
+#define ITEMS 10000
+#define BATCH 37
+
+struct pipeline
+{
+    struct casync_chan* in;
+    struct casync_chan* out;
+    long                sum;
+    int                 in_order;
+};
+
+/* -------------------------------------------------------------------------- */
+static int produce(void* arg)
+{
+    struct pipeline* p = arg;
+    int              batch[BATCH];
+    int              i;
+
+    for (i = 0; i != ITEMS; ++i)
+        CHECK(casync_chan_send(p->in, &i) == 0);
+    for (i = 0; i != BATCH; ++i)
+        batch[i] = ITEMS + i;
+    CHECK(casync_chan_send_many(p->in, batch, BATCH) == BATCH);
+    casync_chan_close(p->in);
+    CHECK(casync_chan_send(p->in, &i) == -1);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int route(void* arg)
+{
+    struct pipeline* p = arg;
+    int              batch[64];
+    size_t           n;
+    size_t           i;
+
+    while ((n = casync_chan_recv_many(p->in, batch, 64)) > 0)
+    {
+        for (i = 0; i != n; ++i)
+            batch[i] *= 2;
+        CHECK(casync_chan_send_many(p->out, batch, n) == n);
+    }
+    casync_chan_close(p->out);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int consume(void* arg)
+{
+    struct pipeline* p = arg;
+    int              expected = 0;
+    int              item;
+
+    while (casync_chan_recv(p->out, &item) == 0)
+    {
+        if (item != expected)
+            p->in_order = 0;
+        expected += 2;
+        p->sum += item;
+    }
+    CHECK(casync_chan_recv(p->out, &item) == -1);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int consume_nested(void* arg)
+{
+    return casync_gather(1, consume, arg);
+}
+
+/* -------------------------------------------------------------------------- */
+static void check_pipeline(size_t in_capacity, size_t out_capacity)
+{
+    struct pipeline p;
+    long            expected = 0;
+    int             i;
+
+    p.in = casync_chan_create(sizeof(int), in_capacity);
+    p.out = casync_chan_create(sizeof(int), out_capacity);
+    p.sum = 0;
+    p.in_order = 1;
+    CHECK(p.in != NULL && p.out != NULL);
+
+    CHECK(
+        casync_gather(3, consume_nested, &p, route, &p, produce, &p) == 0);
+    for (i = 0; i != ITEMS + BATCH; ++i)
+        expected += 2L * i;
+    CHECK(p.sum == expected);
+    CHECK(p.in_order);
+
+    casync_chan_destroy(p.in);
+    casync_chan_destroy(p.out);
+}
+
+/* -------------------------------------------------------------------------- */
+static void check_outside_gather(void)
+{
+    struct casync_chan* chan = casync_chan_create(sizeof(int), 1);
+    int                 item = 5;
+
+    /* Buffered items move without waiting, anything else would have to */
+    CHECK(casync_chan_send(chan, &item) == 0);
+    CHECK(casync_chan_send(chan, &item) == -1);
+    item = 0;
+    CHECK(casync_chan_recv(chan, &item) == 0);
+    CHECK(item == 5);
+    CHECK(casync_chan_recv(chan, &item) == -1);
+
+    /* Closing keeps what was buffered */
+    CHECK(casync_chan_send(chan, &item) == 0);
+    casync_chan_close(chan);
+    CHECK(casync_chan_send(chan, &item) == -1);
+    CHECK(casync_chan_recv(chan, &item) == 0);
+    CHECK(casync_chan_recv_many(chan, &item, 1) == 0);
+    casync_chan_destroy(chan);
+}
+
+/* -------------------------------------------------------------------------- */
+int main(void)
+{
+    check_pipeline(8, 1);
+    check_pipeline(1, 8);
+    check_pipeline(0, 0);
+    check_outside_gather();
+    return check_result();
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * Assertions shared by the tests. Unlike assert(), they stay in release
+ * builds and don't stop at the first failure. Each test returns
+ * check_result() from main(), which CTest reports as a failure if any CHECK()
+ * failed.
+ */
+
+static int check_failures;
+
+#define CHECK(condition)                                                       \
+    do                                                                         \
+    {                                                                          \
+        if (!(condition))                                                      \
+        {                                                                      \
+            fprintf(                                                           \
+                stderr,                                                        \
+                "%s:%d: CHECK(%s) failed\n",                                   \
+                __FILE__,                                                      \
+                __LINE__,                                                      \
+                #condition);                                                   \
+            check_failures++;                                                  \
+        }                                                                      \
+    } while (0)
+
+/* -------------------------------------------------------------------------- */
+static int check_result(void)
+{
+    return check_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+#include "casync/casync.h"
+#include "check.h"
+
+/*
+ * Joinable co-routines: casync_join() returns the return value whether the
+ * co-routine finished before or after, casync_join_any() collects them in
+ * the order they finish, and detached co-routines still run to the end.
+ */
+
+#define JOINS 1000
+
+static int detached_ran;
+
+/* -------------------------------------------------------------------------- */
+static int sleep_return(void* arg)
+{
+    int ms = *(int*)arg;
+
+    casync_sleep_ms(ms);
+    return ms;
+}
+
+/* -------------------------------------------------------------------------- */
+static int return_arg(void* arg)
+{
+    return *(int*)arg;
+}
+
+/* -------------------------------------------------------------------------- */
+static int detached(void* arg)
+{
+    (void)arg;
+    casync_yield();
+    casync_yield();
+    detached_ran = 1;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int check_join(void* arg)
+{
+    static int            delays[3] = {30, 10, 20};
+    static int            values[JOINS];
+    struct casync_handle* h[3];
+    long                  sum = 0;
+    int                   rc;
+    int                   i;
+
+    (void)arg;
+
+    /* In the order they finish, not the order they were started */
+    for (i = 0; i != 3; ++i)
+        h[i] = casync_start_joinable(NULL, sleep_return, &delays[i]);
+    CHECK(casync_join_any(h, 3, &rc) == 1);
+    CHECK(rc == 10 && h[1] == NULL);
+    CHECK(casync_join_any(h, 3, &rc) == 2);
+    CHECK(rc == 20 && h[2] == NULL);
+    CHECK(casync_join_any(h, 3, NULL) == 0);
+    CHECK(h[0] == NULL);
+    CHECK(casync_join_any(h, 3, &rc) == -1);
+
+    /* Finished before the join */
+    values[0] = 5;
+    h[0] = casync_start_joinable(NULL, return_arg, &values[0]);
+    casync_yield();
+    casync_yield();
+    CHECK(casync_join(h[0]) == 5);
+
+    /* Both finish in the same round */
+    values[0] = 1;
+    values[1] = 2;
+    h[0] = casync_start_joinable(NULL, return_arg, &values[0]);
+    h[1] = casync_start_joinable(NULL, return_arg, &values[1]);
+    CHECK(casync_join_any(h, 2, &rc) == 0);
+    CHECK(rc == 1);
+    CHECK(casync_join_any(h, 2, &rc) == 1);
+    CHECK(rc == 2);
+
+    /* Handles are recycled */
+    for (i = 0; i != JOINS; ++i)
+    {
+        values[i] = i;
+        h[0] = casync_start_joinable(NULL, return_arg, &values[i]);
+        CHECK(h[0] != NULL);
+        sum += casync_join(h[0]);
+    }
+    CHECK(sum == (long)JOINS * (JOINS - 1) / 2);
+
+    casync_detach(casync_start_joinable(NULL, detached, NULL));
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int nested(void* arg)
+{
+    return casync_gather(1, check_join, arg);
+}
+
+/* -------------------------------------------------------------------------- */
+int main(void)
+{
+    /* The return values of joinable co-routines are not reported by the
+     * gather */
+    CHECK(casync_gather(1, nested, NULL) == 0);
+    CHECK(detached_ran);
+    return check_result();
+}
@@ -0,0 +1,93 @@
+#include "casync/casync.h"
+#include "check.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Submissions from another thread: each one runs exactly once, on the loop
+ * it was submitted to, in the order it was submitted, whether the loop is
+ * busy or asleep in the reactor. casync_loop_serve() returns once the loop
+ * was closed and everything submitted before was started. POSIX only, since
+ * the submitter is a pthread.
+ */
+
+#define SUBMISSIONS 20000
+#define BURST       1000
+
+struct server
+{
+    struct casync_loop* loop;
+    pthread_t           submitter;
+    volatile long       ran;
+    long                out_of_order;
+    long                wrong_loop;
+    int                 ids[SUBMISSIONS];
+};
+
+static struct server server;
+
+/* -------------------------------------------------------------------------- */
+static int job(void* arg)
+{
+    int id = *(int*)arg;
+
+    if (casync_loop_current() != server.loop)
+        server.wrong_loop++;
+    if (id != server.ran)
+        server.out_of_order++;
+    __atomic_store_n(&server.ran, server.ran + 1, __ATOMIC_SEQ_CST);
+
+    /* Keep the loop busy now and then, so later submissions find it awake */
+    if (id % 3 == 0)
+        casync_yield();
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static void* submit_all(void* arg)
+{
+    int i;
+
+    (void)arg;
+    for (i = 0; i != SUBMISSIONS; ++i)
+    {
+        server.ids[i] = i;
+        CHECK(casync_loop_submit(server.loop, job, &server.ids[i]) == 0);
+
+        /* Let the loop fall asleep, then the next submission has to wake
+         * it. If it didn't, this would wait forever */
+        if (i % BURST == BURST - 1)
+        {
+            while (__atomic_load_n(&server.ran, __ATOMIC_SEQ_CST) != i + 1)
+                usleep(100);
+            usleep(2000);
+        }
+    }
+    casync_loop_close(server.loop);
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+static int serve(void* arg)
+{
+    (void)arg;
+    server.loop = casync_loop_current();
+    CHECK(server.loop != NULL);
+    if (pthread_create(&server.submitter, NULL, submit_all, NULL) != 0)
+        return -1;
+    return casync_loop_serve();
+}
+
+/* -------------------------------------------------------------------------- */
+int main(void)
+{
+    CHECK(casync_loop_current() == NULL);
+    CHECK(casync_gather(1, serve, NULL) == 0);
+    pthread_join(server.submitter, NULL);
+
+    CHECK(server.ran == SUBMISSIONS);
+    CHECK(server.out_of_order == 0);
+    CHECK(server.wrong_loop == 0);
+    return check_result();
+}
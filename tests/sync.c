@@ -0,0 +1,173 @@
+#include "casync/sync.h"
+#include "check.h"
+
+/*
+ * Mutex, condition variable, semaphore and wait group: exclusion holds across
+ * yields, waiters are served first-come, first-served, and nobody is left
+ * waiting.
+ */
+
+#define LOCKERS      3
+#define LOCK_ROUNDS  100
+#define SEM_UNITS    2
+#define SEM_USERS    6
+#define COND_WAITERS 3
+
+struct state
+{
+    struct casync_mutex      mutex;
+    struct casync_cond       cond;
+    struct casync_sem        sem;
+    struct casync_wait_group wg;
+    int                      counter;
+    int                      inside;
+    int                      max_inside;
+    int                      order[SEM_USERS];
+    int                      ordered;
+    int                      ready;
+    int                      woken;
+};
+
+static struct state s;
+
+/* -------------------------------------------------------------------------- */
+static int lock_increment(void* arg)
+{
+    int i;
+    int value;
+
+    (void)arg;
+    for (i = 0; i != LOCK_ROUNDS; ++i)
+    {
+        /* Without exclusion, the other lockers would overwrite the counter
+         * while this one yields */
+        CHECK(casync_mutex_lock(&s.mutex) == 0);
+        value = s.counter;
+        casync_yield();
+        s.counter = value + 1;
+        casync_mutex_unlock(&s.mutex);
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int sem_use(void* arg)
+{
+    CHECK(casync_sem_acquire(&s.sem) == 0);
+    s.order[s.ordered++] = *(int*)arg;
+    if (++s.inside > s.max_inside)
+        s.max_inside = s.inside;
+    casync_yield();
+    casync_yield();
+    s.inside--;
+    casync_sem_release(&s.sem);
+    casync_wait_group_done(&s.wg);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int cond_wait(void* arg)
+{
+    (void)arg;
+    CHECK(casync_mutex_lock(&s.mutex) == 0);
+    while (!s.ready)
+        CHECK(casync_cond_wait(&s.cond, &s.mutex) == 0);
+    s.woken++;
+    casync_mutex_unlock(&s.mutex);
+    casync_wait_group_done(&s.wg);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int check_sem(void* arg)
+{
+    static int ids[SEM_USERS];
+    int        i;
+
+    (void)arg;
+    for (i = 0; i != SEM_USERS; ++i)
+    {
+        ids[i] = i;
+        casync_wait_group_add(&s.wg, 1);
+        casync_start(sem_use, &ids[i]);
+    }
+    CHECK(casync_wait_group_wait(&s.wg) == 0);
+    CHECK(s.inside == 0);
+    CHECK(s.max_inside == SEM_UNITS);
+    CHECK(s.ordered == SEM_USERS);
+    for (i = 0; i != s.ordered; ++i)
+        CHECK(s.order[i] == i);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+static int check_cond(void* arg)
+{
+    int i;
+
+    (void)arg;
+    for (i = 0; i != COND_WAITERS; ++i)
+    {
+        casync_wait_group_add(&s.wg, 1);
+        casync_start(cond_wait, NULL);
+    }
+    casync_yield();
+    casync_yield();
+    CHECK(s.woken == 0);
+
+    /* A signal without a change of the condition wakes one waiter, which
+     * goes back to waiting */
+    casync_cond_signal(&s.cond);
+    casync_yield();
+    CHECK(s.woken == 0);
+
+    CHECK(casync_mutex_lock(&s.mutex) == 0);
+    s.ready = 1;
+    casync_cond_broadcast(&s.cond);
+    casync_mutex_unlock(&s.mutex);
+    CHECK(casync_wait_group_wait(&s.wg) == 0);
+    CHECK(s.woken == COND_WAITERS);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+int main(void)
+{
+    casync_mutex_init(&s.mutex);
+    casync_cond_init(&s.cond);
+    casync_sem_init(&s.sem, SEM_UNITS);
+    casync_wait_group_init(&s.wg);
+
+    CHECK(
+        casync_gather(
+            LOCKERS + 1,
+            lock_increment,
+            NULL,
+            lock_increment,
+            NULL,
+            lock_increment,
+            NULL,
+            check_sem,
+            NULL) == 0);
+    CHECK(s.counter == LOCKERS * LOCK_ROUNDS);
+
+    CHECK(casync_gather(1, check_cond, NULL) == 0);
+
+    /* Outside of a gather, only what doesn't wait succeeds */
+    CHECK(casync_mutex_trylock(&s.mutex) == 0);
+    CHECK(casync_mutex_trylock(&s.mutex) == -1);
+    CHECK(casync_mutex_lock(&s.mutex) == -1);
+    casync_mutex_unlock(&s.mutex);
+    CHECK(casync_mutex_lock(&s.mutex) == 0);
+    casync_mutex_unlock(&s.mutex);
+
+    CHECK(casync_sem_tryacquire(&s.sem) == 0);
+    CHECK(casync_sem_tryacquire(&s.sem) == 0);
+    CHECK(casync_sem_tryacquire(&s.sem) == -1);
+    CHECK(casync_sem_acquire(&s.sem) == -1);
+    casync_sem_release(&s.sem);
+    casync_sem_release(&s.sem);
+
+    CHECK(casync_wait_group_wait(&s.wg) == 0);
+    return check_result();
+}
@@ -0,0 +1,92 @@
+#include "casync/io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WOULD_BLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+
+/*
+ * Runs the operation through the reactor, if it supports asynchronous system
+ * calls. Non-blocking file descriptors may still report EAGAIN, in which case
+ * we wait until they are ready and try again.
+ */
+static int io_submit(struct casync_io_op* op, int events, ssize_t* rc)
+{
+    int result;
+    while (casync_io_submit(op, &result) == 0)
+    {
+        if (result == -EAGAIN)
+        {
+            if (casync_wait_fd(op->fd, events) >= 0)
+                continue;
+            result = -errno;
+        }
+        if (result < 0)
+        {
+            errno = -result;
+            *rc = -1;
+        }
+        else
+            *rc = result;
+        return 0;
+    }
+
+    return -1;
+}
+
+ssize_t casync_read(int fd, void* buf, size_t len)
+{
+    struct casync_io_op op;
+    ssize_t             rc;
+
+    memset(&op, 0, sizeof op);
+    op.opcode = CASYNC_OP_READ;
+    op.fd = fd;
+    op.buf = buf;
+    op.len = len;
+    if (io_submit(&op, CASYNC_READ, &rc) == 0)
+        return rc;
+
+    while ((rc = read(fd, buf, len)) == -1 && WOULD_BLOCK())
+        if (casync_wait_fd(fd, CASYNC_READ) < 0)
+            return -1;
+    return rc;
+}
+
+ssize_t casync_write(int fd, const void* buf, size_t len)
+{
+    struct casync_io_op op;
+    ssize_t             rc;
+
+    memset(&op, 0, sizeof op);
+    op.opcode = CASYNC_OP_WRITE;
+    op.fd = fd;
+    op.buf = (void*)buf;
+    op.len = len;
+    if (io_submit(&op, CASYNC_WRITE, &rc) == 0)
+        return rc;
+
+    while ((rc = write(fd, buf, len)) == -1 && WOULD_BLOCK())
+        if (casync_wait_fd(fd, CASYNC_WRITE) < 0)
+            return -1;
+    return rc;
+}
+
+int casync_openat(int dirfd, const char* path, int flags, mode_t mode)
+{
+    struct casync_io_op op;
+    ssize_t             rc;
+
+    memset(&op, 0, sizeof op);
+    op.opcode = CASYNC_OP_OPENAT;
+    op.fd = dirfd;
+    op.path = path;
+    op.flags = flags;
+    op.mode = mode;
+    if (io_submit(&op, 0, &rc) == 0)
+        return (int)rc;
+
+    return openat(dirfd, path, flags, mode);
+}
@@ -0,0 +1,117 @@
+#include "casync/net.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define WOULD_BLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+
+/*
+ * Runs the operation through the reactor, if it supports asynchronous system
+ * calls. Non-blocking sockets may still report EAGAIN, in which case we wait
+ * until they are ready and try again.
+ */
+static int io_submit(struct casync_io_op* op, int events, int* rc)
+{
+    int result;
+    while (casync_io_submit(op, &result) == 0)
+    {
+        if (result == -EAGAIN)
+        {
+            if (casync_wait_fd(op->fd, events) >= 0)
+                continue;
+            result = -errno;
+        }
+        if (result < 0)
+        {
+            errno = -result;
+            *rc = -1;
+        }
+        else
+            *rc = result;
+        return 0;
+    }
+
+    return -1;
+}
+
+int casync_recv(int fd, void* buf, size_t len, int flags)
+{
+    struct casync_io_op op;
+    int                 rc;
+
+    memset(&op, 0, sizeof op);
+    op.opcode = CASYNC_OP_RECV;
+    op.fd = fd;
+    op.buf = buf;
+    op.len = len;
+    op.flags = flags;
+    if (io_submit(&op, CASYNC_READ, &rc) == 0)
+        return rc;
+
+    while ((rc = recv(fd, buf, len, flags)) == -1 && WOULD_BLOCK())
+        if (casync_wait_fd(fd, CASYNC_READ) < 0)
+            return -1;
+    return rc;
+}
+
+int casync_send(int fd, const void* buf, size_t len, int flags)
+{
+    struct casync_io_op op;
+    int                 rc;
+
+    memset(&op, 0, sizeof op);
+    op.opcode = CASYNC_OP_SEND;
+    op.fd = fd;
+    op.buf = (void*)buf;
+    op.len = len;
+    op.flags = flags;
+    if (io_submit(&op, CASYNC_WRITE, &rc) == 0)
+        return rc;
+
+    while ((rc = send(fd, buf, len, flags)) == -1 && WOULD_BLOCK())
+        if (casync_wait_fd(fd, CASYNC_WRITE) < 0)
+            return -1;
+    return rc;
+}
+
+int casync_accept(int fd, struct sockaddr* addr, socklen_t* addr_len)
+{
+    struct casync_io_op op;
+    int                 rc;
+
+    memset(&op, 0, sizeof op);
+    op.opcode = CASYNC_OP_ACCEPT;
+    op.fd = fd;
+    op.addr = addr;
+    op.addr_len = addr_len;
+    if (io_submit(&op, CASYNC_READ, &rc) == 0)
+        return rc;
+
+    while ((rc = accept(fd, addr, addr_len)) == -1 && WOULD_BLOCK())
+        if (casync_wait_fd(fd, CASYNC_READ) < 0)
+            return -1;
+    return rc;
+}
+
+int casync_connect(int fd, const struct sockaddr* addr, socklen_t addr_len)
+{
+    int       error;
+    socklen_t error_len = sizeof error;
+
+    if (connect(fd, addr, addr_len) == 0)
+        return 0;
+    if (errno != EINPROGRESS)
+        return -1;
+
+    if (casync_wait_fd(fd, CASYNC_WRITE) < 0)
+        return -1;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0)
+        return -1;
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
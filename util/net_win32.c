@@ -0,0 +1,57 @@
+#include "casync/net.h"
+
+#define WOULD_BLOCK()                                                          \
+    (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINPROGRESS)
+
+int casync_recv(int fd, void* buf, size_t len, int flags)
+{
+    int rc;
+    while ((rc = recv(fd, buf, (int)len, flags)) == SOCKET_ERROR &&
+           WOULD_BLOCK())
+        if (casync_wait_fd(fd, CASYNC_READ) < 0)
+            return -1;
+    return rc;
+}
+
+int casync_send(int fd, const void* buf, size_t len, int flags)
+{
+    int rc;
+    while ((rc = send(fd, buf, (int)len, flags)) == SOCKET_ERROR &&
+           WOULD_BLOCK())
+        if (casync_wait_fd(fd, CASYNC_WRITE) < 0)
+            return -1;
+    return rc;
+}
+
+int casync_accept(int fd, struct sockaddr* addr, socklen_t* addr_len)
+{
+    SOCKET rc;
+    while ((rc = accept(fd, addr, addr_len)) == INVALID_SOCKET &&
+           WOULD_BLOCK())
+        if (casync_wait_fd(fd, CASYNC_READ) < 0)
+            return -1;
+    return rc == INVALID_SOCKET ? -1 : (int)rc;
+}
+
+int casync_connect(int fd, const struct sockaddr* addr, socklen_t addr_len)
+{
+    int error;
+    int error_len = sizeof error;
+
+    if (connect(fd, addr, addr_len) == 0)
+        return 0;
+    if (!WOULD_BLOCK())
+        return -1;
+
+    if (casync_wait_fd(fd, CASYNC_WRITE) < 0)
+        return -1;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&error, &error_len) != 0)
+        return -1;
+    if (error != 0)
+    {
+        WSASetLastError(error);
+        return -1;
+    }
+
+    return 0;
+}
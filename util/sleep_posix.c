@@ -1,24 +1,33 @@
 #include "casync/casync.h"
-#include <time.h>
+
+#include <errno.h>
 #include <stdint.h>
+#include <time.h>
 
 static uint64_t ts_to_ns(struct timespec ts)
 {
     return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
 }
 
-void casync_sleep_ns(uint64_t ns)
+uint64_t casync_clock_ns(void)
 {
-    uint64_t        now, wait_until;
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    wait_until = ts_to_ns(ts) + ns;
+    return ts_to_ns(ts);
+}
 
-    do
+int casync_sleep_ns(uint64_t ns)
+{
+    struct timespec ts;
+    int             rc = casync_timer_wait(casync_clock_ns() + ns);
+    if (rc != -1)
+        return rc;
+
+    /* Not inside casync_gather(), block the thread instead */
+    ts.tv_sec = (time_t)(ns / 1000000000);
+    ts.tv_nsec = (long)(ns % 1000000000);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
     {
-        casync_yield();
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        now = ts_to_ns(ts);
-    } while (now < wait_until);
+    }
+    return 0;
 }
-
@@ -3,19 +3,25 @@
 #define WIN32_LEAN_AND_MEAN
 #include "windows.h"
 
-void casync_sleep_ns(uint64_t ns)
+uint64_t casync_clock_ns(void)
 {
-    uint64_t now, wait_until;
     LARGE_INTEGER freq, ticks;
     QueryPerformanceCounter(&ticks);
     QueryPerformanceFrequency(&freq);
-    now = ticks.QuadPart;
-    wait_until = now + ns / freq.QuadPart;
 
-    do
-    {
-        casync_yield();
-        QueryPerformanceCounter(&ticks);
-        now = ticks.QuadPart;
-    } while (now < wait_until);
+    /* Split to avoid overflowing when multiplying */
+    return (uint64_t)(ticks.QuadPart / freq.QuadPart) * 1000000000 +
+           (uint64_t)(ticks.QuadPart % freq.QuadPart) * 1000000000 /
+               freq.QuadPart;
+}
+
+int casync_sleep_ns(uint64_t ns)
+{
+    int rc = casync_timer_wait(casync_clock_ns() + ns);
+    if (rc != -1)
+        return rc;
+
+    /* Not inside casync_gather(), block the thread instead */
+    Sleep((DWORD)((ns + 999999) / 1000000));
+    return 0;
 }